@@ -1,18 +1,27 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <mutex>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <future>
 #include <sstream>
 #include <map>
 #include <string>
+#include <thread>
 #include <stdexcept>
 #include <random>
 #include <regex>
 #include <vector>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "ggml.h"
 #include "ggml-backend.h"
 #include "ggml-alloc.h"
@@ -24,6 +33,33 @@
 #define NORM_EPS 1e-5f
 
 
+// compare two ranges of n bytes of a file, by chunks
+static bool biogpt_file_ranges_equal(
+            std::ifstream & fin,
+       const std::streamoff   a,
+       const std::streamoff   b,
+             const size_t   n) {
+    const size_t chunk = 1 << 20;
+
+    std::vector<char> buf_a(std::min(n, chunk));
+    std::vector<char> buf_b(std::min(n, chunk));
+
+    for (size_t off = 0; off < n; off += chunk) {
+        const size_t len = std::min(chunk, n - off);
+
+        fin.seekg(a + (std::streamoff) off);
+        fin.read(buf_a.data(), len);
+        fin.seekg(b + (std::streamoff) off);
+        fin.read(buf_b.data(), len);
+
+        if (!fin || memcmp(buf_a.data(), buf_b.data(), len) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool biogpt_model_load(
         const std::string & fname,
              biogpt_model & model,
@@ -164,53 +200,76 @@ bool biogpt_model_load(
         return false;
     }
 
-    auto & ctx = model.ctx;
-
-    size_t buffer_size  = 0;
+    // the type of each tensor, read from the tensor headers: a quantized model may store some of
+    // the weights in another type than wtype (e.g. the rows that do not fit the k-quant super-blocks)
+    std::map<std::string, ggml_type> tensor_types;
+    std::map<std::string, std::pair<std::streamoff, size_t>> tensor_data;  // offset and size in the file
 
-    // Evaluating context size
+    const std::streampos data_start = infile.tellg();
     {
-        const auto & hparams = model.hparams;
-
-        const int n_vocab     = hparams.n_vocab;
-        const int d_ff        = hparams.d_ff;
-        const int d_model     = hparams.d_model;
-        const int n_layer     = hparams.n_layer;
-        const int n_positions = hparams.n_positions;
+        while (true) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ttype;
 
-        buffer_size += n_vocab*d_model*ggml_type_size(wtype);  // lm_head
+            read_safe(infile, n_dims);
+            read_safe(infile, length);
+            read_safe(infile, ttype);
 
-        // decoder
-        {
-            buffer_size +=     n_vocab*d_model*ggml_type_size(wtype);          // embed_tokens
-            buffer_size += (d_model+2)*d_model*ggml_type_size(wtype);          // embed_pos
-            buffer_size +=           2*d_model*ggml_type_size(wtype);          // final_ln (weights and biases)
-        }
+            if (infile.eof()) {
+                break;
+            }
 
-        // decoder layers
-        {
-            buffer_size += 4*n_layer*(d_model*d_model*ggml_type_size(wtype));  // att projection weights
-            buffer_size += 4*n_layer*(d_model*ggml_type_size(GGML_TYPE_F32));  // att projection biases
+            int64_t nelements = 1;
+            for (int i = 0; i < n_dims; i++) {
+                int32_t ne;
+                read_safe(infile, ne);
+                nelements *= ne;
+            }
 
-            buffer_size += 4*n_layer*(d_model*ggml_type_size(GGML_TYPE_F32));  // layer norm weights and biases
+            std::string name(length, 0);
+            infile.read(&name[0], length);
 
-            buffer_size += 2*n_layer*(d_ff*d_model*ggml_type_size(wtype));     // ff weights
+            if (ttype < 0 || ttype >= GGML_TYPE_COUNT) {
+                fprintf(stderr, "%s: tensor '%s' has invalid type %d in model file\n", __func__, name.c_str(), ttype);
+                return false;
+            }
 
-            buffer_size += n_layer*(d_ff*ggml_type_size(GGML_TYPE_F32));       // ff bias
-            buffer_size += n_layer*(d_model*ggml_type_size(GGML_TYPE_F32));    // ff bias
+            tensor_types[name] = (ggml_type) ttype;
 
-            buffer_size += n_positions*n_layer*d_model*ggml_type_sizef(GGML_TYPE_F32); // memory_k
-            buffer_size += n_positions*n_layer*d_model*ggml_type_sizef(GGML_TYPE_F32); // memory_v
+            const size_t nbytes = nelements*ggml_type_size((ggml_type) ttype)/ggml_blck_size((ggml_type) ttype);
+            tensor_data[name] = std::make_pair((std::streamoff) infile.tellg(), nbytes);
+            infile.seekg(nbytes, std::ios::cur);
         }
 
-        buffer_size += (4 + 18*n_layer)*128; // alignment overhead
+        infile.clear();
+        infile.seekg(data_start);
+    }
 
-        if (verbosity > 0) {
-            printf("%s: ggml tensor size    = %d bytes\n", __func__, (int) sizeof(ggml_tensor));
-            printf("%s: backend buffer size = %6.2f MB\n", __func__, buffer_size/(1024.0*1024.0));
+    // BioGPT ties the lm head to the token embeddings: newer model files do not store it, older ones store
+    // an identical copy, which is skipped so that both share the tensor of the embeddings
+    {
+        const auto it_embd = tensor_data.find("biogpt.embed_tokens.weight");
+        const auto it_head = tensor_data.find("output_projection.weight");
+
+        if (it_embd != tensor_data.end() && it_head == tensor_data.end()) {
+            model.tied_lm_head = true;
+        } else if (it_embd != tensor_data.end() && it_head != tensor_data.end() &&
+                   tensor_types[it_embd->first] == tensor_types[it_head->first] &&
+                   it_embd->second.second == it_head->second.second) {
+            model.tied_lm_head = biogpt_file_ranges_equal(infile, it_embd->second.first, it_head->second.first, it_embd->second.second);
+
+            infile.clear();
+            infile.seekg(data_start);
+        }
+
+        if (model.tied_lm_head && verbosity > 0) {
+            fprintf(stderr, "%s: lm head tied to the token embeddings\n", __func__);
         }
     }
 
+    auto & ctx = model.ctx;
+
     // create the ggml context
     {
         size_t n_tensors = 4 + 18*model.hparams.n_layer;
@@ -227,20 +286,6 @@ bool biogpt_model_load(
         }
     }
 
-    if (!model.backend) {
-        // fallback to CPU backend
-        fprintf(stderr, "%s: using CPU backend\n", __func__);
-        model.backend = ggml_backend_cpu_init();
-    }
-
-    if (!model.backend) {
-        fprintf(stderr, "%s: ggml_backend_cpu_init() failed\n", __func__);
-        return false;
-    }
-
-    // allocate weights buffer
-    model.buffer_w = ggml_backend_alloc_buffer(model.backend, buffer_size);
-
     // prepare memory for the weights
     {
         const auto & hparams = model.hparams;
@@ -252,111 +297,89 @@ bool biogpt_model_load(
 
         model.layers_decoder.resize(n_layer);
 
-        // global
-        {
-            model.lm_head = ggml_new_tensor_2d(ctx, wtype, d_model, n_vocab);
-            model.tensors["output_projection.weight"] = model.lm_head;
-        }
+        // the matrices take the type stored in the model file, wtype if they are missing from it
+        auto new_weight = [&](const std::string & name, int ne0, int ne1) {
+            const auto it = tensor_types.find(name);
+            struct ggml_tensor * tensor = ggml_new_tensor_2d(ctx, it != tensor_types.end() ? it->second : wtype, ne0, ne1);
+            model.tensors[name] = tensor;
+            return tensor;
+        };
+
+        auto new_vector = [&](const std::string & name, int ne0) {
+            struct ggml_tensor * tensor = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+            model.tensors[name] = tensor;
+            return tensor;
+        };
 
         // decoder
         {
-            model.embed_tokens = ggml_new_tensor_2d(ctx, wtype, d_model, n_vocab);
-            model.embed_pos    = ggml_new_tensor_2d(ctx, wtype, d_model, d_model+2);
-            model.ln_w         = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
-            model.ln_b         = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
-
-            model.tensors["biogpt.embed_tokens.weight"]     = model.embed_tokens;
-            model.tensors["biogpt.embed_positions.weight"]  = model.embed_pos;
-            model.tensors["biogpt.layer_norm.weight"]       = model.ln_w;
-            model.tensors["biogpt.layer_norm.bias"]         = model.ln_b;
+            model.embed_tokens = new_weight("biogpt.embed_tokens.weight",    d_model, n_vocab);
+            model.embed_pos    = new_weight("biogpt.embed_positions.weight", d_model, d_model+2);
+            model.ln_w         = new_vector("biogpt.layer_norm.weight",      d_model);
+            model.ln_b         = new_vector("biogpt.layer_norm.bias",        d_model);
 
             for (int i = 0; i < n_layer; i++) {
                 auto & layer = model.layers_decoder[i];
 
-                layer.q_proj_w = ggml_new_tensor_2d(ctx, wtype, d_model, d_model);
-                layer.k_proj_w = ggml_new_tensor_2d(ctx, wtype, d_model, d_model);
-                layer.v_proj_w = ggml_new_tensor_2d(ctx, wtype, d_model, d_model);
-                layer.o_proj_w = ggml_new_tensor_2d(ctx, wtype, d_model, d_model);
-
-                layer.q_proj_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
-                layer.k_proj_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
-                layer.v_proj_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
-                layer.o_proj_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
+                const std::string prefix = "biogpt.layers." + std::to_string(i);
 
-                layer.ln_0_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
-                layer.ln_1_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
+                layer.q_proj_w = new_weight(prefix + ".self_attn.q_proj.weight",   d_model, d_model);
+                layer.k_proj_w = new_weight(prefix + ".self_attn.k_proj.weight",   d_model, d_model);
+                layer.v_proj_w = new_weight(prefix + ".self_attn.v_proj.weight",   d_model, d_model);
+                layer.o_proj_w = new_weight(prefix + ".self_attn.out_proj.weight", d_model, d_model);
 
-                layer.ln_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
-                layer.ln_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
+                layer.q_proj_b = new_vector(prefix + ".self_attn.q_proj.bias",   d_model);
+                layer.k_proj_b = new_vector(prefix + ".self_attn.k_proj.bias",   d_model);
+                layer.v_proj_b = new_vector(prefix + ".self_attn.v_proj.bias",   d_model);
+                layer.o_proj_b = new_vector(prefix + ".self_attn.out_proj.bias", d_model);
 
-                layer.fc_0_w = ggml_new_tensor_2d(ctx, wtype, d_model, d_ff);
-                layer.fc_1_w = ggml_new_tensor_2d(ctx, wtype, d_ff, d_model);
+                layer.ln_0_w = new_vector(prefix + ".self_attn_layer_norm.weight", d_model);
+                layer.ln_1_w = new_vector(prefix + ".final_layer_norm.weight",     d_model);
 
-                layer.fc_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_ff);
-                layer.fc_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, d_model);
+                layer.ln_0_b = new_vector(prefix + ".self_attn_layer_norm.bias", d_model);
+                layer.ln_1_b = new_vector(prefix + ".final_layer_norm.bias",     d_model);
 
-                model.tensors["biogpt.layers." + std::to_string(i) + ".self_attn.q_proj.weight"] = layer.q_proj_w;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".self_attn.v_proj.weight"] = layer.v_proj_w;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".self_attn.k_proj.weight"] = layer.k_proj_w;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".self_attn.out_proj.weight"] = layer.o_proj_w;
-
-                model.tensors["biogpt.layers." + std::to_string(i) + ".self_attn.q_proj.bias"] = layer.q_proj_b;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".self_attn.v_proj.bias"] = layer.v_proj_b;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".self_attn.k_proj.bias"] = layer.k_proj_b;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".self_attn.out_proj.bias"] = layer.o_proj_b;
-
-                model.tensors["biogpt.layers." + std::to_string(i) + ".self_attn_layer_norm.weight"] = layer.ln_0_w;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".self_attn_layer_norm.bias"] = layer.ln_0_b;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".final_layer_norm.weight"] = layer.ln_1_w;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".final_layer_norm.bias"] = layer.ln_1_b;
-
-                model.tensors["biogpt.layers." + std::to_string(i) + ".fc1.weight"] = layer.fc_0_w;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".fc2.weight"] = layer.fc_1_w;
-
-                model.tensors["biogpt.layers." + std::to_string(i) + ".fc1.bias"] = layer.fc_0_b;
-                model.tensors["biogpt.layers." + std::to_string(i) + ".fc2.bias"] = layer.fc_1_b;
+                layer.fc_0_w = new_weight(prefix + ".fc1.weight", d_model, d_ff);
+                layer.fc_1_w = new_weight(prefix + ".fc2.weight", d_ff,    d_model);
 
+                layer.fc_0_b = new_vector(prefix + ".fc1.bias", d_ff);
+                layer.fc_1_b = new_vector(prefix + ".fc2.bias", d_model);
             }
         }
+
+        // lm head
+        {
+            model.lm_head = model.tied_lm_head ? model.embed_tokens : new_weight("output_projection.weight", d_model, n_vocab);
+        }
     }
 
-    // key + value memory
+    // the weights buffer holds every tensor at its own type, plus the alignment overhead
+    size_t buffer_size = 0;
     {
-        const auto & hparams  = model.hparams;
-
-        const int d_model     = hparams.d_model;
-        const int n_layer     = hparams.n_layer;
-        const int n_positions = hparams.n_positions;
-
-        const int n_mem       = n_layer*n_positions;
-        const int n_elements  = n_mem*d_model;
-
-        model.memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_elements);
-        model.memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_elements);
-
-        const size_t memory_size = ggml_nbytes(model.memory_k) + ggml_nbytes(model.memory_v);
+        for (const auto & it : model.tensors) {
+            buffer_size += ggml_nbytes(it.second) + 128;
+        }
 
         if (verbosity > 0) {
-            printf("%s: memory size = %8.2f MB, n_mem = %d\n", __func__, memory_size/1024.0/1024.0, n_mem);
+            printf("%s: ggml tensor size    = %d bytes\n", __func__, (int) sizeof(ggml_tensor));
+            printf("%s: backend buffer size = %6.2f MB\n", __func__, buffer_size/(1024.0*1024.0));
         }
+    }
 
-        // create a backend buffer (can be in host or device memory)
-        model.buffer_kv = ggml_backend_alloc_buffer(model.backend, memory_size + 256);
-
-        // allocate the tensors into the backend buffer
-        {
-            ggml_allocr * alloc = ggml_allocr_new_from_buffer(model.buffer_kv);
-
-            // this updates the pointers in the tensors to point to the correct location in the buffer
-            // this is necessary since the ggml_context is .no_alloc == true
-            // note that the buffer can actually be a device buffer, depending on the backend
-            ggml_allocr_alloc(alloc, model.memory_k);
-            ggml_allocr_alloc(alloc, model.memory_v);
+    if (!model.backend) {
+        // fallback to CPU backend
+        fprintf(stderr, "%s: using CPU backend\n", __func__);
+        model.backend = ggml_backend_cpu_init();
+    }
 
-            ggml_allocr_free(alloc);
-        }
+    if (!model.backend) {
+        fprintf(stderr, "%s: ggml_backend_cpu_init() failed\n", __func__);
+        return false;
     }
 
+    // allocate weights buffer
+    model.buffer_w = ggml_backend_alloc_buffer(model.backend, buffer_size);
+
     // load weights
     {
         ggml_allocr * alloc = ggml_allocr_new_from_buffer(model.buffer_w);
@@ -391,6 +414,12 @@ bool biogpt_model_load(
             infile.read(&buf[0], buf.size());
             name.assign(&buf[0], buf.size());
 
+            // the copy of a tied lm head
+            if (model.tied_lm_head && name == "output_projection.weight") {
+                infile.seekg(tensor_data[name].second, std::ios::cur);
+                continue;
+            }
+
             if (model.tensors.find(name.data()) == model.tensors.end()) {
                 fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__, name.data());
                 return false;
@@ -409,6 +438,12 @@ bool biogpt_model_load(
                 return false;
             }
 
+            if (tensor->type != ggml_type(ftype)) {
+                fprintf(stderr, "%s: tensor '%s' has wrong type in model file: got %s, expected %s\n",
+                        __func__, name.data(), ggml_type_name(ggml_type(ftype)), ggml_type_name(tensor->type));
+                return false;
+            }
+
             const size_t bpe = ggml_type_size(ggml_type(ftype));
             if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
                 fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
@@ -427,7 +462,7 @@ bool biogpt_model_load(
             }
 
             if (verbosity > 0) {
-                printf("%48s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
+                printf("%48s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ggml_type_name(tensor->type), ggml_nbytes(tensor)/1024.0/1024.0);
             }
             total_size += ggml_nbytes(tensor);
             model.n_loaded++;
@@ -452,398 +487,3082 @@ bool biogpt_model_load(
     return true;
 }
 
+void biogpt_model_free(biogpt_model & model) {
+    ggml_free(model.ctx);
+
+    ggml_backend_buffer_free(model.buffer_w);
+    ggml_backend_free(model.backend);
+}
+
 //
-// quantization
+// context
 //
 
-void biogpt_model_quantize_internal(std::ifstream & fin, std::ofstream & fout, const ggml_ftype ftype) {
-    ggml_type qtype = GGML_TYPE_F32;
+biogpt_context * biogpt_context_init(
+         const biogpt_model & model,
+const biogpt_context_params & cparams) {
+    biogpt_context * ctx = new biogpt_context;
+
+    ctx->model   = &model;
+    ctx->cparams = cparams;
+
+    // a CPU backend only holds the number of threads and a work buffer: a fresh one per context
+    // makes the contexts independent, other backends are shared with the model
+    ctx->backend = ggml_backend_is_cpu(model.backend) ? ggml_backend_cpu_init() : model.backend;
+    if (!ctx->backend) {
+        fprintf(stderr, "%s: failed to initialize the backend\n", __func__);
+        biogpt_context_free(ctx);
+        return NULL;
+    }
 
-    switch (ftype) {
-        case GGML_FTYPE_MOSTLY_Q4_0: qtype = GGML_TYPE_Q4_0; break;
-        case GGML_FTYPE_MOSTLY_Q4_1: qtype = GGML_TYPE_Q4_1; break;
-        case GGML_FTYPE_MOSTLY_Q5_0: qtype = GGML_TYPE_Q5_0; break;
-        case GGML_FTYPE_MOSTLY_Q5_1: qtype = GGML_TYPE_Q5_1; break;
-        case GGML_FTYPE_MOSTLY_Q8_0: qtype = GGML_TYPE_Q8_0; break;
-        case GGML_FTYPE_UNKNOWN:
-        case GGML_FTYPE_ALL_F32:
-        case GGML_FTYPE_MOSTLY_F16:
-        case GGML_FTYPE_MOSTLY_Q4_1_SOME_F16:
-        case GGML_FTYPE_MOSTLY_Q2_K:
-        case GGML_FTYPE_MOSTLY_Q3_K:
-        case GGML_FTYPE_MOSTLY_Q4_K:
-        case GGML_FTYPE_MOSTLY_Q5_K:
-        case GGML_FTYPE_MOSTLY_Q6_K:
-                {
-                    fprintf(stderr, "%s: invalid model type %d\n", __func__, ftype);
-                    throw std::runtime_error("invalid model type");
-                }
-    };
+    // key + value memory
+    {
+        const auto & hparams  = model.hparams;
 
-    if (!ggml_is_quantized(qtype)) {
-        throw std::runtime_error("invalid quantization type");
-    }
+        const int d_model     = hparams.d_model;
+        const int n_layer     = hparams.n_layer;
+        const int n_positions = hparams.n_positions;
 
-    size_t total_size_org = 0;
-    size_t total_size_new = 0;
+        // in paged mode the memory is a pool of blocks shared by all the sequences, otherwise a
+        // single sequence of n_positions; both are laid out as [d_model, n_cells] per layer
+        auto & pool = ctx->kv_pool;
 
-    std::vector<float> work;
+        pool.n_blocks = std::max(0, cparams.n_kv_blocks);
 
-    std::vector<uint8_t>     data_u8;
-    std::vector<ggml_fp16_t> data_f16;
-    std::vector<float>       data_f32;
+        const int n_cells     = pool.n_blocks > 0 ? pool.n_blocks*pool.block_size : n_positions;
 
-    while (true) {
-        int32_t n_dims;
-        int32_t length;
-        int32_t ttype;
+        const int n_mem       = n_layer*n_cells;
+        const int n_elements  = n_mem*d_model;
 
-        read_safe(fin, n_dims);
-        read_safe(fin, length);
-        read_safe(fin, ttype);
+        pool.free_blocks.clear();
+        for (int i = pool.n_blocks - 1; i >= 0; i--) {
+            pool.free_blocks.push_back(i);
+        }
+        pool.ref_count.assign(pool.n_blocks, 0);
 
-        if (fin.eof()) {
-            break;
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ 2*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+
+        ctx->ctx_kv = ggml_init(params);
+        if (!ctx->ctx_kv) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            biogpt_context_free(ctx);
+            return NULL;
         }
 
-        int32_t nelements = 1;
-        int32_t ne[2] = {1, 1};
-        for (int i = 0; i < n_dims; i++) {
-            read_safe(fin, ne[i]);
-            nelements *= ne[i];
+        ctx->memory_k = ggml_new_tensor_1d(ctx->ctx_kv, GGML_TYPE_F32, n_elements);
+        ctx->memory_v = ggml_new_tensor_1d(ctx->ctx_kv, GGML_TYPE_F32, n_elements);
+
+        const size_t memory_size = ggml_nbytes(ctx->memory_k) + ggml_nbytes(ctx->memory_v);
+
+        if (cparams.verbosity > 0) {
+            fprintf(stderr, "%s: memory size = %8.2f MB, n_mem = %d\n", __func__, memory_size/1024.0/1024.0, n_mem);
+            if (pool.n_blocks > 0) {
+                fprintf(stderr, "%s: paged memory  = %d blocks of %d positions\n", __func__, pool.n_blocks, pool.block_size);
+            }
         }
 
-        std::string name;
-        std::vector<char> buf(length);
-        fin.read(&buf[0], buf.size());
-        name.assign(&buf[0], buf.size());
+        // create a backend buffer (can be in host or device memory)
+        ctx->buffer_kv = ggml_backend_alloc_buffer(ctx->backend, memory_size + 256);
 
-        printf("%64s - [%5d, %5d], type = %6s ", name.data(), ne[0], ne[1], ggml_type_name((ggml_type) ttype));
+        // allocate the tensors into the backend buffer
+        {
+            ggml_allocr * alloc = ggml_allocr_new_from_buffer(ctx->buffer_kv);
 
-        bool quantize = (name.find("weight") != std::string::npos) && (ne[1] != 1);
+            ggml_allocr_alloc(alloc, ctx->memory_k);
+            ggml_allocr_alloc(alloc, ctx->memory_v);
 
-        if (quantize) {
-            if (ttype != GGML_TYPE_F32 && ttype != GGML_TYPE_F16) {
-                throw std::runtime_error("unsupported ttype for integer quantization");
-            }
+            ggml_allocr_free(alloc);
+        }
+    }
 
-            if (ttype == GGML_TYPE_F16) {
-                data_f16.resize(nelements);
-                fin.read(reinterpret_cast<char *>(data_f16.data()), nelements * sizeof(ggml_fp16_t));
-                data_f32.resize(nelements);
-                for (int i = 0; i < nelements; ++i) {
-                    data_f32[i] = ggml_fp16_to_fp32(data_f16[i]);
-                }
-            } else {
-                data_f32.resize(nelements);
-                fin.read(reinterpret_cast<char *>(data_f32.data()), nelements * sizeof(float));
+    // compute buffer, measured on the largest batch of cparams at the end of the memory
+    {
+        // the graph only needs enough space to hold the ggml_tensor and ggml_cgraph structs, not the tensor data
+        ctx->buf_graph.resize(ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead());
+
+        const int n_positions = model.hparams.n_positions;
+        const int n_tokens    = std::min(n_positions, std::max(1, cparams.n_batch));
+        const int n_seq       = std::max(1, cparams.n_seq);
+
+        ctx->allocr = ggml_allocr_new_measure(ggml_backend_get_alignment(ctx->backend));
+
+        struct ggml_cgraph * gf = NULL;
+        if (ctx->kv_pool.n_blocks > 0) {
+            // n_seq full sequences sharing the tokens of the batch
+            std::vector<token_sequence>  embd(n_seq, token_sequence(1, 0));
+            std::vector<biogpt_kv_seq>   seqs_measure(n_seq);
+            std::vector<biogpt_kv_seq *> seqs;
+
+            embd[0].resize(std::max(1, n_tokens - (n_seq - 1)), 0);
+            for (int s = 0; s < n_seq; s++) {
+                seqs_measure[s].n_past = n_positions - embd[s].size();
+                seqs.push_back(&seqs_measure[s]);
             }
 
-            ttype = qtype;
+            gf = biogpt_graph_paged(*ctx, embd, seqs);
         } else {
-            const int bpe = (ttype == 0) ? sizeof(float) : sizeof(uint16_t);
-            data_u8.resize(nelements*bpe);
-            fin.read(reinterpret_cast<char *>(data_u8.data()), nelements*bpe);
+            gf = biogpt_graph(*ctx, token_sequence(n_tokens, 0), n_positions - n_tokens);
         }
 
-        write_safe(fout, n_dims);
-        write_safe(fout, length);
-        write_safe(fout, ttype);
+        const size_t mem_size = ggml_allocr_alloc_graph(ctx->allocr, gf);
 
-        for (int i = 0; i < n_dims; i++) {
-            write_safe(fout, ne[i]);
-        }
-
-        fout.write(&name[0], length);
-
-        if (quantize) {
-            work.resize(nelements);  // for quantization
-
-            size_t cur_size = 0;
-            std::vector<int64_t> hist_cur(1 << 4, 0);
-
-            switch ((ggml_type) ttype) {
-                case GGML_TYPE_Q4_0:
-                    {
-                        cur_size = ggml_quantize_q4_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q4_1:
-                    {
-                        cur_size = ggml_quantize_q4_1(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q5_0:
-                    {
-                        cur_size = ggml_quantize_q5_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q5_1:
-                    {
-                        cur_size = ggml_quantize_q5_1(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_Q8_0:
-                    {
-                        cur_size = ggml_quantize_q8_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
-                    } break;
-                case GGML_TYPE_F32:
-                case GGML_TYPE_F16:
-                case GGML_TYPE_I8:
-                case GGML_TYPE_I16:
-                case GGML_TYPE_I32:
-                case GGML_TYPE_Q8_1:
-                case GGML_TYPE_Q2_K:
-                case GGML_TYPE_Q3_K:
-                case GGML_TYPE_Q4_K:
-                case GGML_TYPE_Q5_K:
-                case GGML_TYPE_Q6_K:
-                case GGML_TYPE_Q8_K:
-                case GGML_TYPE_COUNT:
-                    {
-                        fprintf(stderr, "%s: unsupported quantization type %d (%s)\n", __func__, ttype, ggml_type_name((ggml_type) ttype));
-                        throw std::runtime_error("unsupported quantization type");
-                    }
-            }
+        ggml_allocr_free(ctx->allocr);
+        ctx->allocr = NULL;
 
-            fout.write(reinterpret_cast<char *>(work.data()), cur_size);
-            total_size_new += cur_size;
+        ctx->buffer_compute = ggml_backend_alloc_buffer(ctx->backend, mem_size);
+        ctx->allocr = ggml_allocr_new_from_buffer(ctx->buffer_compute);
 
-            printf("size = %8.2f MB -> %8.2f MB", nelements * sizeof(float)/1024.0/1024.0, cur_size/1024.0/1024.0);
-            printf("\n");
-        } else {
-            printf("size = %8.3f MB\n", data_u8.size()/1024.0/1024.0);
-            fout.write(reinterpret_cast<char *>(data_u8.data()), data_u8.size());
-            total_size_new += data_u8.size();
+        if (cparams.verbosity > 0) {
+            fprintf(stderr, "%s: compute buffer size: %.2f MB\n", __func__, mem_size/1024.0/1024.0);
         }
-
-        total_size_org += nelements * sizeof(float);
     }
 
-    printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
-    printf("%s: quant size  = %8.2f MB | ftype = %d (%s)\n", __func__, total_size_new/1024.0/1024.0, ftype, ggml_type_name(qtype));
+    return ctx;
 }
 
-// build the computation graph
-struct ggml_cgraph * biogpt_graph(
-            const biogpt_model & model,
-            struct ggml_allocr * allocr, 
-          const token_sequence & embed_inp,
-                     const int   n_past) {
-    const int N = embed_inp.size();
-
-    const auto & hparams = model.hparams;
+void biogpt_context_free(biogpt_context * ctx) {
+    if (ctx == NULL) {
+        return;
+    }
 
-    const int n_vocab     = hparams.n_vocab;
-    const int n_layer     = hparams.n_layer;
-    const int n_head      = hparams.n_head;
-    const int d_model     = hparams.d_model;
-    const int n_positions = hparams.n_positions;
+    if (ctx->allocr) {
+        ggml_allocr_free(ctx->allocr);
+    }
+    if (ctx->buffer_compute) {
+        ggml_backend_buffer_free(ctx->buffer_compute);
+    }
+    if (ctx->buffer_kv) {
+        ggml_backend_buffer_free(ctx->buffer_kv);
+    }
+    if (ctx->ctx_kv) {
+        ggml_free(ctx->ctx_kv);
+    }
+    if (ctx->backend && ctx->backend != ctx->model->backend) {
+        ggml_backend_free(ctx->backend);
+    }
 
-    const int d_kv        = d_model/n_head;
+    delete ctx;
+}
 
-    // since we are using ggml-alloc, this buffer only needs enough space to hold the ggml_tensor and ggml_cgraph structs, but not the tensor data
-    static size_t buf_size = ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead();
-    static std::vector<uint8_t> buf(buf_size);
+//
+// quantization
+//
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ buf_size,
-        /*.mem_buffer =*/ buf.data(),
-        /*.no_alloc   =*/ true, // the tensors will be allocated later by ggml_allocr_alloc_graph()
-    };
+// a tensor of the model file, read ahead of its quantization
+struct biogpt_quantize_tensor {
+    int32_t n_dims = 0;
+    int32_t ttype  = 0;
+    int32_t ne[2]  = { 1, 1 };
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    std::string name;
 
-    struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+    bool quantize = false;
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    ggml_allocr_alloc(allocr, embd);
+    std::vector<float>   data_f32;  // quantized tensors, converted to f32
+    std::vector<uint8_t> data_u8;   // tensors copied as is
+};
 
-    // avoid writing to tensors if we are only measuring the memory usage
-    if (!ggml_allocr_is_measure(allocr)) {
-        ggml_backend_tensor_set(embd, embed_inp.data(), 0, N*ggml_element_size(embd));
-    }
+// read the next tensor, false at the end of the file
+static bool biogpt_quantize_read_tensor(std::ifstream & fin, biogpt_quantize_tensor & tensor) {
+    int32_t length;
 
-    // token embeddings
-    struct ggml_tensor * embed_tokens = ggml_get_rows(ctx0, model.embed_tokens, embd);
-    embed_tokens = ggml_scale(ctx0, embed_tokens, ggml_new_f32(ctx0, sqrt(float(d_model))));
+    read_safe(fin, tensor.n_dims);
+    read_safe(fin, length);
+    read_safe(fin, tensor.ttype);
 
-    // position embeddings
-    struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    ggml_allocr_alloc(allocr, positions);
-    if (!ggml_allocr_is_measure(allocr)) {
-        for (int i = 0; i < N; ++i) {
-            int32_t v = n_past + i + 2;  // + 2 offset for BioGPT
-            ggml_backend_tensor_set(positions, &v, i*sizeof(int32_t), sizeof(v));
-        }
+    if (fin.eof()) {
+        return false;
     }
-    struct ggml_tensor * embed_positions = ggml_get_rows(ctx0, model.embed_pos, positions);
 
-    struct ggml_tensor * Q_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-    ggml_allocr_alloc(allocr, Q_scale);
-    if (!ggml_allocr_is_measure(allocr)) {
-        float s = 1.0f/sqrtf(float(d_kv));
-        ggml_backend_tensor_set(Q_scale, &s, 0, sizeof(s));
+    int32_t nelements = 1;
+    tensor.ne[0] = 1;
+    tensor.ne[1] = 1;
+    for (int i = 0; i < tensor.n_dims; i++) {
+        read_safe(fin, tensor.ne[i]);
+        nelements *= tensor.ne[i];
     }
 
-    // token embeddings + position embeddings
-    struct ggml_tensor * inpL = ggml_add(ctx0, embed_tokens, embed_positions);
+    std::vector<char> buf(length);
+    fin.read(&buf[0], buf.size());
+    tensor.name.assign(&buf[0], buf.size());
 
-    for (int layer_ix = 0; layer_ix < n_layer; ++layer_ix) {
-        struct ggml_tensor * current;
+    tensor.quantize = (tensor.name.find("weight") != std::string::npos) && (tensor.ne[1] != 1);
 
-        // self-attention layer norm
-        {
-            current = ggml_norm(ctx0, inpL, NORM_EPS);
-            current = ggml_add(
-                ctx0,
-                ggml_mul(
-                    ctx0,
-                    ggml_repeat(ctx0, model.layers_decoder[layer_ix].ln_0_w, current), current),
-                    ggml_repeat(ctx0, model.layers_decoder[layer_ix].ln_0_b, current)
-            );
+    if (tensor.quantize) {
+        if (tensor.ttype != GGML_TYPE_F32 && tensor.ttype != GGML_TYPE_F16) {
+            throw std::runtime_error("unsupported ttype for integer quantization");
         }
 
-        // self-attention
-        {
-            struct ggml_tensor * q_curr = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].q_proj_w, current);
-            q_curr = ggml_add(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].q_proj_b, q_curr), q_curr);
-            q_curr = ggml_reshape_3d(ctx0, q_curr, d_kv, n_head, N);
+        tensor.data_f32.resize(nelements);
+        if (tensor.ttype == GGML_TYPE_F16) {
+            std::vector<ggml_fp16_t> data_f16(nelements);
+            fin.read(reinterpret_cast<char *>(data_f16.data()), nelements * sizeof(ggml_fp16_t));
+            ggml_fp16_to_fp32_row(data_f16.data(), tensor.data_f32.data(), nelements);
+        } else {
+            fin.read(reinterpret_cast<char *>(tensor.data_f32.data()), nelements * sizeof(float));
+        }
+    } else {
+        const int bpe = (tensor.ttype == 0) ? sizeof(float) : sizeof(uint16_t);
+        tensor.data_u8.resize(nelements*bpe);
+        fin.read(reinterpret_cast<char *>(tensor.data_u8.data()), nelements*bpe);
+    }
 
-            // biogpt scales the query
-            q_curr = ggml_scale(ctx0, q_curr, Q_scale);
+    if (!fin) {
+        throw std::runtime_error("truncated model file");
+    }
 
-            struct ggml_tensor * k_curr = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].k_proj_w, current);
+    return true;
+}
+
+// whether the lm head stored in the tensors that follow is a copy of the token embeddings, in any order:
+// same type, same shape and the same bytes. The read position is restored
+static bool biogpt_quantize_find_tied_head(std::ifstream & fin) {
+    struct record {
+        int32_t        ttype = -1;
+        int32_t        ne[2] = { 1, 1 };
+        std::streamoff offset = 0;
+        size_t         nbytes = 0;
+    };
+
+    std::map<std::string, record> records;
+
+    const std::streampos data_start = fin.tellg();
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+
+        record rec;
+
+        read_safe(fin, n_dims);
+        read_safe(fin, length);
+        read_safe(fin, rec.ttype);
+
+        if (fin.eof() || n_dims < 0 || n_dims > 2 || length < 0 || rec.ttype < 0 || rec.ttype >= GGML_TYPE_COUNT) {
+            break;
+        }
+
+        int64_t nelements = 1;
+        for (int i = 0; i < n_dims; i++) {
+            read_safe(fin, rec.ne[i]);
+            nelements *= rec.ne[i];
+        }
+
+        std::string name(length, 0);
+        fin.read(&name[0], length);
+
+        rec.offset = fin.tellg();
+        rec.nbytes = nelements*ggml_type_size((ggml_type) rec.ttype)/ggml_blck_size((ggml_type) rec.ttype);
+
+        if (name == "biogpt.embed_tokens.weight" || name == "output_projection.weight") {
+            records[name] = rec;
+        }
+
+        fin.seekg(rec.nbytes, std::ios::cur);
+    }
+
+    bool tied = false;
+
+    const auto it_embd = records.find("biogpt.embed_tokens.weight");
+    const auto it_head = records.find("output_projection.weight");
+    if (it_embd != records.end() && it_head != records.end()) {
+        const record & embd = it_embd->second;
+        const record & head = it_head->second;
+
+        fin.clear();
+        tied = embd.ttype == head.ttype && embd.ne[0] == head.ne[0] && embd.ne[1] == head.ne[1] &&
+               biogpt_file_ranges_equal(fin, embd.offset, head.offset, embd.nbytes);
+    }
+
+    fin.clear();
+    fin.seekg(data_start);
+
+    return tied;
+}
+
+#define BIOGPT_QK4_0 32
+
+// layout of a Q4_0 block in ggml: the scale, then x[j] in the low and x[j + 16] in the high nibbles
+struct biogpt_block_q4_0 {
+    ggml_fp16_t d;
+    uint8_t     qs[BIOGPT_QK4_0/2];
+};
+
+static_assert(sizeof(biogpt_block_q4_0) == sizeof(ggml_fp16_t) + BIOGPT_QK4_0/2, "wrong q4_0 block size");
+
+// Q4_0 minimizing the rounding error weighted by the importance of each column: the scale of a block
+// is searched around the round-to-nearest one, with the least squares scale of each candidate rounding
+static void biogpt_quantize_q4_0_weighted(
+                  const float * src,
+                         void * dst,
+                    const int   n_rows,
+                    const int   n_per_row,
+                  const float * imp) {
+    const int nb = n_per_row/BIOGPT_QK4_0;
+
+    biogpt_block_q4_0 * y = (biogpt_block_q4_0 *) dst;
+
+    int8_t L[BIOGPT_QK4_0];
+    int8_t L_best[BIOGPT_QK4_0];
+
+    for (int r = 0; r < n_rows; r++) {
+        for (int ib = 0; ib < nb; ib++) {
+            const float * x = src + (int64_t) r*n_per_row + ib*BIOGPT_QK4_0;
+            const float * w = imp + ib*BIOGPT_QK4_0;
+
+            biogpt_block_q4_0 & block = y[(int64_t) r*nb + ib];
+
+            // the value of largest magnitude maps to -8, as in ggml
+            float amax = 0.0f;
+            float max  = 0.0f;
+            float sum_w = 0.0f;
+            for (int j = 0; j < BIOGPT_QK4_0; j++) {
+                if (fabsf(x[j]) > amax) {
+                    amax = fabsf(x[j]);
+                    max  = x[j];
+                }
+                sum_w += w[j];
+            }
+
+            if (amax == 0.0f) {
+                block.d = ggml_fp32_to_fp16(0.0f);
+                memset(block.qs, 0x88, sizeof(block.qs));
+                continue;
+            }
+
+            // columns never seen in the calibration keep a small weight
+            const float w_min = sum_w > 0.0f ? 1e-3f*sum_w/BIOGPT_QK4_0 : 1.0f;
+
+            float best_err = INFINITY;
+            float best_d   = max/-8;
+
+            for (int is = -9; is <= 9; is++) {
+                const float iscale = -(8.0f + 0.1f*is)/max;
+
+                float sum_xl = 0.0f;
+                float sum_ll = 0.0f;
+                for (int j = 0; j < BIOGPT_QK4_0; j++) {
+                    const int l = std::max(-8, std::min(7, (int) nearbyintf(iscale*x[j])));
+                    const float wj = std::max(w[j], w_min);
+
+                    L[j] = l;
+                    sum_xl += wj*x[j]*l;
+                    sum_ll += wj*l*l;
+                }
+
+                if (sum_ll == 0.0f) {
+                    continue;
+                }
+
+                const float d = sum_xl/sum_ll;
+
+                float err = 0.0f;
+                for (int j = 0; j < BIOGPT_QK4_0; j++) {
+                    const float diff = x[j] - d*L[j];
+                    err += std::max(w[j], w_min)*diff*diff;
+                }
+
+                if (err < best_err) {
+                    best_err = err;
+                    best_d   = d;
+                    memcpy(L_best, L, sizeof(L));
+                }
+            }
+
+            if (best_err == INFINITY) {
+                for (int j = 0; j < BIOGPT_QK4_0; j++) {
+                    L_best[j] = std::max(-8, std::min(7, (int) nearbyintf(x[j]/best_d)));
+                }
+            }
+
+            block.d = ggml_fp32_to_fp16(best_d);
+            for (int j = 0; j < BIOGPT_QK4_0/2; j++) {
+                block.qs[j] = (uint8_t) (L_best[j] + 8) | ((uint8_t) (L_best[j + BIOGPT_QK4_0/2] + 8) << 4);
+            }
+        }
+    }
+}
+
+// quantize the rows of a tensor, split across n_threads; returns the size of the result
+// with an importance per column, Q4_0 minimizes the weighted error instead of rounding to nearest
+static size_t biogpt_quantize_rows(
+              const ggml_type   qtype,
+                  const float * src,
+                         void * dst,
+                    const int   n_rows,
+                    const int   n_per_row,
+                    const int   n_threads,
+                  const float * imp = NULL) {
+    const int n_chunks = std::max(1, std::min(n_threads, n_rows));
+
+    std::vector<size_t>               sizes(n_chunks, 0);
+    std::vector<std::vector<int64_t>> hists(n_chunks, std::vector<int64_t>(1 << 4, 0));
+
+    // the chunks are whole rows, so that they start on a block boundary
+    auto worker = [&](const int ith) {
+        const int r0 = (int64_t) n_rows*ith/n_chunks;
+        const int r1 = (int64_t) n_rows*(ith + 1)/n_chunks;
+
+        if (imp && qtype == GGML_TYPE_Q4_0) {
+            const size_t row_size = n_per_row/BIOGPT_QK4_0*sizeof(biogpt_block_q4_0);
+
+            biogpt_quantize_q4_0_weighted(src + (int64_t) r0*n_per_row, (uint8_t *) dst + r0*row_size, r1 - r0, n_per_row, imp);
+            sizes[ith] = (r1 - r0)*row_size;
+        } else {
+            sizes[ith] = ggml_quantize_chunk(qtype, src, dst, r0*n_per_row, (r1 - r0)*n_per_row, hists[ith].data());
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int ith = 1; ith < n_chunks; ith++) {
+        workers.push_back(std::thread(worker, ith));
+    }
+    worker(0);
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    size_t size = 0;
+    for (auto s : sizes) {
+        size += s;
+    }
+
+    return size;
+}
+
+// the legacy type used for the matrices whose rows do not divide the k-quant super-blocks
+static ggml_type biogpt_quantize_fallback(const ggml_type qtype) {
+    switch (qtype) {
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_Q3_K: return GGML_TYPE_Q4_0;
+        case GGML_TYPE_Q4_K: return GGML_TYPE_Q5_0;
+        case GGML_TYPE_Q5_K: return GGML_TYPE_Q5_1;
+        case GGML_TYPE_Q6_K: return GGML_TYPE_Q8_0;
+        default:             return qtype;
+    }
+}
+
+// the types ggml_quantize_chunk can produce
+static bool biogpt_quantize_type_supported(const ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_Q3_K:
+        case GGML_TYPE_Q4_K:
+        case GGML_TYPE_Q5_K:
+        case GGML_TYPE_Q6_K:
+            return true;
+        default:
+            return false;
+    }
+}
+
+ggml_type biogpt_quantize_row_type(
+              const ggml_type   type,
+                    const int   n_per_row) {
+    if (!ggml_is_quantized(type) || n_per_row % ggml_blck_size(type) == 0) {
+        return type;
+    }
+
+    const ggml_type fallback = biogpt_quantize_fallback(type);
+
+    return n_per_row % ggml_blck_size(fallback) == 0 ? fallback : GGML_TYPE_F32;
+}
+
+size_t biogpt_convert_rows(
+              const ggml_type   type,
+                  const float * src,
+                         void * dst,
+                    const int   n_rows,
+                    const int   n_per_row,
+                    const int   n_threads) {
+    const int64_t n = (int64_t) n_rows*n_per_row;
+
+    switch (type) {
+        case GGML_TYPE_F32:
+            {
+                memcpy(dst, src, n*sizeof(float));
+                return n*sizeof(float);
+            }
+        case GGML_TYPE_F16:
+            {
+                ggml_fp32_to_fp16_row(src, (ggml_fp16_t *) dst, n);
+                return n*sizeof(ggml_fp16_t);
+            }
+        default:
+            {
+                GGML_ASSERT(biogpt_quantize_type_supported(type));
+                return biogpt_quantize_rows(type, src, dst, n_rows, n_per_row, n_threads);
+            }
+    }
+}
+
+static bool biogpt_quantize_type_from_name(const std::string & name, ggml_type & type) {
+    std::string lname = name;
+    std::transform(lname.begin(), lname.end(), lname.begin(), ::tolower);
+
+    for (int t = 0; t < GGML_TYPE_COUNT; t++) {
+        const char * tname = ggml_type_name((ggml_type) t);
+        if (tname == NULL) {
+            continue;
+        }
+
+        std::string ltname = tname;
+        std::transform(ltname.begin(), ltname.end(), ltname.begin(), ::tolower);
+
+        if (ltname == lname && (t == GGML_TYPE_F32 || t == GGML_TYPE_F16 || biogpt_quantize_type_supported((ggml_type) t))) {
+            type = (ggml_type) t;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool biogpt_quantize_policy_preset(
+                     const std::string & name,
+                             const int   n_layer,
+     std::vector<biogpt_quantize_rule> & rules) {
+    rules.clear();
+
+    if (name == "uniform") {
+        return true;
+    }
+
+    ggml_type type_embd;
+    if (name == "mixed") {
+        type_embd = GGML_TYPE_Q8_0;
+    } else if (name == "mixed-f16") {
+        type_embd = GGML_TYPE_F16;
+    } else {
+        return false;
+    }
+
+    // the embeddings, the lm head and the first and last layers are the most sensitive to
+    // the quantization error, the other layers take the type of the ftype
+    const std::string layers = "0|" + std::to_string(n_layer - 1);
+
+    auto add_rule = [&](const std::string & pattern, ggml_type type) {
+        biogpt_quantize_rule rule;
+        rule.pattern = pattern;
+        rule.type    = type;
+        rules.push_back(rule);
+    };
+
+    add_rule("biogpt\\.embed_tokens\\..*",                 type_embd);
+    add_rule("output_projection\\..*",                     type_embd);
+    add_rule("biogpt\\.layers\\.(" + layers + ")\\..*", GGML_TYPE_Q8_0);
+
+    return true;
+}
+
+bool biogpt_quantize_policy_load(
+                     const std::string & fname,
+     std::vector<biogpt_quantize_rule> & rules) {
+    std::ifstream fin(fname);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    rules.clear();
+
+    std::string line;
+    for (int n_line = 1; std::getline(fin, line); n_line++) {
+        const size_t pos = line.find('#');
+        if (pos != std::string::npos) {
+            line.resize(pos);
+        }
+
+        std::istringstream ss(line);
+
+        std::string pattern;
+        std::string type_name;
+        if (!(ss >> pattern)) {
+            continue;
+        }
+
+        biogpt_quantize_rule rule;
+        rule.pattern = pattern;
+
+        if (!(ss >> type_name) || !biogpt_quantize_type_from_name(type_name, rule.type)) {
+            fprintf(stderr, "%s: %s:%d: expected '<regex> <type>'\n", __func__, fname.c_str(), n_line);
+            return false;
+        }
+
+        try {
+            std::regex re(rule.pattern);
+        } catch (const std::regex_error & err) {
+            fprintf(stderr, "%s: %s:%d: invalid regex '%s': %s\n", __func__, fname.c_str(), n_line, pattern.c_str(), err.what());
+            return false;
+        }
+
+        rules.push_back(rule);
+    }
+
+    return true;
+}
+
+void biogpt_model_quantize_internal(
+            std::ifstream & fin,
+            std::ofstream & fout,
+         const ggml_ftype   ftype,
+                const int   n_threads,
+const std::vector<biogpt_quantize_rule> & rules,
+     const biogpt_calibration * calib) {
+    ggml_type qtype = GGML_TYPE_F32;
+
+    switch (ftype) {
+        case GGML_FTYPE_MOSTLY_Q4_0: qtype = GGML_TYPE_Q4_0; break;
+        case GGML_FTYPE_MOSTLY_Q4_1: qtype = GGML_TYPE_Q4_1; break;
+        case GGML_FTYPE_MOSTLY_Q5_0: qtype = GGML_TYPE_Q5_0; break;
+        case GGML_FTYPE_MOSTLY_Q5_1: qtype = GGML_TYPE_Q5_1; break;
+        case GGML_FTYPE_MOSTLY_Q8_0: qtype = GGML_TYPE_Q8_0; break;
+        case GGML_FTYPE_MOSTLY_Q2_K: qtype = GGML_TYPE_Q2_K; break;
+        case GGML_FTYPE_MOSTLY_Q3_K: qtype = GGML_TYPE_Q3_K; break;
+        case GGML_FTYPE_MOSTLY_Q4_K: qtype = GGML_TYPE_Q4_K; break;
+        case GGML_FTYPE_MOSTLY_Q5_K: qtype = GGML_TYPE_Q5_K; break;
+        case GGML_FTYPE_MOSTLY_Q6_K: qtype = GGML_TYPE_Q6_K; break;
+        case GGML_FTYPE_UNKNOWN:
+        case GGML_FTYPE_ALL_F32:
+        case GGML_FTYPE_MOSTLY_F16:
+        case GGML_FTYPE_MOSTLY_Q4_1_SOME_F16:
+                {
+                    fprintf(stderr, "%s: invalid model type %d\n", __func__, ftype);
+                    throw std::runtime_error("invalid model type");
+                }
+    };
+
+    if (!ggml_is_quantized(qtype)) {
+        throw std::runtime_error("invalid quantization type");
+    }
+
+    size_t total_size_org = 0;
+    size_t total_size_new = 0;
+    size_t total_size_q   = 0;  // f32 size of the quantized tensors
+
+    int64_t t_quantize_us = 0;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    std::vector<std::regex> rules_re;
+    for (const auto & rule : rules) {
+        rules_re.push_back(std::regex(rule.pattern));
+    }
+
+    // the first matching rule of the policy chooses the type
+    auto policy_type = [&](const std::string & name) -> ggml_type {
+        for (size_t i = 0; i < rules.size(); i++) {
+            if (std::regex_match(name, rules_re[i])) {
+                return rules[i].type;
+            }
+        }
+        return qtype;
+    };
+
+    // the lm head tied to the token embeddings is not written, the loader shares the embeddings
+    const bool tied_lm_head = biogpt_quantize_find_tied_head(fin);
+
+    if (tied_lm_head && policy_type("output_projection.weight") != policy_type("biogpt.embed_tokens.weight")) {
+        fprintf(stderr, "%s: warning: the lm head is tied to the token embeddings and takes their type (%s), "
+                "the policy type of output_projection.weight (%s) is ignored\n", __func__,
+                ggml_type_name(policy_type("biogpt.embed_tokens.weight")), ggml_type_name(policy_type("output_projection.weight")));
+    }
+
+    std::vector<uint8_t> work;
+    std::vector<float>   imp;
+
+    // the next tensor is read while the current one is quantized
+    biogpt_quantize_tensor cur;
+    biogpt_quantize_tensor next;
+
+    bool has_cur = biogpt_quantize_read_tensor(fin, cur);
+
+    while (has_cur) {
+        std::future<bool> has_next = std::async(std::launch::async, biogpt_quantize_read_tensor, std::ref(fin), std::ref(next));
+
+        if (tied_lm_head && cur.name == "output_projection.weight") {
+            printf("%64s - [%5d, %5d], tied to the token embeddings, skipped\n", cur.name.data(), cur.ne[0], cur.ne[1]);
+
+            has_cur = has_next.get();
+            std::swap(cur, next);
+            continue;
+        }
+
+        const int32_t nelements = cur.ne[0]*cur.ne[1];
+        const int32_t length    = cur.name.size();
+
+        const ggml_type rule_type = policy_type(cur.name);
+
+        // rows that do not fit the blocks of the type fall back to a type with smaller blocks, or stay in f32
+        const ggml_type cur_type = cur.quantize ? biogpt_quantize_row_type(rule_type, cur.ne[0]) : rule_type;
+
+        const int32_t ttype = cur.quantize ? (int32_t) cur_type : cur.ttype;
+
+        printf("%64s - [%5d, %5d], type = %6s ", cur.name.data(), cur.ne[0], cur.ne[1], ggml_type_name((ggml_type) cur.ttype));
+
+        write_safe(fout, cur.n_dims);
+        write_safe(fout, length);
+        write_safe(fout, ttype);
+
+        for (int i = 0; i < cur.n_dims; i++) {
+            write_safe(fout, cur.ne[i]);
+        }
+
+        fout.write(&cur.name[0], length);
+
+        if (cur.quantize && cur_type == GGML_TYPE_F32) {
+            if (rule_type == GGML_TYPE_F32) {
+                printf("size = %8.2f MB (f32)\n", nelements * sizeof(float)/1024.0/1024.0);
+            } else {
+                printf("size = %8.2f MB, kept in f32: row size %d is not a multiple of the block size\n",
+                        nelements * sizeof(float)/1024.0/1024.0, cur.ne[0]);
+            }
+            fout.write(reinterpret_cast<char *>(cur.data_f32.data()), nelements * sizeof(float));
+            total_size_new += nelements * sizeof(float);
+        } else if (cur.quantize && cur_type == GGML_TYPE_F16) {
+            std::vector<ggml_fp16_t> data_f16(nelements);
+            ggml_fp32_to_fp16_row(cur.data_f32.data(), data_f16.data(), nelements);
+
+            printf("size = %8.2f MB -> %8.2f MB (f16)\n", nelements * sizeof(float)/1024.0/1024.0, nelements * sizeof(ggml_fp16_t)/1024.0/1024.0);
+            fout.write(reinterpret_cast<char *>(data_f16.data()), nelements * sizeof(ggml_fp16_t));
+            total_size_new += nelements * sizeof(ggml_fp16_t);
+        } else if (cur.quantize) {
+            if (!biogpt_quantize_type_supported(cur_type)) {
+                fprintf(stderr, "%s: unsupported quantization type %d (%s)\n", __func__, cur_type, ggml_type_name(cur_type));
+                has_next.wait();
+                throw std::runtime_error("unsupported quantization type");
+            }
+
+            work.resize(nelements*sizeof(float));
+
+            // the mean squared input of each column, from the calibration
+            imp.clear();
+            if (calib && calib->n_tokens > 0 && cur_type == GGML_TYPE_Q4_0) {
+                const auto it = calib->sum_sq.find(cur.name);
+                if (it != calib->sum_sq.end() && (int) it->second.size() == cur.ne[0]) {
+                    for (double sum : it->second) {
+                        imp.push_back(sum/calib->n_tokens);
+                    }
+                }
+            }
+
+            const int64_t t_quantize_start_us = ggml_time_us();
+
+            const size_t cur_size = biogpt_quantize_rows(cur_type, cur.data_f32.data(), work.data(), cur.ne[1], cur.ne[0], n_threads,
+                    imp.empty() ? NULL : imp.data());
+
+            t_quantize_us += ggml_time_us() - t_quantize_start_us;
+
+            fout.write(reinterpret_cast<char *>(work.data()), cur_size);
+            total_size_new += cur_size;
+            total_size_q   += nelements*sizeof(float);
+
+            printf("size = %8.2f MB -> %8.2f MB", nelements * sizeof(float)/1024.0/1024.0, cur_size/1024.0/1024.0);
+            if (cur_type != rule_type) {
+                printf(" (%s fallback)", ggml_type_name(cur_type));
+            } else if (cur_type != qtype) {
+                printf(" (%s)", ggml_type_name(cur_type));
+            }
+            if (!imp.empty()) {
+                printf(" (importance)");
+            }
+            printf("\n");
+        } else {
+            printf("size = %8.3f MB\n", cur.data_u8.size()/1024.0/1024.0);
+            fout.write(reinterpret_cast<char *>(cur.data_u8.data()), cur.data_u8.size());
+            total_size_new += cur.data_u8.size();
+        }
+
+        total_size_org += nelements * sizeof(float);
+
+        has_cur = has_next.get();
+        std::swap(cur, next);
+    }
+
+    const int64_t t_total_us = ggml_time_us() - t_start_us;
+
+    printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
+    printf("%s: quant size  = %8.2f MB | ftype = %d (%s)\n", __func__, total_size_new/1024.0/1024.0, ftype, ggml_type_name(qtype));
+    printf("%s: quantized %.2f MB in %.2f s with %d threads: %.2f MB/s (%.2f MB/s including I/O)\n", __func__,
+            total_size_q/1024.0/1024.0, t_quantize_us/1e6, n_threads,
+            total_size_q/1024.0/1024.0/std::max(1e-6, t_quantize_us/1e6), total_size_q/1024.0/1024.0/std::max(1e-6, t_total_us/1e6));
+}
+
+// number of positions stored per layer in the key + value memory
+static int biogpt_kv_n_cells(const biogpt_context & ctx) {
+    const auto & pool = ctx.kv_pool;
+    return pool.n_blocks > 0 ? pool.n_blocks*pool.block_size : ctx.model->hparams.n_positions;
+}
+
+// host-side description of where a paged batch reads and writes its keys and values
+struct biogpt_kv_layout {
+    int n_kv = 0;
+
+    std::vector<int32_t> kv_cells;  // [n_kv] cells gathered for the attention
+    std::vector<float>   kq_mask;   // [n_kv, N] 0 if the token can attend the cell, -inf otherwise
+
+    // contiguous runs of input tokens written to contiguous cells: (first token, first cell, length)
+    std::vector<std::vector<int32_t>> runs;
+};
+
+static struct ggml_cgraph * biogpt_graph_build(
+                biogpt_context & ctx,
+          const token_sequence & embed_inp,
+    const std::vector<int32_t> & positions_inp,
+                     const int   n_past,
+        const biogpt_kv_layout * kv_layout,
+        const biogpt_eval_opts & opts) {
+    const int N = embed_inp.size();
+
+    const auto & model   = *ctx.model;
+    const auto & hparams = model.hparams;
+
+    struct ggml_allocr * allocr = ctx.allocr;
+
+    // a truncated pass skips the last decoder layers and goes straight to the final norm and lm head
+    const int n_layer     = opts.n_layer > 0 ? std::min(opts.n_layer, hparams.n_layer) : hparams.n_layer;
+    const int n_head      = hparams.n_head;
+    const int d_model     = hparams.d_model;
+
+    const int d_kv        = d_model/n_head;
+
+    // in paged mode, the attention gathers the cells of the batch through kv_layout
+    const bool paged      = kv_layout != NULL;
+
+    const int n_cells     = biogpt_kv_n_cells(ctx);
+    const int n_kv        = paged ? kv_layout->n_kv : n_past + N;
+
+    // since we are using ggml-alloc, this buffer only needs enough space to hold the ggml_tensor and ggml_cgraph structs, but not the tensor data
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ ctx.buf_graph.size(),
+        /*.mem_buffer =*/ ctx.buf_graph.data(),
+        /*.no_alloc   =*/ true, // the tensors will be allocated later by ggml_allocr_alloc_graph()
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    // profile: the nodes created since the last call are given to the current part, by walking back from
+    // the outputs of that part until the nodes that already have one
+    int part = 0;
+
+    ctx.graph_parts.clear();
+
+    auto set_part = [&](struct ggml_tensor * out) {
+        if (!ctx.profile) {
+            return;
+        }
+
+        std::vector<struct ggml_tensor *> stack = { out };
+        while (!stack.empty()) {
+            struct ggml_tensor * t = stack.back();
+            stack.pop_back();
+
+            if (!ctx.graph_parts.emplace(t, part).second) {
+                continue;
+            }
+
+            for (int j = 0; j < GGML_MAX_SRC && t->src[j]; j++) {
+                stack.push_back(t->src[j]);
+            }
+        }
+    };
+
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_allocr_alloc(allocr, embd);
+
+    // avoid writing to tensors if we are only measuring the memory usage
+    if (!ggml_allocr_is_measure(allocr)) {
+        ggml_backend_tensor_set(embd, embed_inp.data(), 0, N*ggml_element_size(embd));
+    }
+
+    // token embeddings
+    struct ggml_tensor * embed_tokens = ggml_get_rows(ctx0, model.embed_tokens, embd);
+    embed_tokens = ggml_scale(ctx0, embed_tokens, ggml_new_f32(ctx0, sqrt(float(d_model))));
+
+    // position embeddings
+    struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_allocr_alloc(allocr, positions);
+    if (!ggml_allocr_is_measure(allocr)) {
+        for (int i = 0; i < N; ++i) {
+            int32_t v = positions_inp[i] + 2;  // + 2 offset for BioGPT
+            ggml_backend_tensor_set(positions, &v, i*sizeof(int32_t), sizeof(v));
+        }
+    }
+    struct ggml_tensor * embed_positions = ggml_get_rows(ctx0, model.embed_pos, positions);
+
+    struct ggml_tensor * Q_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+    ggml_allocr_alloc(allocr, Q_scale);
+    if (!ggml_allocr_is_measure(allocr)) {
+        float s = 1.0f/sqrtf(float(d_kv));
+        ggml_backend_tensor_set(Q_scale, &s, 0, sizeof(s));
+    }
+
+    // paged memory: cells to gather and attention mask
+    struct ggml_tensor * kv_cells = NULL;
+    struct ggml_tensor * kq_mask  = NULL;
+    if (paged) {
+        kv_cells = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv);
+        ggml_allocr_alloc(allocr, kv_cells);
+
+        kq_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, N);
+        ggml_allocr_alloc(allocr, kq_mask);
+
+        if (!ggml_allocr_is_measure(allocr)) {
+            ggml_backend_tensor_set(kv_cells, kv_layout->kv_cells.data(), 0, ggml_nbytes(kv_cells));
+            ggml_backend_tensor_set(kq_mask,  kv_layout->kq_mask.data(),  0, ggml_nbytes(kq_mask));
+        }
+    }
+
+    // calibration: the sums of the squared inputs of a linear layer over the tokens, by input channel,
+    // are graph outputs read back by biogpt_calibration_collect
+    auto add_input_stats = [&](struct ggml_tensor * inp, const std::string & name) {
+        if (!ctx.cparams.calibration) {
+            return;
+        }
+
+        struct ggml_tensor * sum_sq = ggml_sum_rows(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, ggml_sqr(ctx0, inp))));
+        ggml_set_name(sum_sq, ("act_in." + name).c_str());
+        ggml_build_forward_expand(gf, sum_sq);
+        set_part(sum_sq);
+    };
+
+    // token embeddings + position embeddings
+    struct ggml_tensor * inpL = ggml_add(ctx0, embed_tokens, embed_positions);
+    set_part(inpL);
+
+    for (int layer_ix = 0; layer_ix < n_layer; ++layer_ix) {
+        part = layer_ix + 1;
+
+        struct ggml_tensor * current;
+
+        // self-attention layer norm
+        {
+            current = ggml_norm(ctx0, inpL, NORM_EPS);
+            ggml_set_name(current, "ln_0");
+            current = ggml_add(
+                ctx0,
+                ggml_mul(
+                    ctx0,
+                    ggml_repeat(ctx0, model.layers_decoder[layer_ix].ln_0_w, current), current),
+                    ggml_repeat(ctx0, model.layers_decoder[layer_ix].ln_0_b, current)
+            );
+        }
+
+        const std::string layer_name = std::to_string(layer_ix);
+
+        // self-attention
+        {
+            add_input_stats(current, layer_name + ".qkv");
+
+            struct ggml_tensor * q_curr = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].q_proj_w, current);
+            ggml_set_name(q_curr, "q_proj");
+            q_curr = ggml_add(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].q_proj_b, q_curr), q_curr);
+            q_curr = ggml_reshape_3d(ctx0, q_curr, d_kv, n_head, N);
+
+            // biogpt scales the query
+            q_curr = ggml_scale(ctx0, q_curr, Q_scale);
+
+            struct ggml_tensor * k_curr = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].k_proj_w, current);
+            ggml_set_name(k_curr, "k_proj");
             k_curr = ggml_add(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].k_proj_b, k_curr), k_curr);
             k_curr = ggml_reshape_3d(ctx0, k_curr, d_kv, n_head, N);
 
-            struct ggml_tensor * v_curr = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].v_proj_w, current);
-            v_curr = ggml_add(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].v_proj_b, v_curr), v_curr);
-            v_curr = ggml_reshape_3d(ctx0, v_curr, d_kv, n_head, N);
+            struct ggml_tensor * v_curr = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].v_proj_w, current);
+            ggml_set_name(v_curr, "v_proj");
+            v_curr = ggml_add(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].v_proj_b, v_curr), v_curr);
+            v_curr = ggml_reshape_3d(ctx0, v_curr, d_kv, n_head, N);
+
+            const size_t k_row_size = ggml_element_size(ctx.memory_k)*d_model;
+            const size_t v_row_size = ggml_element_size(ctx.memory_v)*d_model;
+
+            // key + value memory
+            if (!paged && N >= 1) {
+                struct ggml_tensor * k = ggml_view_1d(ctx0, ctx.memory_k, N*d_model, k_row_size*(layer_ix*n_cells + n_past));
+                struct ggml_tensor * v = ggml_view_1d(ctx0, ctx.memory_v, N*d_model, v_row_size*(layer_ix*n_cells + n_past));
+
+                struct ggml_tensor * k_store = ggml_cpy(ctx0, k_curr, k);
+                struct ggml_tensor * v_store = ggml_cpy(ctx0, v_curr, v);
+
+                ggml_build_forward_expand(gf, ggml_set_name(k_store, "k_store"));
+                ggml_build_forward_expand(gf, ggml_set_name(v_store, "v_store"));
+                set_part(k_store);
+                set_part(v_store);
+            } else if (paged) {
+                for (const auto & run : kv_layout->runs) {
+                    const int tok = run[0], cell = run[1], len = run[2];
+
+                    struct ggml_tensor * k_src = ggml_view_1d(ctx0, k_curr, len*d_model, tok*d_model*ggml_element_size(k_curr));
+                    struct ggml_tensor * v_src = ggml_view_1d(ctx0, v_curr, len*d_model, tok*d_model*ggml_element_size(v_curr));
+
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, ctx.memory_k, len*d_model, k_row_size*(layer_ix*n_cells + cell));
+                    struct ggml_tensor * v = ggml_view_1d(ctx0, ctx.memory_v, len*d_model, v_row_size*(layer_ix*n_cells + cell));
+
+                    struct ggml_tensor * k_store = ggml_cpy(ctx0, k_src, k);
+                    struct ggml_tensor * v_store = ggml_cpy(ctx0, v_src, v);
+
+                    ggml_build_forward_expand(gf, ggml_set_name(k_store, "k_store"));
+                    ggml_build_forward_expand(gf, ggml_set_name(v_store, "v_store"));
+                    set_part(k_store);
+                    set_part(v_store);
+                }
+            }
+
+            // [d_model, n_kv]
+            struct ggml_tensor * k_mem;
+            struct ggml_tensor * v_mem;
+            if (paged) {
+                k_mem = ggml_get_rows(ctx0, ggml_view_2d(ctx0, ctx.memory_k, d_model, n_cells, k_row_size, layer_ix*n_cells*k_row_size), kv_cells);
+                v_mem = ggml_get_rows(ctx0, ggml_view_2d(ctx0, ctx.memory_v, d_model, n_cells, v_row_size, layer_ix*n_cells*v_row_size), kv_cells);
+                ggml_set_name(k_mem, "k_gather");
+                ggml_set_name(v_mem, "v_gather");
+            } else {
+                k_mem = ggml_view_1d(ctx0, ctx.memory_k, n_kv*d_model, layer_ix*n_cells*k_row_size);
+                v_mem = ggml_view_1d(ctx0, ctx.memory_v, n_kv*d_model, layer_ix*n_cells*v_row_size);
+            }
+
+            // (d_kv, N, n_head)
+            struct ggml_tensor * Q = ggml_permute(ctx0, ggml_cpy(ctx0, q_curr, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, d_kv, n_head, N)), 0, 2, 1, 3);
+
+            // (d_kv, n_kv, n_head)
+            struct ggml_tensor * K = ggml_permute(ctx0, ggml_reshape_3d(ctx0, k_mem, d_kv, n_head, n_kv), 0, 2, 1, 3);
+
+            // (n_kv, N, n_head)
+            struct ggml_tensor * QK = ggml_mul_mat(ctx0, K, Q);
+            ggml_set_name(QK, "kq");
+
+            // cells of other sequences and future positions are masked out
+            if (paged) {
+                QK = ggml_add(ctx0, QK, ggml_repeat(ctx0, kq_mask, QK));
+            } else {
+                QK = ggml_diag_mask_inf(ctx0, QK, n_past);
+            }
+
+            // softmax
+            struct ggml_tensor * attn_weights = ggml_soft_max(ctx0, QK);
+            ggml_set_name(attn_weights, "kq_soft_max");
+
+            // [n_kv, d_kv, n_head]
+            struct ggml_tensor * V_trans =
+                ggml_cpy(ctx0,
+                        ggml_permute(ctx0, ggml_reshape_3d(ctx0, v_mem, d_kv, n_head, n_kv), 1, 2, 0, 3),
+                        ggml_new_tensor_3d(ctx0, ctx.memory_v->type, n_kv, d_kv, n_head)
+            );
+            ggml_set_name(V_trans, "v_trans");
+
+            // [d_kv, N, n_head]
+            struct ggml_tensor * attn_outputs = ggml_mul_mat(ctx0, V_trans, attn_weights);
+            ggml_set_name(attn_outputs, "kqv");
+
+            // [d_kv, n_head, N]
+            struct ggml_tensor * attn_outputs_merged = ggml_permute(ctx0, attn_outputs, 0, 2, 1, 3);
+
+            // [d_model, N]
+            current = ggml_cpy(ctx0, attn_outputs_merged, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, d_model, N));
+
+            // output projection
+            add_input_stats(current, layer_name + ".o");
+
+            current = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].o_proj_w, current);
+            ggml_set_name(current, "o_proj");
+            current = ggml_add(ctx0, current, ggml_repeat(ctx0, model.layers_decoder[layer_ix].o_proj_b, current));
+        }
+
+        // residual connection
+        current = ggml_add(ctx0, current, inpL);
+
+        struct ggml_tensor * inpFF = current;
+
+        // feed forward
+        {
+            // final layer norm
+            current = ggml_norm(ctx0, inpFF, NORM_EPS);
+            ggml_set_name(current, "ln_1");
+            current = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].ln_1_w, current), current), ggml_repeat(ctx0, model.layers_decoder[layer_ix].ln_1_b, current));
+
+            // fc1
+            add_input_stats(current, layer_name + ".fc_0");
+
+            current = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].fc_0_w, current);
+            ggml_set_name(current, "fc_0");
+            current = ggml_add(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].fc_0_b, current), current);
+
+            // gelu
+            current = ggml_gelu(ctx0, current);
+            ggml_set_name(current, "gelu");
+
+            // fc2
+            add_input_stats(current, layer_name + ".fc_1");
+
+            current = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].fc_1_w, current);
+            ggml_set_name(current, "fc_1");
+            current = ggml_add(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].fc_1_b, current), current);
+        }
+
+        // residual connection
+        inpL = ggml_add(ctx0, current, inpFF);
+        set_part(inpL);
+    }
+
+    part = hparams.n_layer + 1;
+
+    // final norm layer
+    inpL = ggml_norm(ctx0, inpL, NORM_EPS);
+    ggml_set_name(inpL, "ln_f");
+    inpL = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.ln_w, inpL), inpL), ggml_repeat(ctx0, model.ln_b, inpL));
+
+    if (opts.embeddings) {
+        ggml_build_forward_expand(gf, inpL);
+        set_part(inpL);
+        ggml_free(ctx0);
+
+        return gf;
+    }
+
+    // lm head, restricted to the rows of the allowed tokens if any
+    struct ggml_tensor * lm_head = model.lm_head;
+    if (opts.allowed_ids) {
+        struct ggml_tensor * allowed = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, opts.allowed_ids->size());
+        ggml_allocr_alloc(allocr, allowed);
+        if (!ggml_allocr_is_measure(allocr)) {
+            ggml_backend_tensor_set(allowed, opts.allowed_ids->data(), 0, ggml_nbytes(allowed));
+        }
+
+        lm_head = ggml_get_rows(ctx0, model.lm_head, allowed);
+    }
+
+    add_input_stats(inpL, "lm_head");
+
+    inpL = ggml_mul_mat(ctx0, lm_head, inpL);
+    ggml_set_name(inpL, "lm_head");
+
+    ggml_build_forward_expand(gf, inpL);
+    set_part(inpL);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+// build the computation graph
+struct ggml_cgraph * biogpt_graph(
+                biogpt_context & ctx,
+          const token_sequence & embed_inp,
+                     const int   n_past,
+        const biogpt_eval_opts & opts) {
+    const int N = embed_inp.size();
+
+    std::vector<int32_t> positions(N);
+    for (int i = 0; i < N; ++i) {
+        positions[i] = n_past + i;
+    }
+
+    return biogpt_graph_build(ctx, embed_inp, positions, n_past, NULL, opts);
+}
+
+// build the computation graph of a batch of sequences stored in the paged memory
+// the blocks receiving the new tokens must have been reserved with biogpt_kv_seq_reserve
+struct ggml_cgraph * biogpt_graph_paged(
+                         biogpt_context   & ctx,
+      const std::vector<token_sequence>   & embed_inps,
+      const std::vector<biogpt_kv_seq *>  & seqs,
+                   const biogpt_eval_opts & opts) {
+    GGML_ASSERT(embed_inps.size() == seqs.size());
+    GGML_ASSERT(ctx.kv_pool.n_blocks > 0);
+
+    const int block_size = ctx.kv_pool.block_size;
+    const bool measure   = ggml_allocr_is_measure(ctx.allocr);
+
+    token_sequence       tokens;
+    std::vector<int32_t> positions;
+
+    biogpt_kv_layout layout;
+
+    for (size_t s = 0; s < seqs.size(); s++) {
+        const int n_past = seqs[s]->n_past;
+        const int n_tok  = embed_inps[s].size();
+
+        for (int i = 0; i < n_tok; i++) {
+            tokens.push_back(embed_inps[s][i]);
+            positions.push_back(n_past + i);
+        }
+
+        layout.n_kv += n_past + n_tok;
+    }
+
+    const int N = tokens.size();
+
+    // when measuring, only the shapes matter and the block tables may be empty
+    if (!measure) {
+        layout.kv_cells.resize(layout.n_kv);
+        layout.kq_mask.resize(layout.n_kv*N, -INFINITY);
+
+        int i_kv  = 0;
+        int i_tok = 0;
+        for (size_t s = 0; s < seqs.size(); s++) {
+            const auto & seq = *seqs[s];
+
+            const int n_tok = embed_inps[s].size();
+            const int n_seq = seq.n_past + n_tok;
+
+            for (int p = 0; p < n_seq; p++) {
+                layout.kv_cells[i_kv + p] = seq.blocks[p/block_size]*block_size + p%block_size;
+            }
+
+            // causal mask restricted to the cells of the sequence
+            for (int t = 0; t < n_tok; t++) {
+                float * row = layout.kq_mask.data() + (i_tok + t)*layout.n_kv + i_kv;
+                for (int p = 0; p <= seq.n_past + t; p++) {
+                    row[p] = 0.0f;
+                }
+            }
+
+            // new tokens are written block by block
+            for (int t = 0; t < n_tok; ) {
+                const int p   = seq.n_past + t;
+                const int len = std::min(n_tok - t, block_size - p%block_size);
+
+                layout.runs.push_back({ i_tok + t, layout.kv_cells[i_kv + p], len });
+
+                t += len;
+            }
+
+            i_kv  += n_seq;
+            i_tok += n_tok;
+        }
+    }
+
+    return biogpt_graph_build(ctx, tokens, positions, 0, &layout, opts);
+}
+
+//
+// metrics
+//
+
+// upper bounds of the latency buckets, from 10 us to 1 s
+const int64_t biogpt_metrics_bounds_us[BIOGPT_METRICS_N_BUCKETS] = {
+    10, 25, 50, 100, 250, 500,
+    1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000,
+};
+
+struct biogpt_histogram {
+    std::atomic<uint64_t> counts[BIOGPT_METRICS_N_BUCKETS + 1];
+    std::atomic<uint64_t> count;
+    std::atomic<int64_t>  sum_us;
+    std::atomic<int64_t>  max_us;
+};
+
+// static storage: the atomics start at zero
+static std::atomic<bool> g_metrics_enabled(false);
+static biogpt_histogram  g_metrics[BIOGPT_PHASE_COUNT];
+
+static void biogpt_metrics_record(const biogpt_phase phase, const int64_t t_us) {
+    biogpt_histogram & h = g_metrics[phase];
+
+    int b = 0;
+    while (b < BIOGPT_METRICS_N_BUCKETS && t_us > biogpt_metrics_bounds_us[b]) {
+        b++;
+    }
+
+    h.counts[b].fetch_add(1, std::memory_order_relaxed);
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.sum_us.fetch_add(t_us, std::memory_order_relaxed);
+
+    int64_t cur = h.max_us.load(std::memory_order_relaxed);
+    while (t_us > cur && !h.max_us.compare_exchange_weak(cur, t_us, std::memory_order_relaxed)) {
+    }
+}
+
+// times its scope into the registry; when the metrics are off, it only reads the flag
+struct biogpt_phase_timer {
+    const biogpt_phase phase;
+    const int64_t      t_start_us;
+
+    explicit biogpt_phase_timer(const biogpt_phase phase) :
+        phase(phase), t_start_us(g_metrics_enabled.load(std::memory_order_relaxed) ? ggml_time_us() : -1) {}
+
+    ~biogpt_phase_timer() {
+        if (t_start_us >= 0) {
+            biogpt_metrics_record(phase, ggml_time_us() - t_start_us);
+        }
+    }
+};
+
+void biogpt_metrics_enable(const bool enable) {
+    g_metrics_enabled = enable;
+}
+
+bool biogpt_metrics_enabled() {
+    return g_metrics_enabled;
+}
+
+void biogpt_metrics_reset() {
+    for (auto & h : g_metrics) {
+        for (auto & c : h.counts) {
+            c = 0;
+        }
+        h.count  = 0;
+        h.sum_us = 0;
+        h.max_us = 0;
+    }
+}
+
+const char * biogpt_phase_name(const biogpt_phase phase) {
+    switch (phase) {
+        case BIOGPT_PHASE_TOKENIZE:    return "tokenize";
+        case BIOGPT_PHASE_DETOKENIZE:  return "detokenize";
+        case BIOGPT_PHASE_GRAPH_BUILD: return "graph_build";
+        case BIOGPT_PHASE_ALLOC:       return "alloc";
+        case BIOGPT_PHASE_COMPUTE:     return "compute";
+        case BIOGPT_PHASE_SAMPLE:      return "sample";
+        default:                       return "unknown";
+    }
+}
+
+biogpt_phase_stats biogpt_metrics_get(const biogpt_phase phase) {
+    const biogpt_histogram & h = g_metrics[phase];
+
+    biogpt_phase_stats stats;
+    stats.count  = h.count;
+    stats.sum_us = h.sum_us;
+    stats.max_us = h.max_us;
+    for (int b = 0; b <= BIOGPT_METRICS_N_BUCKETS; b++) {
+        stats.counts[b] = h.counts[b];
+    }
+
+    return stats;
+}
+
+int64_t biogpt_phase_quantile_us(const biogpt_phase_stats & stats, const double q) {
+    const uint64_t rank = std::max<uint64_t>(1, (uint64_t) ceil(q*stats.count));
+
+    uint64_t n = 0;
+    for (int b = 0; b < BIOGPT_METRICS_N_BUCKETS; b++) {
+        n += stats.counts[b];
+        if (n >= rank) {
+            return biogpt_metrics_bounds_us[b];
+        }
+    }
+
+    return -1;
+}
+
+void biogpt_metrics_print() {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%-12s %10s %12s %10s %10s %10s %10s\n", "phase", "count", "total (ms)", "mean (us)", "p50 (us)", "p99 (us)", "max (us)");
+
+    auto bound = [](const int64_t us) {
+        return us < 0 ? std::string(">1s") : "<=" + std::to_string(us);
+    };
+
+    for (int p = 0; p < BIOGPT_PHASE_COUNT; p++) {
+        const biogpt_phase_stats stats = biogpt_metrics_get((biogpt_phase) p);
+        if (stats.count == 0) {
+            continue;
+        }
+
+        fprintf(stderr, "%-12s %10llu %12.2f %10.1f %10s %10s %10lld\n",
+                biogpt_phase_name((biogpt_phase) p), (unsigned long long) stats.count, stats.sum_us/1000.0, (double) stats.sum_us/stats.count,
+                bound(biogpt_phase_quantile_us(stats, 0.50)).c_str(), bound(biogpt_phase_quantile_us(stats, 0.99)).c_str(), (long long) stats.max_us);
+    }
+}
+
+std::string biogpt_metrics_prometheus() {
+    std::stringstream ss;
+
+    ss << "# HELP biogpt_phase_duration_seconds Time spent in each phase of the inference.\n";
+    ss << "# TYPE biogpt_phase_duration_seconds histogram\n";
+
+    for (int p = 0; p < BIOGPT_PHASE_COUNT; p++) {
+        const biogpt_phase_stats stats = biogpt_metrics_get((biogpt_phase) p);
+
+        const std::string label = std::string("phase=\"") + biogpt_phase_name((biogpt_phase) p) + "\"";
+
+        // the buckets are cumulative
+        uint64_t n = 0;
+        for (int b = 0; b < BIOGPT_METRICS_N_BUCKETS; b++) {
+            n += stats.counts[b];
+            ss << "biogpt_phase_duration_seconds_bucket{" << label << ",le=\"" << biogpt_metrics_bounds_us[b]/1e6 << "\"} " << n << "\n";
+        }
+        ss << "biogpt_phase_duration_seconds_bucket{" << label << ",le=\"+Inf\"} " << stats.count << "\n";
+        ss << "biogpt_phase_duration_seconds_sum{" << label << "} " << stats.sum_us/1e6 << "\n";
+        ss << "biogpt_phase_duration_seconds_count{" << label << "} " << stats.count << "\n";
+    }
+
+    return ss.str();
+}
+
+//
+// profiling
+//
+
+// add a computed graph to the profile. The nodes are attributed to the part recorded for them by
+// biogpt_graph_build: the embeddings (0), a decoder layer (1..n_layer) or the final norm and lm head (n_layer + 1)
+static void biogpt_profile_graph(
+     const biogpt_context & ctx,
+  const struct ggml_cgraph * gf,
+            const int64_t   t_start_us,
+            const int64_t   t_end_us,
+           biogpt_profile & prof) {
+    const int n_layer = ctx.model->hparams.n_layer;
+
+    if (prof.n_graphs == 0) {
+        prof.t_start_us = t_start_us;
+    }
+
+    prof.parts.resize(n_layer + 2);
+    prof.n_graphs   += 1;
+    prof.t_graph_us += t_end_us - t_start_us;
+
+    if (prof.trace) {
+        biogpt_trace_event ev;
+        ev.name   = "graph";
+        ev.part   = -1;
+        ev.ts_us  = t_start_us - prof.t_start_us;
+        ev.dur_us = t_end_us - t_start_us;
+        prof.events.push_back(ev);
+    }
+
+    // the nodes run one after the other, each on all the threads
+    int64_t ts_us = t_start_us - prof.t_start_us;
+
+    for (int i = 0; i < gf->n_nodes; i++) {
+        const struct ggml_tensor * node = gf->nodes[i];
+
+        const auto it = ctx.graph_parts.find(node);
+        const int p = it != ctx.graph_parts.end() ? it->second : 0;
+
+        // views only change the strides
+        const bool is_view = node->op == GGML_OP_VIEW || node->op == GGML_OP_RESHAPE ||
+                             node->op == GGML_OP_PERMUTE || node->op == GGML_OP_TRANSPOSE;
+
+        double flops = 0.0;
+        double bytes = 0.0;
+        if (!is_view) {
+            bytes = ggml_nbytes(node);
+            for (int j = 0; j < GGML_MAX_SRC && node->src[j]; j++) {
+                bytes += ggml_nbytes(node->src[j]);
+            }
+
+            flops = ggml_nelements(node);
+            if (node->op == GGML_OP_MUL_MAT) {
+                flops *= 2.0*node->src[0]->ne[0];
+            }
+        }
+
+        std::string name = ggml_op_name(node->op);
+        if (node->name[0] != '\0') {
+            name += std::string(" ") + node->name;
+        }
+
+        for (auto * stat : { &prof.ops[name], &prof.parts[p] }) {
+            stat->n_nodes += 1;
+            stat->t_us    += node->perf_time_us;
+            stat->flops   += flops;
+            stat->bytes   += bytes;
+        }
+
+        if (prof.trace && !is_view) {
+            biogpt_trace_event ev;
+            ev.name   = name;
+            ev.part   = p;
+            ev.ts_us  = ts_us;
+            ev.dur_us = node->perf_time_us;
+            prof.events.push_back(ev);
+        }
+
+        ts_us += node->perf_time_us;
+    }
+}
+
+void biogpt_profile_print(const biogpt_profile & prof) {
+    int64_t t_nodes_us = 0;
+    for (const auto & stat : prof.parts) {
+        t_nodes_us += stat.t_us;
+    }
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: %lld graphs computed in %.2f ms, %.2f ms spent in the nodes\n", __func__,
+            (long long) prof.n_graphs, prof.t_graph_us/1000.0, t_nodes_us/1000.0);
+
+    if (t_nodes_us == 0) {
+        fprintf(stderr, "%s: ggml did not time the nodes: build with -DBIOGPT_PERF=ON (GGML_PERF)\n", __func__);
+    }
+
+    auto print_row = [&](const std::string & name, const biogpt_profile_stat & stat) {
+        fprintf(stderr, "%-24s %8lld %10.2f %6.2f %10.3f %10.3f %10.2f\n",
+                name.c_str(), (long long) stat.n_nodes, stat.t_us/1000.0, 100.0*stat.t_us/std::max<int64_t>(1, t_nodes_us),
+                stat.flops/1e9, stat.bytes/1e9, stat.t_us > 0 ? stat.flops/1e3/stat.t_us : 0.0);
+    };
+
+    const char * header = "%-24s %8s %10s %6s %10s %10s %10s\n";
+
+    // by op, slowest first
+    {
+        std::vector<std::pair<std::string, biogpt_profile_stat>> ops(prof.ops.begin(), prof.ops.end());
+        std::sort(ops.begin(), ops.end(), [](const std::pair<std::string, biogpt_profile_stat> & a, const std::pair<std::string, biogpt_profile_stat> & b) {
+            return a.second.t_us > b.second.t_us;
+        });
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, header, "op", "nodes", "time (ms)", "%", "GFLOP", "GB", "GFLOP/s");
+        for (const auto & op : ops) {
+            print_row(op.first, op.second);
+        }
+    }
+
+    // by part of the model
+    {
+        const int n_parts = prof.parts.size();
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, header, "layer", "nodes", "time (ms)", "%", "GFLOP", "GB", "GFLOP/s");
+        for (int p = 0; p < n_parts; p++) {
+            const std::string name = p == 0 ? "embeddings" : p == n_parts - 1 ? "output" : "decoder " + std::to_string(p - 1);
+            print_row(name, prof.parts[p]);
+        }
+    }
+}
+
+bool biogpt_profile_save_trace(
+        const std::string & fname,
+     const biogpt_profile & prof) {
+    std::ofstream fout(fname);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname.c_str());
+        return false;
+    }
+
+    const int n_parts = prof.parts.size();
+
+    // the graphs and the nodes of each part go on their own row
+    fout << "{\"traceEvents\": [\n";
+    for (size_t i = 0; i < prof.events.size(); i++) {
+        const auto & ev = prof.events[i];
+
+        const std::string cat = ev.part < 0 ? "graph" : ev.part == 0 ? "embeddings" : ev.part == n_parts - 1 ? "output" : "decoder " + std::to_string(ev.part - 1);
+
+        fout << "{\"name\": \"" << ev.name << "\", \"cat\": \"" << cat << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << ev.part + 1
+             << ", \"ts\": " << ev.ts_us << ", \"dur\": " << ev.dur_us << "}" << (i + 1 < prof.events.size() ? ",\n" : "\n");
+    }
+    fout << "], \"displayTimeUnit\": \"ms\"}\n";
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// hand rows [row0, row0 + n_rows) of the output logits to the caller: in place, into its buffer or into `logits`
+static void biogpt_output_logits(
+     const biogpt_context & ctx,
+       struct ggml_tensor * output,
+                const int   row0,
+                const int   n_rows,
+       std::vector<float> & logits,
+   const biogpt_eval_opts & opts) {
+    const int    n_logits = output->ne[0];  // n_vocab, or the number of allowed tokens
+    const size_t row_size = n_logits*sizeof(float);
+
+    if (opts.logits_view && ggml_backend_is_cpu(ctx.backend)) {
+        *opts.logits_view = (const float *) ((const char *) output->data + row0*row_size);
+        return;
+    }
+
+    float * dst = opts.logits_out;
+    if (dst == NULL) {
+        logits.resize(n_rows*n_logits);
+        dst = logits.data();
+    }
+
+    ggml_backend_tensor_get(output, dst, row0*row_size, n_rows*row_size);
+
+    if (opts.logits_view) {
+        *opts.logits_view = dst;
+    }
+}
+
+// add the input statistics of an evaluated graph to ctx.calibration
+static void biogpt_calibration_collect(
+           biogpt_context & ctx,
+     struct ggml_cgraph * gf) {
+    auto & calib = *ctx.calibration;
+
+    std::vector<float> sum_sq;
+
+    int64_t n_tokens = 0;
+
+    for (int i = 0; i < gf->n_nodes; i++) {
+        struct ggml_tensor * node = gf->nodes[i];
+        if (strncmp(node->name, "act_in.", 7) != 0) {
+            continue;
+        }
+
+        // "<layer>.<linear>" or "lm_head", the linear layers sharing an input get the same statistics
+        const std::string name = node->name + 7;
+
+        std::vector<std::string> weights;
+        if (name == "lm_head") {
+            // a tied lm head is stored as the token embeddings, which the quantizer then looks up
+            weights.push_back(ctx.model->tied_lm_head ? "biogpt.embed_tokens.weight" : "output_projection.weight");
+        } else {
+            const size_t dot = name.find('.');
+
+            const std::string prefix = "biogpt.layers." + name.substr(0, dot);
+            const std::string linear = name.substr(dot + 1);
+
+            if (linear == "qkv") {
+                weights.push_back(prefix + ".self_attn.q_proj.weight");
+                weights.push_back(prefix + ".self_attn.k_proj.weight");
+                weights.push_back(prefix + ".self_attn.v_proj.weight");
+            } else if (linear == "o") {
+                weights.push_back(prefix + ".self_attn.out_proj.weight");
+            } else if (linear == "fc_0") {
+                weights.push_back(prefix + ".fc1.weight");
+            } else if (linear == "fc_1") {
+                weights.push_back(prefix + ".fc2.weight");
+            }
+        }
+
+        // the transposed input: [n_tokens, n_channels] summed to [1, n_channels]
+        n_tokens = node->src[0]->ne[0];
+
+        sum_sq.resize(ggml_nelements(node));
+        ggml_backend_tensor_get(node, sum_sq.data(), 0, ggml_nbytes(node));
+
+        for (const auto & weight : weights) {
+            auto & acc = calib.sum_sq[weight];
+            acc.resize(sum_sq.size(), 0.0);
+
+            for (size_t j = 0; j < sum_sq.size(); j++) {
+                acc[j] += sum_sq[j];
+            }
+        }
+    }
+
+    calib.n_tokens += n_tokens;
+}
+
+bool biogpt_calibration_save(
+        const std::string & fname,
+ const biogpt_calibration & calib) {
+    std::ofstream fout(fname, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname.c_str());
+        return false;
+    }
+
+    const uint32_t magic     = BIOGPT_CALIBRATION_MAGIC;
+    const int64_t  n_tokens  = calib.n_tokens;
+    const int32_t  n_entries = calib.sum_sq.size();
+
+    write_safe(fout, magic);
+    write_safe(fout, n_tokens);
+    write_safe(fout, n_entries);
+
+    std::vector<float> mean_sq;
+
+    for (const auto & it : calib.sum_sq) {
+        const int32_t length     = it.first.size();
+        const int32_t n_channels = it.second.size();
+
+        write_safe(fout, length);
+        fout.write(it.first.data(), length);
+        write_safe(fout, n_channels);
+
+        mean_sq.resize(n_channels);
+        for (int j = 0; j < n_channels; j++) {
+            mean_sq[j] = n_tokens > 0 ? it.second[j]/n_tokens : 0.0f;
+        }
+
+        fout.write(reinterpret_cast<const char *>(mean_sq.data()), n_channels*sizeof(float));
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool biogpt_calibration_load(
+        const std::string & fname,
+       biogpt_calibration & calib) {
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    uint32_t magic     = 0;
+    int64_t  n_tokens  = 0;
+    int32_t  n_entries = 0;
+
+    read_safe(fin, magic);
+    if (magic != BIOGPT_CALIBRATION_MAGIC) {
+        fprintf(stderr, "%s: invalid calibration file '%s' (bad magic)\n", __func__, fname.c_str());
+        return false;
+    }
+
+    read_safe(fin, n_tokens);
+    read_safe(fin, n_entries);
+
+    calib.n_tokens = n_tokens;
+    calib.sum_sq.clear();
+
+    std::vector<float> mean_sq;
+
+    for (int i = 0; i < n_entries; i++) {
+        int32_t length     = 0;
+        int32_t n_channels = 0;
+
+        read_safe(fin, length);
+        if (!fin || length <= 0 || length > 512) {
+            fprintf(stderr, "%s: invalid calibration file '%s' (bad entry %d)\n", __func__, fname.c_str(), i);
+            return false;
+        }
+
+        std::string name(length, 0);
+        fin.read(&name[0], length);
+        read_safe(fin, n_channels);
+        if (!fin || n_channels <= 0) {
+            fprintf(stderr, "%s: invalid calibration file '%s' (bad entry '%s')\n", __func__, fname.c_str(), name.c_str());
+            return false;
+        }
+
+        mean_sq.resize(n_channels);
+        fin.read(reinterpret_cast<char *>(mean_sq.data()), n_channels*sizeof(float));
+
+        auto & sums = calib.sum_sq[name];
+        sums.resize(n_channels);
+        for (int j = 0; j < n_channels; j++) {
+            sums[j] = (double) mean_sq[j]*n_tokens;
+        }
+    }
+
+    if (!fin) {
+        fprintf(stderr, "%s: invalid calibration file '%s' (truncated)\n", __func__, fname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool biogpt_eval(
+           biogpt_context & ctx,
+     const token_sequence & embed_inp,
+       std::vector<float> & logits,
+                const int   n_past,
+                const int   n_threads,
+   const biogpt_eval_opts & opts) {
+    const int N = embed_inp.size();
+
+    // the compute buffer is measured on cparams.n_batch tokens
+    if (N > std::max(1, ctx.cparams.n_batch)) {
+        fprintf(stderr, "%s: %d tokens do not fit the batch of the context (n_batch = %d)\n", __func__, N, ctx.cparams.n_batch);
+        return false;
+    }
+
+    struct ggml_cgraph * gf = NULL;
+    {
+        biogpt_phase_timer timer(BIOGPT_PHASE_GRAPH_BUILD);
+
+        // reset the allocator to free all the memory allocated during the previous inference
+        ggml_allocr_reset(ctx.allocr);
+
+        gf = biogpt_graph(ctx, embed_inp, n_past, opts);
+    }
+
+    // allocate tensors
+    {
+        biogpt_phase_timer timer(BIOGPT_PHASE_ALLOC);
+        ggml_allocr_alloc_graph(ctx.allocr, gf);
+    }
+
+    // run the computation
+    if (ggml_backend_is_cpu(ctx.backend)) {
+        ggml_backend_cpu_set_n_threads(ctx.backend, n_threads);
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    {
+        biogpt_phase_timer timer(BIOGPT_PHASE_COMPUTE);
+        ggml_backend_graph_compute(ctx.backend, gf);
+    }
+
+    if (ctx.profile) {
+        biogpt_profile_graph(ctx, gf, t_start_us, ggml_time_us(), *ctx.profile);
+    }
+
+    if (ctx.calibration && ctx.cparams.calibration) {
+        biogpt_calibration_collect(ctx, gf);
+    }
+
+    struct ggml_tensor * inpL = gf->nodes[gf->n_nodes - 1];
+
+    // by default, return result for just the last token
+    const int n_rows = opts.n_rows > 0 ? std::min(opts.n_rows, N) : (opts.logits_all ? N : 1);
+
+    biogpt_output_logits(ctx, inpL, N - n_rows, n_rows, logits, opts);
+
+    return true;
+}
+
+static void biogpt_kv_block_retain(biogpt_kv_pool & pool, const int block);
+static void biogpt_kv_block_release(biogpt_kv_pool & pool, const int block);
+
+// copy-on-write: give a sequence its own copy of the shared blocks it is about to write n_tokens to
+static bool biogpt_kv_seq_cow(
+           biogpt_context & ctx,
+            biogpt_kv_seq & seq,
+                const int   n_tokens) {
+    const auto & model = *ctx.model;
+
+    auto & pool = ctx.kv_pool;
+
+    const int block_size = pool.block_size;
+    const int n_cells    = biogpt_kv_n_cells(ctx);
+
+    const int ib0 = seq.n_past/block_size;
+    const int ib1 = std::min((int) seq.blocks.size(), (seq.n_past + n_tokens + block_size - 1)/block_size);
+
+    std::vector<uint8_t> buf;
+
+    for (int ib = ib0; ib < ib1; ib++) {
+        const int src = seq.blocks[ib];
+        if (pool.ref_count[src] == 1) {
+            continue;
+        }
+
+        if (pool.free_blocks.empty()) {
+            return false;
+        }
+
+        const int dst = pool.free_blocks.back();
+        pool.free_blocks.pop_back();
+        pool.ref_count[dst] = 1;
+
+        for (auto * memory : { ctx.memory_k, ctx.memory_v }) {
+            const size_t row_size = ggml_element_size(memory)*model.hparams.d_model;
+
+            buf.resize(block_size*row_size);
+
+            for (int il = 0; il < model.hparams.n_layer; il++) {
+                ggml_backend_tensor_get(memory, buf.data(), (il*n_cells + src*block_size)*row_size, buf.size());
+                ggml_backend_tensor_set(memory, buf.data(), (il*n_cells + dst*block_size)*row_size, buf.size());
+            }
+        }
+
+        biogpt_kv_block_release(pool, src);
+        seq.blocks[ib] = dst;
+    }
+
+    return true;
+}
+
+// evaluate a batch of sequences in the paged memory and return the logits of the last token of each sequence
+// (or of every token, in the order of the sequences, with opts.logits_all)
+bool biogpt_eval_paged(
+                         biogpt_context   & ctx,
+      const std::vector<token_sequence>   & embed_inps,
+      const std::vector<biogpt_kv_seq *>  & seqs,
+                       std::vector<float> & logits,
+                                const int   n_threads,
+                   const biogpt_eval_opts & opts) {
+    const int n_positions = ctx.model->hparams.n_positions;
+
+    // the compute buffer is measured on n_seq sequences sharing max(n_batch, n_seq) tokens
+    const int n_seq_max = std::max(1, ctx.cparams.n_seq);
+    const int n_tok_max = std::max(ctx.cparams.n_batch, n_seq_max);
+
+    int n_tok_sum = 0;
+    for (const auto & embed : embed_inps) {
+        n_tok_sum += embed.size();
+    }
+
+    if ((int) seqs.size() > n_seq_max || n_tok_sum > n_tok_max) {
+        fprintf(stderr, "%s: %zu sequences of %d tokens do not fit the batch of the context (n_seq = %d, n_batch = %d)\n", __func__,
+                seqs.size(), n_tok_sum, ctx.cparams.n_seq, ctx.cparams.n_batch);
+        return false;
+    }
+
+    for (size_t s = 0; s < seqs.size(); s++) {
+        const int n_tok = embed_inps[s].size();
+
+        if (n_tok == 0 || seqs[s]->n_past + n_tok > n_positions) {
+            fprintf(stderr, "%s: invalid number of tokens %d for sequence %zu (n_past = %d)\n", __func__, n_tok, s, seqs[s]->n_past);
+            return false;
+        }
+
+        if (!biogpt_kv_seq_cow(ctx, *seqs[s], n_tok) || !biogpt_kv_seq_reserve(ctx.kv_pool, *seqs[s], n_tok)) {
+            fprintf(stderr, "%s: out of key + value memory blocks\n", __func__);
+            return false;
+        }
+    }
+
+    struct ggml_cgraph * gf = NULL;
+    {
+        biogpt_phase_timer timer(BIOGPT_PHASE_GRAPH_BUILD);
+
+        ggml_allocr_reset(ctx.allocr);
+
+        gf = biogpt_graph_paged(ctx, embed_inps, seqs, opts);
+    }
+
+    {
+        biogpt_phase_timer timer(BIOGPT_PHASE_ALLOC);
+        ggml_allocr_alloc_graph(ctx.allocr, gf);
+    }
+
+    if (ggml_backend_is_cpu(ctx.backend)) {
+        ggml_backend_cpu_set_n_threads(ctx.backend, n_threads);
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    {
+        biogpt_phase_timer timer(BIOGPT_PHASE_COMPUTE);
+        ggml_backend_graph_compute(ctx.backend, gf);
+    }
+
+    if (ctx.profile) {
+        biogpt_profile_graph(ctx, gf, t_start_us, ggml_time_us(), *ctx.profile);
+    }
+
+    if (ctx.calibration && ctx.cparams.calibration) {
+        biogpt_calibration_collect(ctx, gf);
+    }
+
+    struct ggml_tensor * inpL = gf->nodes[gf->n_nodes - 1];
+
+    const int N        = inpL->ne[1];
+    const int n_logits = inpL->ne[0];
+
+    if (opts.logits_all || opts.n_rows > 0) {
+        const int n_rows = opts.n_rows > 0 ? std::min(opts.n_rows, N) : N;
+        biogpt_output_logits(ctx, inpL, N - n_rows, n_rows, logits, opts);
+    } else if (seqs.size() == 1) {
+        biogpt_output_logits(ctx, inpL, N - 1, 1, logits, opts);
+    } else {
+        // the last rows of the sequences are not contiguous: gather them
+        float * dst = opts.logits_out;
+        if (dst == NULL) {
+            logits.resize(seqs.size()*n_logits);
+            dst = logits.data();
+        }
+
+        int i_tok = 0;
+        for (size_t s = 0; s < seqs.size(); s++) {
+            i_tok += embed_inps[s].size();
+            ggml_backend_tensor_get(inpL, dst + s*n_logits, (i_tok - 1)*n_logits*sizeof(float), n_logits*sizeof(float));
+        }
+
+        if (opts.logits_view) {
+            *opts.logits_view = dst;
+        }
+    }
+
+    for (size_t s = 0; s < seqs.size(); s++) {
+        seqs[s]->n_past += embed_inps[s].size();
+    }
+
+    return true;
+}
+
+static void biogpt_kv_block_retain(biogpt_kv_pool & pool, const int block) {
+    pool.ref_count[block]++;
+}
+
+static void biogpt_kv_block_release(biogpt_kv_pool & pool, const int block) {
+    GGML_ASSERT(pool.ref_count[block] > 0);
+
+    if (--pool.ref_count[block] == 0) {
+        pool.free_blocks.push_back(block);
+    }
+}
+
+// grow the block table of a sequence so that it can hold n_tokens more positions
+bool biogpt_kv_seq_reserve(
+           biogpt_kv_pool & pool,
+            biogpt_kv_seq & seq,
+                const int   n_tokens) {
+    const int n_needed = (seq.n_past + n_tokens + pool.block_size - 1)/pool.block_size;
+
+    while ((int) seq.blocks.size() < n_needed) {
+        if (pool.free_blocks.empty()) {
+            return false;
+        }
+
+        const int block = pool.free_blocks.back();
+        pool.free_blocks.pop_back();
+
+        pool.ref_count[block] = 1;
+        seq.blocks.push_back(block);
+    }
+
+    return true;
+}
+
+// return the blocks of a finished sequence to the pool, unless they are still shared
+void biogpt_kv_seq_free(
+           biogpt_kv_pool & pool,
+            biogpt_kv_seq & seq) {
+    for (auto it = seq.blocks.rbegin(); it != seq.blocks.rend(); ++it) {
+        biogpt_kv_block_release(pool, *it);
+    }
+
+    seq.blocks.clear();
+    seq.n_past = 0;
+}
+
+// share the blocks of src with dst, shared blocks are copied on the first write to them
+void biogpt_kv_seq_fork(
+           biogpt_kv_pool & pool,
+      const biogpt_kv_seq & src,
+            biogpt_kv_seq & dst) {
+    biogpt_kv_seq_free(pool, dst);
+
+    for (const int block : src.blocks) {
+        biogpt_kv_block_retain(pool, block);
+    }
+
+    dst.blocks = src.blocks;
+    dst.n_past = src.n_past;
+}
+
+//
+// beam search
+//
+
+struct biogpt_beam {
+    biogpt_kv_seq  seq;
+    token_sequence tokens;
+
+    double logprob = 0.0;
+};
+
+struct biogpt_beam_candidate {
+    double           logprob;
+    int              beam;
+    biogpt_vocab::id id;
+};
+
+// beam search with all the beams evaluated in one batch of the paged memory
+// beams share their history through the blocks of the pool, forked on each step
+bool biogpt_beam_search(
+           biogpt_context & ctx,
+     const token_sequence & embed_inp,
+ const biogpt_beam_params & bparams,
+       biogpt_beam_result & result,
+                const int   n_batch,
+                const int   n_threads) {
+    GGML_ASSERT(ctx.kv_pool.n_blocks > 0);
+
+    const auto & model = *ctx.model;
+
+    const int n_vocab   = model.hparams.n_vocab;
+    const int n_beams   = bparams.n_beams;
+    const int n_predict = std::min(bparams.n_predict, model.hparams.n_positions - (int) embed_inp.size());
+
+    const biogpt_vocab::id eos_id = 2;
+
+    auto & pool = ctx.kv_pool;
+
+    auto length_score = [&](double logprob, int length) {
+        return logprob/pow((double) std::max(1, length), (double) bparams.length_penalty);
+    };
+
+    const int64_t t_start_us = ggml_time_us();
+
+    std::vector<float> logits;
+
+    std::vector<biogpt_beam> beams(1);
+
+    // evaluate the prompt
+    for (int i = 0; i < (int) embed_inp.size(); i += n_batch) {
+        const int n_eval = std::min(n_batch, (int) embed_inp.size() - i);
+
+        token_sequence embed(embed_inp.begin() + i, embed_inp.begin() + i + n_eval);
+        if (!biogpt_eval_paged(ctx, { embed }, { &beams[0].seq }, logits, n_threads)) {
+            biogpt_kv_seq_free(pool, beams[0].seq);
+            return false;
+        }
+    }
+
+    result.t_prompt_us = ggml_time_us() - t_start_us;
+
+    const int64_t t_predict_start_us = ggml_time_us();
+
+    // finished hypotheses: (score, tokens)
+    std::vector<std::pair<double, token_sequence>> finished;
+
+    std::vector<std::pair<float, biogpt_vocab::id>> top;
+    std::vector<biogpt_beam_candidate> candidates;
+
+    bool ok = true;
+
+    for (int step = 0; step < n_predict; step++) {
+        // best 2*n_beams continuations of every beam, so that n_beams remain after removing EOS
+        candidates.clear();
+        for (int b = 0; b < (int) beams.size(); b++) {
+            const float * row = logits.data() + b*n_vocab;
+
+            float maxl = -INFINITY;
+            for (int i = 0; i < n_vocab; i++) {
+                maxl = std::max(maxl, row[i]);
+            }
+
+            double sum = 0.0;
+            for (int i = 0; i < n_vocab; i++) {
+                sum += exp(row[i] - maxl);
+            }
+            const double log_norm = maxl + log(sum);
+
+            top.resize(n_vocab);
+            for (int i = 0; i < n_vocab; i++) {
+                top[i] = std::make_pair(row[i], i);
+            }
+
+            const int n_top = std::min(2*n_beams, n_vocab);
+            std::partial_sort(top.begin(), top.begin() + n_top, top.end(),
+                    [](const std::pair<float, biogpt_vocab::id> & a, const std::pair<float, biogpt_vocab::id> & b) {
+                return a.first > b.first;
+            });
+
+            for (int i = 0; i < n_top; i++) {
+                candidates.push_back({ beams[b].logprob + top[i].first - log_norm, b, top[i].second });
+            }
+        }
+
+        std::sort(candidates.begin(), candidates.end(), [](const biogpt_beam_candidate & a, const biogpt_beam_candidate & b) {
+            return a.logprob > b.logprob;
+        });
+
+        // select the next beams and move the hypotheses ending with EOS to the finished list
+        std::vector<biogpt_beam> next;
+        for (int rank = 0; rank < (int) candidates.size() && (int) next.size() < n_beams; rank++) {
+            const auto & cand   = candidates[rank];
+            const auto & parent = beams[cand.beam];
+
+            if (cand.id == eos_id) {
+                if (rank < n_beams) {
+                    finished.push_back(std::make_pair(length_score(cand.logprob, parent.tokens.size() + 1), parent.tokens));
+                }
+                continue;
+            }
+
+            next.emplace_back();
+
+            auto & beam = next.back();
+            biogpt_kv_seq_fork(pool, parent.seq, beam.seq);
+
+            beam.tokens = parent.tokens;
+            beam.tokens.push_back(cand.id);
+            beam.logprob = cand.logprob;
+        }
+
+        for (auto & beam : beams) {
+            biogpt_kv_seq_free(pool, beam.seq);
+        }
+        beams = std::move(next);
+
+        result.n_steps++;
+
+        // stopping criteria
+        if ((int) finished.size() >= n_beams) {
+            if (bparams.early_stopping || beams.empty()) {
+                break;
+            }
+
+            double worst = INFINITY;
+            for (const auto & hyp : finished) {
+                worst = std::min(worst, hyp.first);
+            }
+
+            // no running beam can improve on the finished hypotheses anymore
+            if (length_score(beams[0].logprob, beams[0].tokens.size()) <= worst) {
+                break;
+            }
+        }
+
+        if (beams.empty() || step == n_predict - 1) {
+            break;
+        }
+
+        // evaluate the last token of every beam in a single batch
+        std::vector<token_sequence>  embd(beams.size());
+        std::vector<biogpt_kv_seq *> seqs(beams.size());
+        for (size_t b = 0; b < beams.size(); b++) {
+            embd[b] = { beams[b].tokens.back() };
+            seqs[b] = &beams[b].seq;
+        }
+
+        if (!biogpt_eval_paged(ctx, embd, seqs, logits, n_threads)) {
+            ok = false;
+            break;
+        }
+
+        result.n_beam_tokens += beams.size();
+    }
+
+    // running beams compete with the finished hypotheses
+    if ((int) finished.size() < n_beams) {
+        for (const auto & beam : beams) {
+            finished.push_back(std::make_pair(length_score(beam.logprob, beam.tokens.size()), beam.tokens));
+        }
+    }
+
+    for (auto & beam : beams) {
+        biogpt_kv_seq_free(pool, beam.seq);
+    }
+
+    if (!finished.empty()) {
+        auto best = std::max_element(finished.begin(), finished.end(),
+                [](const std::pair<double, token_sequence> & a, const std::pair<double, token_sequence> & b) {
+            return a.first < b.first;
+        });
+
+        result.score  = best->first;
+        result.tokens = best->second;
+    }
+
+    result.t_predict_us = ggml_time_us() - t_predict_start_us;
+
+    return ok;
+}
+
+//
+// multiple-choice scoring
+//
+
+// log-probability of token `id` under a row of logits
+static double biogpt_token_logprob(
+              const float * row,
+                const int   n_vocab,
+         biogpt_vocab::id   id) {
+    float maxl = -INFINITY;
+    for (int i = 0; i < n_vocab; i++) {
+        maxl = std::max(maxl, row[i]);
+    }
+
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; i++) {
+        sum += exp(row[i] - maxl);
+    }
+
+    return row[id] - (maxl + log(sum));
+}
+
+// score every continuation of a prompt: the prompt is evaluated once, then all the choices are
+// evaluated in a single batch of sequences forked from it (paged memory), or one after the other
+// on top of the same prompt keys and values (contiguous memory)
+// the context must fit a batch of n_batch tokens and a batch of all the choice tokens, one sequence per
+// choice in paged mode
+bool biogpt_score_choices(
+                     biogpt_context & ctx,
+               const token_sequence & prompt,
+  const std::vector<token_sequence> & choices,
+   std::vector<biogpt_choice_score> & scores,
+                          const int   n_batch,
+                          const int   n_threads) {
+    const auto & model = *ctx.model;
+
+    const int n_vocab  = model.hparams.n_vocab;
+    const int n_prompt = prompt.size();
+
+    const bool paged = ctx.kv_pool.n_blocks > 0;
+
+    auto & pool = ctx.kv_pool;
+
+    if (n_prompt == 0) {
+        fprintf(stderr, "%s: empty prompt\n", __func__);
+        return false;
+    }
+
+    for (size_t c = 0; c < choices.size(); c++) {
+        if (choices[c].empty() || n_prompt + (int) choices[c].size() > model.hparams.n_positions) {
+            fprintf(stderr, "%s: invalid number of tokens %zu for choice %zu\n", __func__, choices[c].size(), c);
+            return false;
+        }
+    }
+
+    scores.assign(choices.size(), biogpt_choice_score());
+
+    std::vector<float> logits;
+
+    // the prompt, except for its last token which is evaluated with every choice
+    biogpt_kv_seq seq_prompt;
+    for (int i = 0; i < n_prompt - 1; i += n_batch) {
+        const int n_eval = std::min(n_batch, n_prompt - 1 - i);
+
+        token_sequence embed(prompt.begin() + i, prompt.begin() + i + n_eval);
+
+        const bool ok = paged ?
+            biogpt_eval_paged(ctx, { embed }, { &seq_prompt }, logits, n_threads) :
+            biogpt_eval(ctx, embed, logits, i, n_threads);
+
+        if (!ok) {
+            biogpt_kv_seq_free(pool, seq_prompt);
+            return false;
+        }
+    }
+
+    // the row of every input token predicts the next choice token
+    std::vector<token_sequence> embd(choices.size());
+    for (size_t c = 0; c < choices.size(); c++) {
+        embd[c] = { prompt.back() };
+        embd[c].insert(embd[c].end(), choices[c].begin(), choices[c].end() - 1);
+    }
+
+    const float * rows = NULL;
+
+    biogpt_eval_opts opts;
+    opts.logits_all  = true;
+    opts.logits_view = &rows;
+
+    auto score = [&](const size_t c, const float * rows_c) {
+        auto & sc = scores[c];
+        for (size_t t = 0; t < choices[c].size(); t++) {
+            sc.logprob += biogpt_token_logprob(rows_c + t*n_vocab, n_vocab, choices[c][t]);
+        }
+        sc.n_tokens     = choices[c].size();
+        sc.logprob_norm = sc.logprob/sc.n_tokens;
+    };
+
+    bool ok = true;
+
+    if (paged) {
+        // the choices share the blocks of the prompt, and the attention mask keeps them apart
+        std::vector<biogpt_kv_seq>   seqs(choices.size());
+        std::vector<biogpt_kv_seq *> seqs_ptr(choices.size());
+        for (size_t c = 0; c < choices.size(); c++) {
+            biogpt_kv_seq_fork(pool, seq_prompt, seqs[c]);
+            seqs_ptr[c] = &seqs[c];
+        }
+
+        ok = biogpt_eval_paged(ctx, embd, seqs_ptr, logits, n_threads, opts);
+        if (ok) {
+            int i_row = 0;
+            for (size_t c = 0; c < choices.size(); c++) {
+                score(c, rows + i_row*n_vocab);
+                i_row += embd[c].size();
+            }
+        }
+
+        for (auto & seq : seqs) {
+            biogpt_kv_seq_free(pool, seq);
+        }
+    } else {
+        // every choice overwrites the cells of the previous one
+        for (size_t c = 0; c < choices.size() && ok; c++) {
+            ok = biogpt_eval(ctx, embd[c], logits, n_prompt - 1, n_threads, opts);
+            if (ok) {
+                score(c, rows);
+            }
+        }
+    }
+
+    biogpt_kv_seq_free(pool, seq_prompt);
+
+    return ok;
+}
+
+//
+// embeddings
+//
+
+// pooled hidden states of the final layer norm, one d_model row per document
+// with the paged memory, several documents share each batch of n_batch tokens
+// the mean skips the </s> that gpt_tokenize puts first: its hidden state is the same for every document
+bool biogpt_embed(
+                     biogpt_context & ctx,
+  const std::vector<token_sequence> & docs,
+               const biogpt_pooling   pooling,
+                 std::vector<float> & embeddings,
+                          const int   n_batch,
+                          const int   n_threads) {
+    const auto & model = *ctx.model;
+
+    const int d_model = model.hparams.d_model;
+    const int n_docs  = docs.size();
+
+    const bool paged = ctx.kv_pool.n_blocks > 0;
+
+    // the compute buffer of the context fits batches of up to cparams.n_seq sequences
+    const int n_seq_max = paged ? std::max(1, ctx.cparams.n_seq) : 1;
+
+    const biogpt_vocab::id eos_id = 2;
+
+    // positions left out of the mean at the start of each document
+    auto n_skip = [&](const int d) {
+        return docs[d].size() > 1 && docs[d][0] == eos_id ? 1 : 0;
+    };
+
+    for (int d = 0; d < n_docs; d++) {
+        if ((int) docs[d].size() > model.hparams.n_positions) {
+            fprintf(stderr, "%s: document %d is too long (%zu tokens)\n", __func__, d, docs[d].size());
+            return false;
+        }
+    }
+
+    embeddings.assign(n_docs*d_model, 0.0f);
+
+    std::vector<biogpt_kv_seq> seqs(n_docs);
+    std::vector<int>           n_done(n_docs, 0);
+
+    std::vector<float> out;
+
+    const float * rows = NULL;
+
+    biogpt_eval_opts opts;
+    opts.embeddings  = true;
+    opts.logits_all  = true;
+    opts.logits_view = &rows;
+
+    std::vector<token_sequence>  embd;
+    std::vector<biogpt_kv_seq *> seqs_ptr;
+    std::vector<int>             docs_idx;
+
+    bool ok = true;
+
+    int d0 = 0;  // first document with tokens left
+    while (ok) {
+        while (d0 < n_docs && n_done[d0] == (int) docs[d0].size()) {
+            d0++;
+        }
+        if (d0 == n_docs) {
+            break;
+        }
+
+        // fill the batch with the next tokens of the next documents, one document at a time if not paged
+        embd.clear();
+        seqs_ptr.clear();
+        docs_idx.clear();
+
+        int n_tok = 0;
+        for (int d = d0; d < n_docs && n_tok < n_batch && (int) docs_idx.size() < n_seq_max; d++) {
+            const int n = std::min((int) docs[d].size() - n_done[d], n_batch - n_tok);
+            if (n == 0) {
+                continue;
+            }
+
+            embd.emplace_back(docs[d].begin() + n_done[d], docs[d].begin() + n_done[d] + n);
+            seqs_ptr.push_back(&seqs[d]);
+            docs_idx.push_back(d);
+
+            n_tok += n;
+        }
+
+        ok = paged ?
+            biogpt_eval_paged(ctx, embd, seqs_ptr, out, n_threads, opts) :
+            biogpt_eval(ctx, embd[0], out, n_done[docs_idx[0]], n_threads, opts);
+        if (!ok) {
+            break;
+        }
+
+        int i_row = 0;
+        for (size_t k = 0; k < docs_idx.size(); k++) {
+            const int d = docs_idx[k];
+            const int n = embd[k].size();
+
+            float * dst = embeddings.data() + d*d_model;
+
+            if (pooling == BIOGPT_POOLING_MEAN) {
+                for (int t = std::max(0, n_skip(d) - n_done[d]); t < n; t++) {
+                    const float * row = rows + (i_row + t)*d_model;
+                    for (int j = 0; j < d_model; j++) {
+                        dst[j] += row[j];
+                    }
+                }
+            }
+
+            n_done[d] += n;
+            i_row     += n;
+
+            if (n_done[d] == (int) docs[d].size()) {
+                if (pooling == BIOGPT_POOLING_MEAN) {
+                    for (int j = 0; j < d_model; j++) {
+                        dst[j] /= n_done[d] - n_skip(d);
+                    }
+                } else {
+                    memcpy(dst, rows + (i_row - 1)*d_model, d_model*sizeof(float));
+                }
+
+                biogpt_kv_seq_free(ctx.kv_pool, seqs[d]);
+            }
+        }
+    }
+
+    for (auto & seq : seqs) {
+        biogpt_kv_seq_free(ctx.kv_pool, seq);
+    }
+
+    return ok;
+}
+
+//
+// generation
+//
+
+bool biogpt_generate(
+               biogpt_context & ctx,
+                biogpt_kv_seq & seq,
+         const token_sequence & prompt,
+ const biogpt_generate_params & gparams,
+               biogpt_sampler & smpl,
+                 std::mt19937 & rng,
+  const biogpt_token_callback & callback,
+       biogpt_generate_result & result) {
+    const int n_positions = ctx.model->hparams.n_positions;
+    const int n_prompt    = prompt.size();
+    const int n_batch     = std::max(1, ctx.cparams.n_batch);
+    const int n_predict   = std::min(gparams.n_predict, n_positions - n_prompt);
+
+    const biogpt_vocab::id eos_id = 2;
+
+    const bool paged = ctx.kv_pool.n_blocks > 0;
+
+    result = biogpt_generate_result();
+
+    // the last token of the prompt is always evaluated to get its logits
+    if (n_prompt == 0 || n_prompt > n_positions || seq.n_past >= n_prompt) {
+        fprintf(stderr, "%s: invalid prompt of %d tokens (n_past = %d)\n", __func__, n_prompt, seq.n_past);
+        result.stop = BIOGPT_STOP_ERROR;
+        return false;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    // polled before every evaluation, so a cancelled generation releases the compute within one batch
+    auto stop_requested = [&]() {
+        if (gparams.cancel && gparams.cancel->load()) {
+            result.stop = BIOGPT_STOP_CANCELLED;
+            return true;
+        }
+        if (gparams.t_max_us > 0 && ggml_time_us() - t_start_us >= gparams.t_max_us) {
+            result.stop = BIOGPT_STOP_DEADLINE;
+            return true;
+        }
+        return false;
+    };
+
+    std::vector<float> logits;
+
+    // the sampler reads the last row in place from the compute buffer
+    const float * logits_last = NULL;
+
+    biogpt_eval_opts opts;
+    opts.logits_view = &logits_last;
+
+    auto eval = [&](const token_sequence & embed) {
+        if (paged) {
+            return biogpt_eval_paged(ctx, { embed }, { &seq }, logits, gparams.n_threads, opts);
+        }
+
+        if (!biogpt_eval(ctx, embed, logits, seq.n_past, gparams.n_threads, opts)) {
+            return false;
+        }
+        seq.n_past += embed.size();
+
+        return true;
+    };
+
+    // the prompt counts towards the repetition penalties
+    biogpt_sampler_reset(smpl);
+    for (auto id : prompt) {
+        biogpt_sampler_accept(smpl, id);
+    }
+
+    while (seq.n_past < n_prompt) {
+        if (stop_requested()) {
+            return true;
+        }
+
+        const int i      = seq.n_past;
+        const int n_eval = std::min(n_batch, n_prompt - i);
+
+        const token_sequence embed(prompt.begin() + i, prompt.begin() + i + n_eval);
+
+        const int64_t t_eval_start_us = ggml_time_us();
+
+        if (!eval(embed)) {
+            result.stop = BIOGPT_STOP_ERROR;
+            return false;
+        }
+
+        result.t_prompt_us   += ggml_time_us() - t_eval_start_us;
+        result.n_prompt_eval += n_eval;
+
+        if (callback && !callback(embed, true)) {
+            result.stop = BIOGPT_STOP_CALLBACK;
+            return true;
+        }
+    }
+
+    token_sequence embed(1);
+
+    for (int n = 0; n < n_predict; n++) {
+        {
+            const int64_t t_sample_start_us = ggml_time_us();
+
+            embed[0] = biogpt_sampler_sample(smpl, logits_last, rng);
+            biogpt_sampler_accept(smpl, embed[0]);
+
+            result.t_sample_us += ggml_time_us() - t_sample_start_us;
+        }
+
+        result.tokens.push_back(embed[0]);
+
+        if (callback && !callback(embed, false)) {
+            result.stop = BIOGPT_STOP_CALLBACK;
+            return true;
+        }
+
+        if (embed[0] == eos_id) {
+            result.stop = BIOGPT_STOP_EOS;
+            return true;
+        }
+
+        // the last token is not evaluated, nothing would read its logits
+        if (n == n_predict - 1 || stop_requested()) {
+            break;
+        }
+
+        const int64_t t_eval_start_us = ggml_time_us();
+
+        if (!eval(embed)) {
+            result.stop = BIOGPT_STOP_ERROR;
+            return false;
+        }
+
+        result.t_predict_us += ggml_time_us() - t_eval_start_us;
+    }
+
+    return true;
+}
+
+//
+// session state
+//
+
+// visit the runs of contiguous cells holding the first n_tokens positions of a sequence
+// seq is NULL for the contiguous memory, where the cell of a position is the position itself
+template<typename F>
+static void biogpt_kv_for_each_run(const biogpt_context & ctx, const biogpt_kv_seq * seq, const int n_tokens, F fn) {
+    const int block_size = ctx.kv_pool.block_size;
+
+    for (int pos = 0; pos < n_tokens; ) {
+        int cell = pos;
+        int len  = n_tokens - pos;
+        if (seq) {
+            cell = seq->blocks[pos/block_size]*block_size + pos%block_size;
+            len  = std::min(len, block_size - pos%block_size);
+        }
+
+        fn(pos, cell, len);
+
+        pos += len;
+    }
+}
+
+// write the keys and values of the first tokens.size() positions, the tokens and the RNG state
+bool biogpt_session_save(
+        const std::string & fname,
+     const biogpt_context & ctx,
+      const biogpt_kv_seq * seq,
+                const int   n_past,
+     const token_sequence & tokens,
+       const std::mt19937 & rng) {
+    // the memory must hold every saved position
+    if ((int) tokens.size() > n_past || (seq && (int) tokens.size() > seq->n_past)) {
+        fprintf(stderr, "%s: %zu tokens but only %d evaluated positions\n", __func__, tokens.size(), seq ? std::min(n_past, seq->n_past) : n_past);
+        return false;
+    }
+
+    auto fout = std::ofstream(fname, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname.c_str());
+        return false;
+    }
+
+    const auto & hparams = ctx.model->hparams;
+
+    const int d_model = hparams.d_model;
+    const int n_cells = biogpt_kv_n_cells(ctx);
+
+    // header
+    {
+        uint32_t magic   = BIOGPT_SESSION_MAGIC;
+        uint32_t version = BIOGPT_SESSION_VERSION;
+
+        write_safe(fout, magic);
+        write_safe(fout, version);
+
+        int32_t n_layer     = hparams.n_layer;
+        int32_t n_positions = hparams.n_positions;
+        int32_t d_model_    = hparams.d_model;
+        int32_t mtype       = ctx.memory_k->type;
+
+        write_safe(fout, n_layer);
+        write_safe(fout, n_positions);
+        write_safe(fout, d_model_);
+        write_safe(fout, mtype);
+    }
+
+    // tokens
+    {
+        int32_t n_tokens = tokens.size();
+        write_safe(fout, n_tokens);
+        fout.write((const char *) tokens.data(), n_tokens*sizeof(biogpt_vocab::id));
+    }
+
+    // RNG state
+    {
+        std::stringstream ss;
+        ss << rng;
+
+        const std::string state = ss.str();
+
+        uint32_t len = state.size();
+        write_safe(fout, len);
+        fout.write(state.data(), len);
+    }
+
+    // key + value memory, layer by layer
+    {
+        const int n_tokens = tokens.size();
+
+        std::vector<uint8_t> buf;
+
+        for (auto * memory : { ctx.memory_k, ctx.memory_v }) {
+            const size_t row_size = ggml_element_size(memory)*d_model;
+
+            buf.resize(n_tokens*row_size);
+
+            for (int il = 0; il < hparams.n_layer; il++) {
+                biogpt_kv_for_each_run(ctx, seq, n_tokens, [&](int pos, int cell, int len) {
+                    ggml_backend_tensor_get(memory, buf.data() + pos*row_size, (il*n_cells + cell)*row_size, len*row_size);
+                });
+
+                fout.write((const char *) buf.data(), buf.size());
+            }
+        }
+    }
+
+    return fout.good();
+}
+
+// restore a session written by biogpt_session_save; in paged mode, seq must be empty
+bool biogpt_session_load(
+        const std::string & fname,
+           biogpt_context & ctx,
+            biogpt_kv_seq * seq,
+           token_sequence & tokens,
+             std::mt19937 & rng) {
+    auto fin = std::ifstream(fname, std::ios::binary);
+    if (!fin) {
+        return false;
+    }
+
+    const auto & hparams = ctx.model->hparams;
+
+    const int d_model = hparams.d_model;
+    const int n_cells = biogpt_kv_n_cells(ctx);
+
+    // header
+    {
+        uint32_t magic;
+        uint32_t version;
+
+        read_safe(fin, magic);
+        read_safe(fin, version);
+
+        if (magic != BIOGPT_SESSION_MAGIC || version != BIOGPT_SESSION_VERSION) {
+            fprintf(stderr, "%s: invalid session file '%s' (bad magic or version)\n", __func__, fname.c_str());
+            return false;
+        }
+
+        int32_t n_layer, n_positions, d_model_, mtype;
+
+        read_safe(fin, n_layer);
+        read_safe(fin, n_positions);
+        read_safe(fin, d_model_);
+        read_safe(fin, mtype);
+
+        if (n_layer != hparams.n_layer || n_positions != hparams.n_positions || d_model_ != d_model || mtype != ctx.memory_k->type) {
+            fprintf(stderr, "%s: session file '%s' does not match the model\n", __func__, fname.c_str());
+            return false;
+        }
+    }
+
+    // tokens
+    {
+        int32_t n_tokens;
+        read_safe(fin, n_tokens);
+
+        if (n_tokens < 0 || n_tokens > hparams.n_positions) {
+            fprintf(stderr, "%s: invalid session file '%s' (bad number of tokens %d)\n", __func__, fname.c_str(), n_tokens);
+            return false;
+        }
+
+        tokens.resize(n_tokens);
+        fin.read((char *) tokens.data(), n_tokens*sizeof(biogpt_vocab::id));
+
+        for (const auto id : tokens) {
+            if (id < 0 || id >= hparams.n_vocab) {
+                fprintf(stderr, "%s: invalid session file '%s' (bad token id %d)\n", __func__, fname.c_str(), id);
+                return false;
+            }
+        }
+    }
+
+    // RNG state, about 7 KB of text for mt19937
+    std::mt19937 rng_file;
+    {
+        const uint32_t max_len = 16*1024;
+
+        uint32_t len;
+        read_safe(fin, len);
+
+        if (len > max_len) {
+            fprintf(stderr, "%s: invalid session file '%s' (bad RNG state length %u)\n", __func__, fname.c_str(), len);
+            return false;
+        }
+
+        std::string state(len, 0);
+        fin.read(&state[0], len);
+
+        std::stringstream ss(state);
+        if (!(ss >> rng_file)) {
+            fprintf(stderr, "%s: invalid session file '%s' (bad RNG state)\n", __func__, fname.c_str());
+            return false;
+        }
+    }
+
+    const int n_tokens = tokens.size();
+
+    if (seq) {
+        GGML_ASSERT(seq->blocks.empty() && seq->n_past == 0);
+
+        if (!biogpt_kv_seq_reserve(ctx.kv_pool, *seq, n_tokens)) {
+            fprintf(stderr, "%s: out of key + value memory blocks\n", __func__);
+            return false;
+        }
+    }
+
+    // key + value memory, layer by layer
+    {
+        std::vector<uint8_t> buf;
+
+        for (auto * memory : { ctx.memory_k, ctx.memory_v }) {
+            const size_t row_size = ggml_element_size(memory)*d_model;
+
+            buf.resize(n_tokens*row_size);
+
+            for (int il = 0; il < hparams.n_layer; il++) {
+                fin.read((char *) buf.data(), buf.size());
+
+                biogpt_kv_for_each_run(ctx, seq, n_tokens, [&](int pos, int cell, int len) {
+                    ggml_backend_tensor_set(memory, buf.data() + pos*row_size, (il*n_cells + cell)*row_size, len*row_size);
+                });
+            }
+        }
+    }
+
+    if (!fin) {
+        fprintf(stderr, "%s: invalid session file '%s' (truncated)\n", __func__, fname.c_str());
+        if (seq) {
+            biogpt_kv_seq_free(ctx.kv_pool, *seq);
+        }
+        return false;
+    }
+
+    if (seq) {
+        seq->n_past = n_tokens;
+    }
+
+    rng = rng_file;
+
+    return true;
+}
 
-            // key + value memory
-            if (N >= 1) {
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.memory_k, N*d_model, (ggml_element_size(model.memory_k)*d_model)*(layer_ix*n_positions + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctx0, model.memory_v, N*d_model, (ggml_element_size(model.memory_v)*d_model)*(layer_ix*n_positions + n_past));
+//
+// prefix cache
+//
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_curr, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_curr, v));
-            }
+// attach the longest cached prefix of `tokens` to the empty sequence `seq` and return its length
+// at least one token is left to evaluate, so that the caller always gets the logits of the last token
+int biogpt_prefix_cache_lookup(
+      biogpt_prefix_cache & cache,
+           biogpt_kv_pool & pool,
+     const token_sequence & tokens,
+            biogpt_kv_seq & seq) {
+    GGML_ASSERT(seq.blocks.empty() && seq.n_past == 0);
 
-            // (d_kv, N, n_head)
-            struct ggml_tensor * Q = ggml_permute(ctx0, ggml_cpy(ctx0, q_curr, ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, d_kv, n_head, N)), 0, 2, 1, 3);
+    const int block_size = pool.block_size;
+    const int n_max      = ((int) tokens.size() - 1)/block_size;
 
-            // (d_kv, N + n_past, n_head)
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, model.memory_k, (n_past + N)*d_model, layer_ix*n_positions*ggml_element_size(model.memory_k)*d_model),
-                            d_kv, n_head, n_past + N),
-                        0, 2, 1, 3);
+    cache.n_lookups++;
+    cache.clock++;
 
-            // (N + n_past, N, n_head)
-            struct ggml_tensor * QK = ggml_mul_mat(ctx0, K, Q);
+    biogpt_prefix_node * node = &cache.root;
 
-            // softmax
-            struct ggml_tensor * attn_weights = ggml_soft_max(ctx0, QK);
+    for (int i = 0; i < n_max; i++) {
+        token_sequence key(tokens.begin() + i*block_size, tokens.begin() + (i + 1)*block_size);
 
-            // [N + n_past, d_kv, n_head]
-            struct ggml_tensor * V_trans =
-                ggml_cpy(ctx0,
-                        ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
-                                ggml_view_1d(ctx0, model.memory_v, (n_past + N)*d_model, layer_ix*n_positions*ggml_element_size(model.memory_v)*d_model),
-                                d_kv, n_head, n_past + N),
-                        1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, model.memory_v->type, n_past + N, d_kv, n_head)
-            );
+        auto it = node->children.find(key);
+        if (it == node->children.end()) {
+            break;
+        }
 
-            // [d_kv, N, n_head]
-            struct ggml_tensor * attn_outputs = ggml_mul_mat(ctx0, V_trans, attn_weights);
+        node = it->second.get();
+        node->last_used = cache.clock;
 
-            // [d_kv, n_head, N]
-            struct ggml_tensor * attn_outputs_merged = ggml_permute(ctx0, attn_outputs, 0, 2, 1, 3);
+        biogpt_kv_block_retain(pool, node->block);
+        seq.blocks.push_back(node->block);
+        seq.n_past += block_size;
+    }
 
-            // [d_model, N]
-            current = ggml_cpy(ctx0, attn_outputs_merged, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, d_model, N));
+    if (seq.n_past > 0) {
+        cache.n_hits++;
+    }
 
-            // output projection
-            current = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].o_proj_w, current);
-            current = ggml_add(ctx0, current, ggml_repeat(ctx0, model.layers_decoder[layer_ix].o_proj_b, current));
-        }
+    cache.n_tokens_reused += seq.n_past;
+    cache.n_tokens_missed += tokens.size() - seq.n_past;
 
-        // residual connection
-        current = ggml_add(ctx0, current, inpL);
+    return seq.n_past;
+}
 
-        struct ggml_tensor * inpFF = current;
+// store the full blocks of an evaluated sequence, `tokens` being the tokens of its first n_past positions
+void biogpt_prefix_cache_insert(
+      biogpt_prefix_cache & cache,
+           biogpt_kv_pool & pool,
+     const token_sequence & tokens,
+      const biogpt_kv_seq & seq) {
+    const int block_size = pool.block_size;
+    const int n_full     = std::min(seq.n_past, (int) tokens.size())/block_size;
 
-        // feed forward
-        {
-            // final layer norm
-            current = ggml_norm(ctx0, inpFF, NORM_EPS);
-            current = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].ln_1_w, current), current), ggml_repeat(ctx0, model.layers_decoder[layer_ix].ln_1_b, current));
+    cache.clock++;
 
-            // fc1
-            current = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].fc_0_w, current);
-            current = ggml_add(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].fc_0_b, current), current);
+    biogpt_prefix_node * node = &cache.root;
 
-            // gelu
-            current = ggml_gelu(ctx0, current);
+    for (int i = 0; i < n_full; i++) {
+        token_sequence key(tokens.begin() + i*block_size, tokens.begin() + (i + 1)*block_size);
 
-            // fc2
-            current = ggml_mul_mat(ctx0, model.layers_decoder[layer_ix].fc_1_w, current);
-            current = ggml_add(ctx0, ggml_repeat(ctx0, model.layers_decoder[layer_ix].fc_1_b, current), current);
+        auto it = node->children.find(key);
+        if (it == node->children.end()) {
+            std::unique_ptr<biogpt_prefix_node> child(new biogpt_prefix_node);
+
+            child->tokens = key;
+            child->block  = seq.blocks[i];
+            child->parent = node;
+
+            biogpt_kv_block_retain(pool, child->block);
+            cache.n_blocks++;
+
+            it = node->children.insert(std::make_pair(key, std::move(child))).first;
         }
 
-        // residual connection
-        inpL = ggml_add(ctx0, current, inpFF);
+        node = it->second.get();
+        node->last_used = cache.clock;
     }
 
-    // final norm layer
-    inpL = ggml_norm(ctx0, inpL, NORM_EPS);
-    inpL = ggml_add(ctx0, ggml_mul(ctx0, ggml_repeat(ctx0, model.ln_w, inpL), inpL), ggml_repeat(ctx0, model.ln_b, inpL));
+    if (cache.n_blocks > cache.n_blocks_max) {
+        biogpt_prefix_cache_evict(cache, pool, cache.n_blocks - cache.n_blocks_max);
+    }
+}
 
-    // lm head
-    inpL = ggml_mul_mat(ctx0, model.lm_head, inpL);
+static void biogpt_prefix_cache_collect_leaves(biogpt_prefix_node * node, std::vector<biogpt_prefix_node *> & leaves) {
+    for (auto & child : node->children) {
+        biogpt_prefix_node * c = child.second.get();
+        if (c->children.empty()) {
+            leaves.push_back(c);
+        } else {
+            biogpt_prefix_cache_collect_leaves(c, leaves);
+        }
+    }
+}
 
-    ggml_build_forward_expand(gf, inpL);
-    
-    ggml_free(ctx0);
+// drop up to n_blocks least recently used leaves, returns the number of blocks returned to the pool: a
+// block still used by a live sequence is only freed with that sequence
+// the leaves are collected once into a min-heap on last_used, and a parent left without children joins it
+int biogpt_prefix_cache_evict(
+      biogpt_prefix_cache & cache,
+           biogpt_kv_pool & pool,
+                const int   n_blocks) {
+    int n_evicted = 0;
+    int n_freed   = 0;
+
+    if (n_blocks <= 0) {
+        return 0;
+    }
 
-    return gf;
-}
+    auto later = [](const biogpt_prefix_node * a, const biogpt_prefix_node * b) {
+        return a->last_used > b->last_used;
+    };
 
-bool biogpt_eval(
-       const biogpt_model & model,
-     const token_sequence & embed_inp,
-       std::vector<float> & logits,
-       struct ggml_allocr * allocr,
-                const int   n_past,
-                const int   n_threads) {
-    const int N = embed_inp.size();
+    std::vector<biogpt_prefix_node *> leaves;
+    biogpt_prefix_cache_collect_leaves(&cache.root, leaves);
+    std::make_heap(leaves.begin(), leaves.end(), later);
 
-    const auto & hparams = model.hparams;
+    while (n_evicted < n_blocks && !leaves.empty()) {
+        std::pop_heap(leaves.begin(), leaves.end(), later);
+        biogpt_prefix_node * lru = leaves.back();
+        leaves.pop_back();
 
-    const int n_vocab = hparams.n_vocab;
+        biogpt_prefix_node * parent = lru->parent;
 
-    // reset the allocator to free all the memory allocated during the previous inference
-    ggml_allocr_reset(allocr);
+        biogpt_kv_block_release(pool, lru->block);
+        if (pool.ref_count[lru->block] == 0) {
+            n_freed++;
+        }
 
-    struct ggml_cgraph * gf = biogpt_graph(model, allocr, embed_inp, n_past);
+        // erased through an iterator: the key is owned by the node being erased
+        parent->children.erase(parent->children.find(lru->tokens));
 
-    // allocate tensors
-    ggml_allocr_alloc_graph(allocr, gf);
+        if (parent != &cache.root && parent->children.empty()) {
+            leaves.push_back(parent);
+            std::push_heap(leaves.begin(), leaves.end(), later);
+        }
 
-    // run the computation
-    if (ggml_backend_is_cpu(model.backend)) {
-        ggml_backend_cpu_set_n_threads(model.backend, n_threads);
+        cache.n_blocks--;
+        cache.n_evictions++;
+        n_evicted++;
     }
 
-    ggml_backend_graph_compute(model.backend, gf);
+    return n_freed;
+}
 
-    struct ggml_tensor * inpL = gf->nodes[gf->n_nodes - 1];
+void biogpt_prefix_cache_clear(
+      biogpt_prefix_cache & cache,
+           biogpt_kv_pool & pool) {
+    biogpt_prefix_cache_evict(cache, pool, cache.n_blocks);
+}
 
-    // return result for just the last token
-    logits.resize(n_vocab);
-    ggml_backend_tensor_get(inpL, logits.data(), (N - 1)*n_vocab*sizeof(float), n_vocab*sizeof(float));
+void biogpt_prefix_cache_print_stats(const biogpt_prefix_cache & cache) {
+    const int64_t n_tokens = cache.n_tokens_reused + cache.n_tokens_missed;
 
-    return true;
+    fprintf(stderr, "%s: lookups = %lld, hits = %lld (%.1f%%), evictions = %lld\n", __func__,
+            (long long) cache.n_lookups, (long long) cache.n_hits, 100.0*cache.n_hits/std::max<int64_t>(1, cache.n_lookups),
+            (long long) cache.n_evictions);
+    fprintf(stderr, "%s: tokens reused = %lld / %lld (%.1f%%), cached blocks = %d / %d\n", __func__,
+            (long long) cache.n_tokens_reused, (long long) n_tokens, 100.0*cache.n_tokens_reused/std::max<int64_t>(1, n_tokens),
+            cache.n_blocks, cache.n_blocks_max);
 }
 
 // Extracted from https://github.com/ggerganov/ggml/blob/master/examples/common.cpp
@@ -851,6 +3570,8 @@ token_sequence gpt_tokenize(
           biogpt_vocab & vocab,
      const std::string & text,
      const std::string & lang) {
+    biogpt_phase_timer timer(BIOGPT_PHASE_TOKENIZE);
+
     // Moses tokenization
     std::vector<std::string> words = moses_tokenize(text, lang);
 
@@ -875,6 +3596,8 @@ token_sequence gpt_tokenize(
 }
 
 std::string gpt_decode(std::vector<std::string>& tokens, const std::string& lang) {
+    biogpt_phase_timer timer(BIOGPT_PHASE_DETOKENIZE);
+
     // remove bpe
     std::transform(tokens.begin(), tokens.end(), tokens.begin(), [](std::string t) {
         t = std::regex_replace(t, std::regex(" "), "");
@@ -979,6 +3702,503 @@ biogpt_vocab::id biogpt_sample_top_k_top_p(
     return logits_id[idx].second;
 }
 
+biogpt_vocab::id biogpt_sample_probs(
+              const float * probs,
+                const int   n_vocab,
+             std::mt19937 & rng) {
+    std::discrete_distribution<> dist(probs, probs + n_vocab);
+    return dist(rng);
+}
+
+static float biogpt_vec_max_f32(const float * x, const int n) {
+    float max = -INFINITY;
+
+    int i = 0;
+#if defined(__AVX__)
+    __m256 vmax = _mm256_set1_ps(-INFINITY);
+    for (; i + 8 <= n; i += 8) {
+        vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x + i));
+    }
+
+    float tmp[8];
+    _mm256_storeu_ps(tmp, vmax);
+    for (int j = 0; j < 8; j++) {
+        max = std::max(max, tmp[j]);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t vmax = vdupq_n_f32(-INFINITY);
+    for (; i + 4 <= n; i += 4) {
+        vmax = vmaxq_f32(vmax, vld1q_f32(x + i));
+    }
+    max = vmaxvq_f32(vmax);
+#endif
+    for (; i < n; i++) {
+        max = std::max(max, x[i]);
+    }
+
+    return max;
+}
+
+static void biogpt_vec_scale_f32(float * x, const int n, const float s) {
+    int i = 0;
+#if defined(__AVX__)
+    const __m256 vs = _mm256_set1_ps(s);
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), vs));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(x + i, vmulq_n_f32(vld1q_f32(x + i), s));
+    }
+#endif
+    for (; i < n; i++) {
+        x[i] *= s;
+    }
+}
+
+static bool biogpt_sampler_parse_chain(
+        const std::string & str,
+        std::vector<biogpt_sampler_stage> & chain) {
+    chain.clear();
+
+    std::stringstream ss(str);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        if (name == "penalties") {
+            chain.push_back(BIOGPT_SAMPLER_PENALTIES);
+        } else if (name == "temp") {
+            chain.push_back(BIOGPT_SAMPLER_TEMP);
+        } else if (name == "top_k") {
+            chain.push_back(BIOGPT_SAMPLER_TOP_K);
+        } else if (name == "top_p") {
+            chain.push_back(BIOGPT_SAMPLER_TOP_P);
+        } else if (name == "min_p") {
+            chain.push_back(BIOGPT_SAMPLER_MIN_P);
+        } else {
+            fprintf(stderr, "%s: unknown sampler '%s'\n", __func__, name.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool biogpt_sampler_init(
+               biogpt_sampler & smpl,
+  const biogpt_sampler_params & sparams,
+                    const int   n_vocab) {
+    smpl.params = sparams;
+
+    if (!biogpt_sampler_parse_chain(sparams.chain, smpl.chain)) {
+        return false;
+    }
+
+    smpl.n_vocab = n_vocab;
+
+    smpl.logits.resize(n_vocab);
+    smpl.probs.resize(n_vocab);
+    smpl.ids.resize(n_vocab);
+
+    smpl.prev.assign(std::max(0, sparams.repeat_last_n), 0);
+    smpl.counts.assign(n_vocab, 0);
+    smpl.stamps.assign(n_vocab, 0);
+    smpl.stamp = 0;
+
+    biogpt_sampler_reset(smpl);
+
+    return true;
+}
+
+biogpt_sampler_params biogpt_params_to_sampler(const biogpt_params & params) {
+    biogpt_sampler_params sparams;
+
+    sparams.temp             = params.temp;
+    sparams.top_k            = params.top_k;
+    sparams.top_p            = params.top_p;
+    sparams.min_p            = params.min_p;
+    sparams.repeat_penalty   = params.repeat_penalty;
+    sparams.freq_penalty     = params.freq_penalty;
+    sparams.presence_penalty = params.presence_penalty;
+    sparams.repeat_last_n    = params.repeat_last_n;
+    sparams.chain            = params.samplers;
+
+    return sparams;
+}
+
+biogpt_generate_params biogpt_params_to_generate(const biogpt_params & params) {
+    biogpt_generate_params gparams;
+
+    gparams.n_predict = params.n_predict;
+    gparams.n_threads = params.n_threads;
+    gparams.t_max_us  = (int64_t) params.timeout_ms*1000;
+
+    return gparams;
+}
+
+void biogpt_sampler_reset(biogpt_sampler & smpl) {
+    std::fill(smpl.counts.begin(), smpl.counts.end(), 0);
+
+    smpl.prev_head = 0;
+    smpl.n_prev    = 0;
+}
+
+void biogpt_sampler_accept(
+           biogpt_sampler & smpl,
+         biogpt_vocab::id   id) {
+    const int n = smpl.prev.size();
+    if (n == 0) {
+        return;
+    }
+
+    // the window is full: forget the oldest token
+    if (smpl.n_prev == n) {
+        smpl.counts[smpl.prev[smpl.prev_head]]--;
+    } else {
+        smpl.n_prev++;
+    }
+
+    smpl.prev[smpl.prev_head] = id;
+    smpl.counts[id]++;
+
+    smpl.prev_head = (smpl.prev_head + 1) % n;
+}
+
+static float biogpt_sampler_max_logit(const biogpt_sampler & smpl) {
+    if (smpl.sorted) {
+        return smpl.logits[smpl.ids[0]];
+    }
+
+    // every token is a candidate: the ids are a permutation of the vocabulary
+    if (smpl.n_cand == smpl.n_vocab) {
+        return biogpt_vec_max_f32(smpl.logits.data(), smpl.n_vocab);
+    }
+
+    float max = -INFINITY;
+    for (int i = 0; i < smpl.n_cand; i++) {
+        max = std::max(max, smpl.logits[smpl.ids[i]]);
+    }
+
+    return max;
+}
+
+static void biogpt_sampler_softmax(biogpt_sampler & smpl) {
+    const float max = biogpt_sampler_max_logit(smpl);
+
+    float sum = 0.0f;
+    for (int i = 0; i < smpl.n_cand; i++) {
+        const float p = expf(smpl.logits[smpl.ids[i]] - max);
+        smpl.probs[i] = p;
+        sum += p;
+    }
+
+    biogpt_vec_scale_f32(smpl.probs.data(), smpl.n_cand, 1.0f/sum);
+}
+
+// CTRL repetition penalty, then OpenAI frequency and presence penalties, once per distinct token
+static void biogpt_sampler_penalties(biogpt_sampler & smpl) {
+    const auto & sp = smpl.params;
+
+    if (smpl.n_prev == 0 || (sp.repeat_penalty == 1.0f && sp.freq_penalty == 0.0f && sp.presence_penalty == 0.0f)) {
+        return;
+    }
+
+    if (++smpl.stamp == 0) {
+        std::fill(smpl.stamps.begin(), smpl.stamps.end(), 0);
+        smpl.stamp = 1;
+    }
+
+    for (int i = 0; i < smpl.n_prev; i++) {
+        const int32_t id = smpl.prev[i];
+        if (smpl.stamps[id] == smpl.stamp) {
+            continue;
+        }
+        smpl.stamps[id] = smpl.stamp;
+
+        float & logit = smpl.logits[id];
+        logit  = logit > 0.0f ? logit/sp.repeat_penalty : logit*sp.repeat_penalty;
+        logit -= smpl.counts[id]*sp.freq_penalty + sp.presence_penalty;
+    }
+
+    smpl.sorted = false;
+}
+
+static void biogpt_sampler_temp(biogpt_sampler & smpl) {
+    const float temp = smpl.params.temp;
+
+    // greedy: keep the most likely candidate
+    if (temp <= 0.0f) {
+        int best = 0;
+        for (int i = 1; i < smpl.n_cand; i++) {
+            if (smpl.logits[smpl.ids[i]] > smpl.logits[smpl.ids[best]]) {
+                best = i;
+            }
+        }
+
+        smpl.ids[0] = smpl.ids[best];
+        smpl.n_cand = 1;
+        smpl.sorted = true;
+        return;
+    }
+
+    if (temp == 1.0f) {
+        return;
+    }
+
+    if (smpl.n_cand == smpl.n_vocab) {
+        biogpt_vec_scale_f32(smpl.logits.data(), smpl.n_vocab, 1.0f/temp);
+    } else {
+        for (int i = 0; i < smpl.n_cand; i++) {
+            smpl.logits[smpl.ids[i]] /= temp;
+        }
+    }
+}
+
+static void biogpt_sampler_top_k(biogpt_sampler & smpl) {
+    const int k = smpl.params.top_k;
+    if (k <= 0 || k >= smpl.n_cand) {
+        return;
+    }
+
+    const float * logits = smpl.logits.data();
+    const auto cmp = [logits](const int32_t a, const int32_t b) {
+        return logits[a] > logits[b];
+    };
+
+    int32_t * ids = smpl.ids.data();
+    if (!smpl.sorted) {
+        // linear-time selection of the k largest, then sort only those
+        std::nth_element(ids, ids + k - 1, ids + smpl.n_cand, cmp);
+        std::sort(ids, ids + k, cmp);
+    }
+
+    smpl.n_cand = k;
+    smpl.sorted = true;
+}
+
+static void biogpt_sampler_top_p(biogpt_sampler & smpl) {
+    const float top_p = smpl.params.top_p;
+    if (top_p >= 1.0f) {
+        return;
+    }
+
+    if (!smpl.sorted) {
+        const float * logits = smpl.logits.data();
+        std::sort(smpl.ids.begin(), smpl.ids.begin() + smpl.n_cand, [logits](const int32_t a, const int32_t b) {
+            return logits[a] > logits[b];
+        });
+        smpl.sorted = true;
+    }
+
+    biogpt_sampler_softmax(smpl);
+
+    // keep the smallest set of candidates whose cumulative probability reaches top_p
+    float cumsum = 0.0f;
+    for (int i = 0; i < smpl.n_cand; i++) {
+        cumsum += smpl.probs[i];
+        if (cumsum >= top_p) {
+            smpl.n_cand = i + 1;
+            break;
+        }
+    }
+}
+
+// p >= min_p*p_max is logit >= logit_max + log(min_p): no softmax needed
+static void biogpt_sampler_min_p(biogpt_sampler & smpl) {
+    const float min_p = smpl.params.min_p;
+    if (min_p <= 0.0f) {
+        return;
+    }
+
+    const float threshold = biogpt_sampler_max_logit(smpl) + logf(min_p);
+
+    int n_keep = 0;
+    for (int i = 0; i < smpl.n_cand; i++) {
+        if (smpl.logits[smpl.ids[i]] >= threshold) {
+            smpl.ids[n_keep++] = smpl.ids[i];
+        }
+    }
+
+    smpl.n_cand = n_keep;
+}
+
+void biogpt_sampler_apply(
+           biogpt_sampler & smpl,
+              const float * logits) {
+    memcpy(smpl.logits.data(), logits, smpl.n_vocab*sizeof(float));
+
+    for (int i = 0; i < smpl.n_vocab; i++) {
+        smpl.ids[i] = i;
+    }
+
+    smpl.n_cand = smpl.n_vocab;
+    smpl.sorted = false;
+
+    for (const auto stage : smpl.chain) {
+        switch (stage) {
+            case BIOGPT_SAMPLER_PENALTIES: biogpt_sampler_penalties(smpl); break;
+            case BIOGPT_SAMPLER_TEMP:      biogpt_sampler_temp(smpl);      break;
+            case BIOGPT_SAMPLER_TOP_K:     biogpt_sampler_top_k(smpl);     break;
+            case BIOGPT_SAMPLER_TOP_P:     biogpt_sampler_top_p(smpl);     break;
+            case BIOGPT_SAMPLER_MIN_P:     biogpt_sampler_min_p(smpl);     break;
+        }
+    }
+
+    biogpt_sampler_softmax(smpl);
+}
+
+biogpt_vocab::id biogpt_sampler_sample(
+           biogpt_sampler & smpl,
+              const float * logits,
+             std::mt19937 & rng) {
+    biogpt_phase_timer timer(BIOGPT_PHASE_SAMPLE);
+
+    biogpt_sampler_apply(smpl, logits);
+
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    const float r = uniform(rng);
+
+    float cumsum = 0.0f;
+    for (int i = 0; i < smpl.n_cand - 1; i++) {
+        cumsum += smpl.probs[i];
+        if (r < cumsum) {
+            return smpl.ids[i];
+        }
+    }
+
+    return smpl.ids[smpl.n_cand - 1];
+}
+
+void biogpt_sampler_probs(
+           biogpt_sampler & smpl,
+              const float * logits,
+                    float * probs) {
+    biogpt_sampler_apply(smpl, logits);
+
+    std::fill(probs, probs + smpl.n_vocab, 0.0f);
+    for (int i = 0; i < smpl.n_cand; i++) {
+        probs[smpl.ids[i]] = smpl.probs[i];
+    }
+}
+
+// standard speculative sampling: the drafted tokens are accepted with probability min(1, p/q) and the
+// first rejected one is resampled from max(0, p - q), so that the output follows the target distribution
+//   p: (n_draft + 1) x n_vocab target probabilities
+//   q: n_draft x n_vocab draft probabilities, or NULL if the drafts are deterministic (q is one-hot)
+// returns the number of accepted tokens and writes the token that follows them to `next`
+int biogpt_speculative_accept(
+              const float * p,
+              const float * q,
+     const token_sequence & draft,
+                const int   n_vocab,
+             std::mt19937 & rng,
+         biogpt_vocab::id & next) {
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+    std::vector<float> residual(n_vocab);
+
+    const int n_draft = draft.size();
+
+    for (int i = 0; i < n_draft; i++) {
+        const float * p_i = p + i*n_vocab;
+        const float * q_i = q ? q + i*n_vocab : NULL;
+
+        const biogpt_vocab::id id = draft[i];
+
+        const float p_id = p_i[id];
+        const float q_id = q_i ? q_i[id] : 1.0f;
+
+        if (q_id > 0.0f && uniform(rng) < std::min(1.0f, p_id/q_id)) {
+            continue;
+        }
+
+        // rejected: resample from the normalized residual distribution
+        float sum = 0.0f;
+        for (int k = 0; k < n_vocab; k++) {
+            const float q_k = q_i ? q_i[k] : (k == id ? 1.0f : 0.0f);
+            residual[k] = std::max(0.0f, p_i[k] - q_k);
+            sum += residual[k];
+        }
+
+        next = sum > 0.0f ? biogpt_sample_probs(residual.data(), n_vocab, rng) : biogpt_sample_probs(p_i, n_vocab, rng);
+
+        return i;
+    }
+
+    // all the drafts are accepted: sample one more token from the target
+    next = biogpt_sample_probs(p + n_draft*n_vocab, n_vocab, rng);
+
+    return n_draft;
+}
+
+// verify a draft against the target logits of its n_draft + 1 rows, row i following draft[0, i)
+// `accepted` receives the accepted drafts and the token that follows them, cut after the first eos_id
+// and to at most n_max tokens; p is a work buffer for the target distributions
+// returns the number of drafts kept in `accepted`
+int biogpt_speculative_verify(
+           biogpt_sampler & smpl,
+              const float * rows,
+              const float * q,
+     const token_sequence & draft,
+   const biogpt_vocab::id   eos_id,
+                const int   n_max,
+             std::mt19937 & rng,
+       std::vector<float> & p,
+           token_sequence & accepted) {
+    const int n_vocab = smpl.n_vocab;
+    const int n_rows  = draft.size() + 1;
+
+    p.resize(n_rows*n_vocab);
+    for (int i = 0; i < n_rows; i++) {
+        biogpt_sampler_probs(smpl, rows + i*n_vocab, p.data() + i*n_vocab);
+    }
+
+    biogpt_vocab::id next = 0;
+    const int n_accept = biogpt_speculative_accept(p.data(), q, draft, n_vocab, rng, next);
+
+    accepted.assign(draft.begin(), draft.begin() + n_accept);
+    accepted.push_back(next);
+
+    // nothing follows the end of the text
+    const auto it_eos = std::find(accepted.begin(), accepted.end(), eos_id);
+    if (it_eos != accepted.end()) {
+        accepted.erase(it_eos + 1, accepted.end());
+    }
+
+    if ((int) accepted.size() > n_max) {
+        accepted.resize(std::max(0, n_max));
+    }
+
+    return std::min<int>(n_accept, accepted.size());
+}
+
+// draft the continuation of `history` by finding its last n-gram (longest first, up to n_ngram) in the
+// prompt and copying up to n_draft tokens that follow the most recent match
+token_sequence biogpt_prompt_lookup(
+     const token_sequence & prompt,
+     const token_sequence & history,
+                const int   n_ngram,
+                const int   n_draft) {
+    const int n_prompt  = prompt.size();
+    const int n_history = history.size();
+
+    for (int n = std::min(n_ngram, n_history); n >= 1; n--) {
+        const biogpt_vocab::id * ngram = history.data() + n_history - n;
+
+        for (int i = n_prompt - n - 1; i >= 0; i--) {
+            if (!std::equal(ngram, ngram + n, prompt.begin() + i)) {
+                continue;
+            }
+
+            const int i_draft = i + n;
+            const int n_copy  = std::min(n_draft, n_prompt - i_draft);
+
+            return token_sequence(prompt.begin() + i_draft, prompt.begin() + i_draft + n_copy);
+        }
+    }
+
+    return token_sequence();
+}
+
 bool biogpt_params_parse(int argc, char ** argv, biogpt_params & params) {
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
@@ -993,6 +4213,8 @@ bool biogpt_params_parse(int argc, char ** argv, biogpt_params & params) {
             params.prompt = argv[++i];
         } else if (arg == "-n" || arg == "--n_predict") {
             params.n_predict = std::stoi(argv[++i]);
+        } else if (arg == "--timeout") {
+            params.timeout_ms = std::stoi(argv[++i]);
         } else if (arg == "-v" || arg == "--verbosity") {
             params.verbosity = std::stoi(argv[++i]);
         } else if (arg == "--top_k") {
@@ -1001,10 +4223,70 @@ bool biogpt_params_parse(int argc, char ** argv, biogpt_params & params) {
             params.top_p = std::stof(argv[++i]);
         } else if (arg == "--temp") {
             params.temp = std::stof(argv[++i]);
+        } else if (arg == "--min_p") {
+            params.min_p = std::stof(argv[++i]);
+        } else if (arg == "--repeat_penalty") {
+            params.repeat_penalty = std::stof(argv[++i]);
+        } else if (arg == "--frequency_penalty") {
+            params.freq_penalty = std::stof(argv[++i]);
+        } else if (arg == "--presence_penalty") {
+            params.presence_penalty = std::stof(argv[++i]);
+        } else if (arg == "--repeat_last_n") {
+            params.repeat_last_n = std::stoi(argv[++i]);
+        } else if (arg == "--samplers") {
+            params.samplers = argv[++i];
         } else if (arg == "-b" || arg == "--batch_size") {
             params.n_batch = std::stoi(argv[++i]);
+        } else if (arg == "-f" || arg == "--file") {
+            params.prompt_file = argv[++i];
+        } else if (arg == "--prompt_cache" || arg == "--prompt-cache") {
+            params.prompt_cache = argv[++i];
+        } else if (arg == "--beams") {
+            params.n_beams = std::stoi(argv[++i]);
+        } else if (arg == "--length_penalty") {
+            params.length_penalty = std::stof(argv[++i]);
+        } else if (arg == "--no_early_stopping") {
+            params.early_stopping = false;
+        } else if (arg == "--kv_blocks") {
+            params.n_kv_blocks = std::stoi(argv[++i]);
+        } else if (arg == "--cache_blocks") {
+            params.n_cache_blocks = std::stoi(argv[++i]);
         } else if (arg == "-m" || arg == "--model") {
             params.model = argv[++i];
+        } else if (arg == "-md" || arg == "--model_draft") {
+            params.model_draft = argv[++i];
+        } else if (arg == "--draft") {
+            params.n_draft = std::stoi(argv[++i]);
+        } else if (arg == "--draft_layers") {
+            params.n_draft_layers = std::stoi(argv[++i]);
+        } else if (arg == "--labels") {
+            params.labels = argv[++i];
+        } else if (arg == "--pooling") {
+            params.pooling = argv[++i];
+        } else if (arg == "--normalize") {
+            params.normalize = true;
+        } else if (arg == "-o" || arg == "--output") {
+            params.output = argv[++i];
+        } else if (arg == "--ngram") {
+            params.n_ngram = std::stoi(argv[++i]);
+        } else if (arg == "--host") {
+            params.hostname = argv[++i];
+        } else if (arg == "--port") {
+            params.port = std::stoi(argv[++i]);
+        } else if (arg == "--workers") {
+            params.n_workers = std::stoi(argv[++i]);
+        } else if (arg == "--queue") {
+            params.n_queue = std::stoi(argv[++i]);
+        } else if (arg == "--profile") {
+            params.profile = true;
+        } else if (arg == "--trace") {
+            params.trace = argv[++i];
+        } else if (arg == "--parallel") {
+            params.n_parallel = std::stoi(argv[++i]);
+        } else if (arg == "--checkpoint") {
+            params.checkpoint = argv[++i];
+        } else if (arg == "--chunks") {
+            params.n_chunks = std::stoi(argv[++i]);
         } else if (arg == "-h" || arg == "--help") {
             biogpt_print_usage(argv, params);
             exit(0);
@@ -1027,14 +4309,48 @@ void biogpt_print_usage(char ** argv, const biogpt_params & params) {
     fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
     fprintf(stderr, "  -p PROMPT, --prompt PROMPT\n");
     fprintf(stderr, "                        prompt to start generation with (default: random)\n");
+    fprintf(stderr, "  -f FNAME, --file FNAME\n");
+    fprintf(stderr, "                        file with one prompt per line\n");
     fprintf(stderr, "  -l LANG               language of the prompt          (default: %s)\n", params.lang.c_str());
     fprintf(stderr, "  -n N, --n_predict N   number of tokens to predict (default: %d)\n", params.n_predict);
+    fprintf(stderr, "  --timeout N           stop the generation after N ms (default: %d, none)\n", params.timeout_ms);
     fprintf(stderr, "  -v V, --verbosity V   verbosity level (default: %d)\n", params.verbosity);
+    fprintf(stderr, "  --profile             print the time spent by op and by layer (node timings need -DBIOGPT_PERF=ON)\n");
+    fprintf(stderr, "  --trace FNAME         write the evaluated nodes as a Chrome trace\n");
     fprintf(stderr, "  --top_k N             top-k sampling  (default: %d)\n", params.top_k);
     fprintf(stderr, "  --top_p N             top-p sampling  (default: %.1f)\n", params.top_p);
     fprintf(stderr, "  --temp N              temperature     (default: %.1f)\n", params.temp);
+    fprintf(stderr, "  --min_p N             min-p sampling  (default: %.2f, 0.0 = disabled)\n", params.min_p);
+    fprintf(stderr, "  --repeat_penalty N    penalize repeated tokens (default: %.1f, 1.0 = disabled)\n", params.repeat_penalty);
+    fprintf(stderr, "  --frequency_penalty N penalize tokens by their count (default: %.1f)\n", params.freq_penalty);
+    fprintf(stderr, "  --presence_penalty N  penalize tokens already present (default: %.1f)\n", params.presence_penalty);
+    fprintf(stderr, "  --repeat_last_n N     last tokens considered by the penalties (default: %d)\n", params.repeat_last_n);
+    fprintf(stderr, "  --samplers CHAIN      order of the samplers (default: %s)\n", params.samplers.c_str());
     fprintf(stderr, "  -b N, --batch_size N  batch size for prompt processing (default: %d)\n", params.n_batch);
+    fprintf(stderr, "  --beams N             beam search with N beams (default: %d, sampling)\n", params.n_beams);
+    fprintf(stderr, "  --length_penalty N    beam search length penalty (default: %.1f)\n", params.length_penalty);
+    fprintf(stderr, "  --no_early_stopping   keep searching until no beam can improve on the finished hypotheses\n");
+    fprintf(stderr, "  --prompt_cache FNAME  file to cache the evaluated prompt in, reused when the prompt starts with it\n");
+    fprintf(stderr, "  --kv_blocks N         paged key + value memory of N blocks of %d positions (default: %d, contiguous)\n", BIOGPT_KV_BLOCK_SIZE, params.n_kv_blocks);
+    fprintf(stderr, "  --cache_blocks N      prefix cache budget in blocks (default: %d)\n", params.n_cache_blocks);
     fprintf(stderr, "  -m FNAME, --model FNAME\n");
     fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model_draft FNAME\n");
+    fprintf(stderr, "                        draft model path for speculative decoding\n");
+    fprintf(stderr, "  --draft N             number of tokens drafted per step (default: %d)\n", params.n_draft);
+    fprintf(stderr, "  --ngram N             longest n-gram looked up in the prompt to draft tokens (default: %d)\n", params.n_ngram);
+    fprintf(stderr, "  --draft_layers N      decoder layers of the layer-skip draft, 0 to sweep (default: %d)\n", params.n_draft_layers);
+    fprintf(stderr, "  --labels A,B,...      answers of the classifier\n");
+    fprintf(stderr, "  --pooling MODE        pooling of the embeddings, mean or last (default: %s)\n", params.pooling.c_str());
+    fprintf(stderr, "  --normalize           L2-normalize the embeddings\n");
+    fprintf(stderr, "  -o FNAME, --output FNAME\n");
+    fprintf(stderr, "                        output file\n");
+    fprintf(stderr, "  --host HOST           address the server listens on (default: %s)\n", params.hostname.c_str());
+    fprintf(stderr, "  --port N              port the server listens on (default: %d)\n", params.port);
+    fprintf(stderr, "  --workers N           requests the server evaluates concurrently (default: %d)\n", params.n_workers);
+    fprintf(stderr, "  --queue N             connections waiting for a worker before new ones are rejected (default: %d)\n", params.n_queue);
+    fprintf(stderr, "  --parallel N          sequences the batch tool evaluates together (default: %d)\n", params.n_parallel);
+    fprintf(stderr, "  --checkpoint FNAME    file recording the progress of the batch tool, resumed from when it exists\n");
+    fprintf(stderr, "  --chunks N            documents of the corpus evaluated by the calibration tool (default: %d, 0 = all)\n", params.n_chunks);
     fprintf(stderr, "\n");
 }
@@ -1,17 +1,28 @@
 #pragma once
 
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <random>
 #include <thread>
 #include <string>
+#include <vector>
 
 #include "bpe.h"
 #include "ggml-backend.h"
 
 #define BIOGPT_FILE_MAGIC   'ggml'
 
+#define BIOGPT_SESSION_MAGIC   'ggsn'
+#define BIOGPT_SESSION_VERSION 1
+
+#define BIOGPT_KV_BLOCK_SIZE 16
+
+#define BIOGPT_CALIBRATION_MAGIC 'ggim'
+
 template<typename T>
 static void read_safe(std::ifstream& infile, T& dest) {
     infile.read((char*)& dest, sizeof(T));
@@ -75,6 +86,252 @@ struct biogpt_layer_decoder {
 
 };
 
+// pool of fixed-size key + value blocks, each holding `block_size` positions for every layer
+struct biogpt_kv_pool {
+    int32_t block_size = BIOGPT_KV_BLOCK_SIZE;
+    int32_t n_blocks   = 0;  // 0 = contiguous cache of n_positions
+
+    std::vector<int32_t> free_blocks;
+    std::vector<int32_t> ref_count;  // number of sequences and cache entries holding each block
+};
+
+// block table of one sequence stored in the pool
+struct biogpt_kv_seq {
+    std::vector<int32_t> blocks;
+
+    int32_t n_past = 0;
+};
+
+// node of the prefix cache, keyed by the block of tokens leading to it from its parent
+struct biogpt_prefix_node {
+    token_sequence tokens;
+
+    int32_t block     = -1;  // block holding the keys and values of `tokens`
+    int64_t last_used = 0;
+
+    biogpt_prefix_node * parent = NULL;
+
+    std::map<token_sequence, std::unique_ptr<biogpt_prefix_node>> children;
+};
+
+// radix tree of evaluated token prefixes, stored one full block per node
+struct biogpt_prefix_cache {
+    biogpt_prefix_node root;
+
+    int32_t n_blocks_max = 0;  // memory budget in blocks
+    int32_t n_blocks     = 0;
+
+    int64_t clock = 0;
+
+    // metrics
+    int64_t n_lookups       = 0;
+    int64_t n_hits          = 0;
+    int64_t n_evictions     = 0;
+    int64_t n_tokens_reused = 0;
+    int64_t n_tokens_missed = 0;
+};
+
+// optional outputs of an evaluation
+struct biogpt_eval_opts {
+    bool    logits_all = false;  // return the logits of every token instead of the last one
+    int32_t n_layer    = 0;      // run only the first n_layer decoder layers before the lm head (0 = all)
+    int32_t n_rows     = 0;      // return the logits of the last n_rows tokens of the batch (0 = see logits_all)
+
+    // compute the logits of these tokens only, in this order: rows have allowed_ids->size() entries
+    const token_sequence * allowed_ids = NULL;
+
+    // stop after the final layer norm: rows are d_model hidden states instead of logits
+    bool embeddings = false;
+
+    // where the logits go instead of the `logits` vector:
+    //   logits_out:  a caller buffer of n_rows*n_vocab floats
+    //   logits_view: set to the rows inside the compute buffer, valid until the next evaluation with the same
+    //                allocator; backends without host memory copy to logits_out (or `logits`) and point there
+    float        *  logits_out  = NULL;
+    const float  ** logits_view = NULL;
+};
+
+struct biogpt_beam_params {
+    int32_t n_beams        = 5;
+    int32_t n_predict      = 200;
+    float   length_penalty = 1.0f;  // scores are divided by length^length_penalty
+    bool    early_stopping = true;  // stop as soon as n_beams hypotheses are finished
+};
+
+struct biogpt_beam_result {
+    token_sequence tokens;  // best hypothesis, without the prompt
+    double         score = 0.0;
+
+    int32_t n_steps       = 0;
+    int64_t n_beam_tokens = 0;  // tokens evaluated over all the beams
+    int64_t t_prompt_us   = 0;
+    int64_t t_predict_us  = 0;  // after the prompt
+};
+
+enum biogpt_sampler_stage {
+    BIOGPT_SAMPLER_PENALTIES,
+    BIOGPT_SAMPLER_TEMP,
+    BIOGPT_SAMPLER_TOP_K,
+    BIOGPT_SAMPLER_TOP_P,
+    BIOGPT_SAMPLER_MIN_P,
+};
+
+struct biogpt_sampler_params {
+    float   temp             = 0.9f;  // <= 0 picks the most likely token
+    int32_t top_k            = 40;    // 0 = disabled
+    float   top_p            = 0.9f;  // 1 = disabled
+    float   min_p            = 0.0f;  // 0 = disabled
+    float   repeat_penalty   = 1.0f;  // 1 = disabled
+    float   freq_penalty     = 0.0f;
+    float   presence_penalty = 0.0f;
+    int32_t repeat_last_n    = 64;    // tokens considered by the penalties
+
+    // stages applied to the logits, in order
+    std::string chain = "penalties,top_k,temp,top_p,min_p";
+};
+
+// reusable sampler: every buffer is allocated once by biogpt_sampler_init, so that sampling a
+// token does not touch the heap
+struct biogpt_sampler {
+    biogpt_sampler_params params;
+
+    std::vector<biogpt_sampler_stage> chain;
+
+    int32_t n_vocab = 0;
+
+    // candidates: ids[0, n_cand) index logits; sorted if ordered by decreasing logit
+    std::vector<float>   logits;
+    std::vector<float>   probs;
+    std::vector<int32_t> ids;
+    int32_t              n_cand = 0;
+    bool                 sorted = false;
+
+    // last repeat_last_n accepted tokens, as a ring buffer, and their counts
+    std::vector<int32_t>  prev;
+    int32_t               prev_head = 0;
+    int32_t               n_prev    = 0;
+    std::vector<int32_t>  counts;
+    std::vector<uint32_t> stamps;
+    uint32_t              stamp = 0;
+};
+
+enum biogpt_pooling {
+    BIOGPT_POOLING_MEAN,
+    BIOGPT_POOLING_LAST,
+};
+
+struct biogpt_choice_score {
+    double  logprob      = 0.0;  // sum of the log-probabilities of the choice tokens
+    double  logprob_norm = 0.0;  // logprob/n_tokens
+    int32_t n_tokens     = 0;
+};
+
+enum biogpt_stop_reason {
+    BIOGPT_STOP_EOS,        // end of text token
+    BIOGPT_STOP_LENGTH,     // n_predict tokens or the end of the context
+    BIOGPT_STOP_CALLBACK,   // the token callback returned false
+    BIOGPT_STOP_DEADLINE,   // t_max_us elapsed
+    BIOGPT_STOP_CANCELLED,  // the cancel flag was raised
+    BIOGPT_STOP_ERROR,      // an evaluation failed
+};
+
+struct biogpt_generate_params {
+    int32_t n_predict = 200;  // new tokens to predict
+    int32_t n_threads = 4;
+
+    int64_t t_max_us  = 0;    // stop the generation after this long (0 = no deadline)
+
+    // raised from any thread to stop the generation before its next evaluation
+    const std::atomic<bool> * cancel = NULL;
+};
+
+struct biogpt_generate_result {
+    token_sequence     tokens;  // generated tokens, without the prompt
+    biogpt_stop_reason stop = BIOGPT_STOP_LENGTH;
+
+    int32_t n_prompt_eval = 0;  // prompt tokens evaluated (the reused ones are not)
+
+    int64_t t_prompt_us  = 0;
+    int64_t t_predict_us = 0;
+    int64_t t_sample_us  = 0;
+};
+
+// called with the prompt tokens of each evaluated batch (prompt = true), then with every generated
+// token; returning false stops the generation
+typedef std::function<bool(const token_sequence & tokens, bool prompt)> biogpt_token_callback;
+
+// time, operations and memory traffic of a group of graph nodes
+struct biogpt_profile_stat {
+    int64_t n_nodes = 0;
+    int64_t t_us    = 0;
+    double  flops   = 0.0;  // 2*m*n*k for the matrix products, one per result element otherwise
+    double  bytes   = 0.0;  // sources read and result written
+};
+
+// phases of the inference timed by the metrics registry
+enum biogpt_phase {
+    BIOGPT_PHASE_TOKENIZE,     // gpt_tokenize
+    BIOGPT_PHASE_DETOKENIZE,   // gpt_decode
+    BIOGPT_PHASE_GRAPH_BUILD,  // building the graph of an evaluation
+    BIOGPT_PHASE_ALLOC,        // allocating its tensors in the compute buffer
+    BIOGPT_PHASE_COMPUTE,      // computing it on the backend
+    BIOGPT_PHASE_SAMPLE,       // biogpt_sampler_sample
+    BIOGPT_PHASE_COUNT,
+};
+
+#define BIOGPT_METRICS_N_BUCKETS 16
+
+// upper bounds of the latency buckets, in us
+extern const int64_t biogpt_metrics_bounds_us[BIOGPT_METRICS_N_BUCKETS];
+
+// snapshot of the latency histogram of a phase
+struct biogpt_phase_stats {
+    uint64_t count  = 0;
+    int64_t  sum_us = 0;
+    int64_t  max_us = 0;
+
+    // durations in each bucket, the last one counting those beyond the last bound
+    uint64_t counts[BIOGPT_METRICS_N_BUCKETS + 1] = {};
+};
+
+// a computed node (or a whole graph, part = -1) in the Chrome trace format
+struct biogpt_trace_event {
+    std::string name;
+    int32_t     part   = 0;
+    int64_t     ts_us  = 0;
+    int64_t     dur_us = 0;
+};
+
+// per-node profile of the evaluated graphs; ggml only times the nodes when built with GGML_PERF
+// (cmake -DBIOGPT_PERF=ON), the time of the whole graphs is always recorded
+struct biogpt_profile {
+    bool trace = false;  // keep every node as a trace event
+
+    int64_t n_graphs   = 0;
+    int64_t t_graph_us = 0;
+    int64_t t_start_us = 0;  // origin of the trace
+
+    std::map<std::string, biogpt_profile_stat> ops;    // by op, and by node name for the named ones
+    std::vector<biogpt_profile_stat>           parts;  // embeddings, decoder layers, final norm + lm head
+
+    std::vector<biogpt_trace_event> events;
+};
+
+// per-input-channel sums of the squared inputs of the linear layers, accumulated over the calibration
+// tokens; the quantizer weights the rounding error of each column of a matrix by the mean of its input
+struct biogpt_calibration {
+    int64_t n_tokens = 0;
+
+    std::map<std::string, std::vector<double>> sum_sq;  // by weight name
+};
+
+// a rule of a quantization policy: the matrices whose name matches the regex take the type,
+// the first matching rule wins and the others take the type of the ftype
+struct biogpt_quantize_rule {
+    std::string pattern;
+    ggml_type   type = GGML_TYPE_COUNT;
+};
+
 struct biogpt_model {
     biogpt_hparams hparams;
 
@@ -85,12 +342,9 @@ struct biogpt_model {
     struct ggml_tensor * ln_w;
     struct ggml_tensor * ln_b;
 
-    // lm head
+    // lm head, the same tensor as embed_tokens when tied
     struct ggml_tensor * lm_head;
-
-    // key + value memory
-    struct ggml_tensor * memory_k;
-    struct ggml_tensor * memory_v;
+    bool tied_lm_head = false;
 
     std::vector<biogpt_layer_decoder> layers_decoder;
 
@@ -103,7 +357,52 @@ struct biogpt_model {
     ggml_backend_t backend = NULL;
     
     ggml_backend_buffer_t buffer_w;
-    ggml_backend_buffer_t buffer_kv;
+};
+
+struct biogpt_context_params {
+    int32_t n_kv_blocks = 0;  // paged key + value memory size in blocks (0 = contiguous)
+    int32_t n_batch     = 8;  // largest number of tokens evaluated at once
+    int32_t n_seq       = 1;  // largest number of sequences in a paged batch
+
+    bool calibration = false;  // add the input statistics of the linear layers to the graphs
+
+    uint8_t verbosity = 0;  // print the memory and compute buffer sizes when > 0
+};
+
+// per-session state: the key + value memory and the compute buffer of one stream of evaluations
+// the model is only read, so that contexts created from the same model can run in different threads
+struct biogpt_context {
+    const biogpt_model * model = NULL;
+
+    biogpt_context_params cparams;
+
+    // the CPU backend keeps per-instance threads and work buffer, so each context gets its own
+    ggml_backend_t backend = NULL;
+
+    // key + value memory
+    struct ggml_context * ctx_kv   = NULL;
+    struct ggml_tensor  * memory_k = NULL;
+    struct ggml_tensor  * memory_v = NULL;
+
+    biogpt_kv_pool kv_pool;
+
+    ggml_backend_buffer_t buffer_kv      = NULL;
+    ggml_backend_buffer_t buffer_compute = NULL;
+
+    struct ggml_allocr * allocr = NULL;
+
+    // ggml_tensor and ggml_cgraph structs of the graph being built
+    std::vector<uint8_t> buf_graph;
+
+    // records the evaluated graphs when set
+    biogpt_profile * profile = NULL;
+
+    // part of each node of the graph being built, recorded for the profile: the embeddings (0),
+    // a decoder layer (1..n_layer) or the final norm and lm head (n_layer + 1)
+    std::map<const struct ggml_tensor *, int> graph_parts;
+
+    // accumulates the input statistics of the linear layers when set, needs cparams.calibration
+    biogpt_calibration * calibration = NULL;
 };
 
 struct biogpt_params {
@@ -111,17 +410,65 @@ struct biogpt_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_predict = 200; // new tokens to predict
 
+    int32_t timeout_ms = 0; // generation deadline in ms (0 = none)
+
     // sampling parameters
     int32_t top_k = 40;
     float   top_p = 0.9f;
     float   temp  = 0.9f;
+    float   min_p = 0.0f;
+
+    float   repeat_penalty   = 1.0f;
+    float   freq_penalty     = 0.0f;
+    float   presence_penalty = 0.0f;
+    int32_t repeat_last_n    = 64;
+
+    std::string samplers = "penalties,top_k,temp,top_p,min_p";
 
     uint8_t verbosity = 0;  // verbosity level
 
+    bool        profile = false;  // print the time spent by op and by layer
+    std::string trace;            // Chrome trace of the evaluated nodes
+
     int32_t n_batch = 8; // batch size for prompt processing
 
+    int32_t n_kv_blocks    = 0; // paged key + value memory size in blocks (0 = contiguous)
+    int32_t n_cache_blocks = 0; // prefix cache budget in blocks
+
+    // beam search
+    int32_t n_beams        = 0;     // 0 = sampling
+    float   length_penalty = 1.0f;
+    bool    early_stopping = true;
+
     std::string model = "../ggml_weights/ggml-model.bin"; // model path
+
+    // server
+    std::string hostname  = "127.0.0.1";
+    int32_t     port      = 8080;
+    int32_t     n_workers = 2;   // requests evaluated concurrently, one context each
+    int32_t     n_queue   = 16;  // connections waiting for a worker before new ones are rejected
+
+    // batch inference
+    int32_t     n_parallel = 8;  // sequences evaluated together
+    std::string checkpoint;      // progress file, resumed from when it exists
+
+    // calibration
+    int32_t n_chunks = 0;  // documents of the corpus evaluated (0 = all)
+
+    // speculative decoding
+    std::string model_draft;         // draft model path
+    int32_t     n_draft        = 5;  // tokens drafted per step
+    int32_t     n_ngram        = 3;  // longest n-gram matched against the prompt by prompt-lookup decoding
+    int32_t     n_draft_layers = 0;  // decoder layers of the layer-skip draft (0 = sweep)
+    std::string labels;              // comma-separated answers of the classifier
+
+    // embeddings
+    std::string pooling   = "mean";  // mean or last
+    bool        normalize = false;   // L2-normalize the embeddings
+    std::string output;
     std::string prompt;
+    std::string prompt_file;
+    std::string prompt_cache;  // session file holding the keys and values of the prompt
     std::string lang;
 };
 
@@ -131,25 +478,211 @@ bool biogpt_model_load(
              biogpt_vocab & vocab,
             const uint8_t   verbosity);
 
+void biogpt_model_free(biogpt_model & model);
+
+// allocate the key + value memory and a compute buffer fitting the largest batch of cparams
+// returns NULL on failure
+biogpt_context * biogpt_context_init(
+         const biogpt_model & model,
+const biogpt_context_params & cparams);
+
+void biogpt_context_free(biogpt_context * ctx);
+
 void biogpt_model_quantize_internal(
             std::ifstream & fin,
             std::ofstream & fout,
-         const ggml_ftype   ftype);
+         const ggml_ftype   ftype,
+                const int   n_threads = 1,
+const std::vector<biogpt_quantize_rule> & rules = std::vector<biogpt_quantize_rule>(),
+     const biogpt_calibration * calib = NULL);
+
+// the type the rows of a matrix are written in: type, or a type with smaller blocks (f32 at worst)
+// when n_per_row does not fit its blocks
+ggml_type biogpt_quantize_row_type(
+              const ggml_type   type,
+                    const int   n_per_row);
+
+// convert n_rows rows of f32 values to type (f32, f16 or quantized), split across n_threads; returns the
+// size of dst
+size_t biogpt_convert_rows(
+              const ggml_type   type,
+                  const float * src,
+                         void * dst,
+                    const int   n_rows,
+                    const int   n_per_row,
+                    const int   n_threads);
+
+// the rules of a preset policy ("uniform", "mixed" or "mixed-f16") for a model of n_layer layers
+bool biogpt_quantize_policy_preset(
+                     const std::string & name,
+                             const int   n_layer,
+     std::vector<biogpt_quantize_rule> & rules);
+
+// read the rules of a policy file, one "<regex> <type>" per line, '#' starts a comment
+bool biogpt_quantize_policy_load(
+                     const std::string & fname,
+     std::vector<biogpt_quantize_rule> & rules);
 
 struct ggml_cgraph * biogpt_graph(
-            const biogpt_model & model,
-            struct ggml_allocr * allocr, 
+                biogpt_context & ctx,
           const token_sequence & embed_inp,
-                     const int   n_past);
+                     const int   n_past,
+        const biogpt_eval_opts & opts = biogpt_eval_opts());
 
 bool biogpt_eval(
-       const biogpt_model & model,
+           biogpt_context & ctx,
      const token_sequence & embed_inp,
        std::vector<float> & logits,
-       struct ggml_allocr * allocr,
                 const int   n_past,
+                const int   n_threads,
+   const biogpt_eval_opts & opts = biogpt_eval_opts());
+
+struct ggml_cgraph * biogpt_graph_paged(
+                         biogpt_context   & ctx,
+      const std::vector<token_sequence>   & embed_inps,
+      const std::vector<biogpt_kv_seq *>  & seqs,
+                   const biogpt_eval_opts & opts = biogpt_eval_opts());
+
+bool biogpt_eval_paged(
+                         biogpt_context   & ctx,
+      const std::vector<token_sequence>   & embed_inps,
+      const std::vector<biogpt_kv_seq *>  & seqs,
+                       std::vector<float> & logits,
+                                const int   n_threads,
+                   const biogpt_eval_opts & opts = biogpt_eval_opts());
+
+bool biogpt_kv_seq_reserve(
+           biogpt_kv_pool & pool,
+            biogpt_kv_seq & seq,
+                const int   n_tokens);
+
+void biogpt_kv_seq_free(
+           biogpt_kv_pool & pool,
+            biogpt_kv_seq & seq);
+
+void biogpt_kv_seq_fork(
+           biogpt_kv_pool & pool,
+      const biogpt_kv_seq & src,
+            biogpt_kv_seq & dst);
+
+bool biogpt_beam_search(
+           biogpt_context & ctx,
+     const token_sequence & embed_inp,
+ const biogpt_beam_params & bparams,
+       biogpt_beam_result & result,
+                const int   n_batch,
                 const int   n_threads);
 
+bool biogpt_score_choices(
+                     biogpt_context & ctx,
+               const token_sequence & prompt,
+  const std::vector<token_sequence> & choices,
+   std::vector<biogpt_choice_score> & scores,
+                          const int   n_batch,
+                          const int   n_threads);
+
+bool biogpt_embed(
+                     biogpt_context & ctx,
+  const std::vector<token_sequence> & docs,
+               const biogpt_pooling   pooling,
+                 std::vector<float> & embeddings,
+                          const int   n_batch,
+                          const int   n_threads);
+
+// generate from `prompt` in the sequence `seq`, whose first seq.n_past positions already hold the
+// keys and values of the prompt (e.g. restored from a session); with the contiguous memory, only
+// seq.n_past is used. The prompt is evaluated in batches of the context's n_batch, and the sampler is
+// reset and fed the prompt. Returns false if an evaluation failed.
+bool biogpt_generate(
+               biogpt_context & ctx,
+                biogpt_kv_seq & seq,
+         const token_sequence & prompt,
+ const biogpt_generate_params & gparams,
+               biogpt_sampler & smpl,
+                 std::mt19937 & rng,
+  const biogpt_token_callback & callback,
+       biogpt_generate_result & result);
+
+// process-wide phase metrics, fed by timers at the library boundaries and safe to read from any thread.
+// They are off by default; a disabled timer only reads the flag
+void biogpt_metrics_enable(bool enable);
+
+bool biogpt_metrics_enabled();
+
+void biogpt_metrics_reset();
+
+const char * biogpt_phase_name(biogpt_phase phase);
+
+biogpt_phase_stats biogpt_metrics_get(biogpt_phase phase);
+
+// upper bound of the bucket holding the q-quantile, -1 if beyond the last bound
+int64_t biogpt_phase_quantile_us(
+ const biogpt_phase_stats & stats,
+             const double   q);
+
+// print the count, total, mean, p50, p99 and max of every phase seen
+void biogpt_metrics_print();
+
+// the histograms in the Prometheus text format
+std::string biogpt_metrics_prometheus();
+
+// print the time spent by op and by layer
+void biogpt_profile_print(const biogpt_profile & prof);
+
+// write the trace events as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+bool biogpt_profile_save_trace(
+        const std::string & fname,
+     const biogpt_profile & prof);
+
+// write the mean squared input of every channel, by weight name
+bool biogpt_calibration_save(
+        const std::string & fname,
+ const biogpt_calibration & calib);
+
+// read a file of biogpt_calibration_save, the means are read back as sums over n_tokens
+bool biogpt_calibration_load(
+        const std::string & fname,
+       biogpt_calibration & calib);
+
+int biogpt_prefix_cache_lookup(
+      biogpt_prefix_cache & cache,
+           biogpt_kv_pool & pool,
+     const token_sequence & tokens,
+            biogpt_kv_seq & seq);
+
+void biogpt_prefix_cache_insert(
+      biogpt_prefix_cache & cache,
+           biogpt_kv_pool & pool,
+     const token_sequence & tokens,
+      const biogpt_kv_seq & seq);
+
+int biogpt_prefix_cache_evict(
+      biogpt_prefix_cache & cache,
+           biogpt_kv_pool & pool,
+                const int   n_blocks);
+
+void biogpt_prefix_cache_clear(
+      biogpt_prefix_cache & cache,
+           biogpt_kv_pool & pool);
+
+void biogpt_prefix_cache_print_stats(const biogpt_prefix_cache & cache);
+
+// n_past: positions of the memory holding evaluated tokens, at least tokens.size()
+bool biogpt_session_save(
+        const std::string & fname,
+     const biogpt_context & ctx,
+      const biogpt_kv_seq * seq,
+                const int   n_past,
+     const token_sequence & tokens,
+       const std::mt19937 & rng);
+
+bool biogpt_session_load(
+        const std::string & fname,
+           biogpt_context & ctx,
+            biogpt_kv_seq * seq,
+           token_sequence & tokens,
+             std::mt19937 & rng);
+
 token_sequence gpt_tokenize(
              biogpt_vocab & vocab,
         const std::string & text,
@@ -167,6 +700,73 @@ biogpt_vocab::id biogpt_sample_top_k_top_p(
                    double   temp,
              std::mt19937 & rng);
 
+biogpt_vocab::id biogpt_sample_probs(
+              const float * probs,
+                const int   n_vocab,
+             std::mt19937 & rng);
+
+bool biogpt_sampler_init(
+               biogpt_sampler & smpl,
+  const biogpt_sampler_params & sparams,
+                    const int   n_vocab);
+
+// sampler parameters from the command line
+biogpt_sampler_params biogpt_params_to_sampler(const biogpt_params & params);
+
+// generation parameters from the command line
+biogpt_generate_params biogpt_params_to_generate(const biogpt_params & params);
+
+// forget the accepted tokens
+void biogpt_sampler_reset(biogpt_sampler & smpl);
+
+// record a generated token for the penalties
+void biogpt_sampler_accept(
+           biogpt_sampler & smpl,
+         biogpt_vocab::id   id);
+
+// run the chain on a row of logits, leaving the candidates in smpl.ids[0, smpl.n_cand)
+// with their normalized probabilities in smpl.probs
+void biogpt_sampler_apply(
+           biogpt_sampler & smpl,
+              const float * logits);
+
+biogpt_vocab::id biogpt_sampler_sample(
+           biogpt_sampler & smpl,
+              const float * logits,
+             std::mt19937 & rng);
+
+// run the chain on a row of logits and write the distribution over the whole vocabulary to
+// probs[0, n_vocab), zero outside the candidates; used to compare the draft and target distributions
+void biogpt_sampler_probs(
+           biogpt_sampler & smpl,
+              const float * logits,
+                    float * probs);
+
+int biogpt_speculative_accept(
+              const float * p,
+              const float * q,
+     const token_sequence & draft,
+                const int   n_vocab,
+             std::mt19937 & rng,
+         biogpt_vocab::id & next);
+
+int biogpt_speculative_verify(
+           biogpt_sampler & smpl,
+              const float * rows,
+              const float * q,
+     const token_sequence & draft,
+   const biogpt_vocab::id   eos_id,
+                const int   n_max,
+             std::mt19937 & rng,
+       std::vector<float> & p,
+           token_sequence & accepted);
+
+token_sequence biogpt_prompt_lookup(
+     const token_sequence & prompt,
+     const token_sequence & history,
+                const int   n_ngram,
+                const int   n_draft);
+
 bool biogpt_params_parse(int argc, char ** argv, biogpt_params & params);
 
 void biogpt_print_usage(char ** argv, const biogpt_params & params);
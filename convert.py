@@ -53,6 +53,13 @@ def parse_bpe_merges(dir_model, outfile):
 
 def parse_model(checkpoint, outfile, use_f16):
     for name in checkpoint.keys():
+        # the lm head is tied to the token embeddings, the loader shares them
+        if name == "output_projection.weight" and torch.equal(
+            checkpoint[name], checkpoint["biogpt.embed_tokens.weight"]
+        ):
+            print(f"Skipping variable: {name} (tied to biogpt.embed_tokens.weight)")
+            continue
+
         var_data = checkpoint[name].squeeze().numpy()
         print(f"Processing variable: {name} with shape: {var_data.shape}")
 
@@ -0,0 +1,658 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "ggml.h"
+
+#include "biogpt.h"
+#include "json.h"
+
+// Offline inference over a corpus (-f), one record per line, either a plain-text prompt or a JSON object:
+//   {"id": 7, "prompt": "...", "n_predict": 64}                    generation
+//   {"id": 8, "prompt": "...", "choices": ["yes", "no", "maybe"]}  scoring of the choices
+// The model is loaded once. A background thread tokenizes ahead while up to --parallel sequences share
+// the paged memory: each evaluation mixes the next token of the sequences being generated with chunks
+// of the new prompts. The results are written to -o as JSON lines, in the order of the corpus:
+//   {"index": 7, "id": 7, "text": "...", "n_prompt": 12, "n_generated": 64, "stop": "length"}
+//   {"index": 8, "id": 8, "scores": [{"choice": "yes", "logprob": -1.2, "logprob_norm": -1.2}, ...], "best": "yes"}
+//   {"index": 9, "error": "..."}
+// With --checkpoint, the number of records written and the size of the output are saved every
+// BATCH_CHECKPOINT_EVERY records; a rerun with the same checkpoint resumes from there.
+
+// tokenized records waiting for a sequence
+#define BATCH_READ_AHEAD        256
+#define BATCH_CHECKPOINT_EVERY  64
+
+// the context is sized for choices up to these limits
+#define BATCH_MAX_CHOICES       16
+#define BATCH_MAX_CHOICE_TOKENS 64
+
+static std::atomic<bool> g_stop(false);
+
+static void batch_sigint_handler(int) {
+    g_stop = true;
+}
+
+struct batch_record {
+    int64_t     index = 0;
+    std::string id;     // the "id" field, as JSON
+    std::string error;  // why the record cannot be evaluated
+
+    token_sequence prompt;
+    int32_t        n_predict = 0;
+
+    std::vector<std::string>    choices;
+    std::vector<token_sequence> choice_tokens;
+};
+
+// records tokenized by the reader thread
+struct batch_queue {
+    std::mutex               mutex;
+    std::condition_variable  cv;
+    std::deque<batch_record> records;
+    bool                     done = false;
+};
+
+// output in the order of the corpus, and the progress saved to the checkpoint
+struct batch_writer {
+    std::ofstream fout;
+
+    std::map<int64_t, std::string> pending;  // finished ahead of an earlier record
+
+    int64_t  n_done = 0;  // records written, also the index of the next one
+    int64_t  offset = 0;  // size of the output
+    uint32_t seed   = 0;
+
+    std::string checkpoint;
+};
+
+struct batch_slot {
+    bool active = false;
+
+    batch_record   rec;
+    biogpt_kv_seq  seq;
+    biogpt_sampler smpl;
+    std::mt19937   rng;
+
+    token_sequence   tokens;  // generated
+    biogpt_vocab::id next = 0;
+};
+
+static void batch_parse_record(
+             biogpt_vocab & vocab,
+      const biogpt_params & params,
+                const int   n_positions,
+                const int   n_batch,
+        const std::string & line,
+             batch_record & rec) {
+    std::string prompt = line;
+
+    rec.n_predict = params.n_predict;
+
+    if (line[0] == '{') {
+        json_value obj;
+        if (!json_parse(line, obj) || obj.type != json_value::JSON_OBJECT) {
+            rec.error = "invalid JSON";
+            return;
+        }
+
+        const json_value * id = obj.get("id");
+        if (id && id->type == json_value::JSON_STRING) {
+            rec.id = json_escape(id->str);
+        } else if (id && id->type == json_value::JSON_NUMBER) {
+            rec.id = json_number(id->num);
+        }
+
+        prompt.clear();
+        if (!json_get(obj, "prompt", prompt) || prompt.empty() || !json_get(obj, "n_predict", rec.n_predict)) {
+            rec.error = "'prompt' must be a non-empty string and 'n_predict' a number";
+            return;
+        }
+
+        const json_value * choices = obj.get("choices");
+        if (choices) {
+            if (choices->type != json_value::JSON_ARRAY || choices->arr.empty() || choices->arr.size() > BATCH_MAX_CHOICES) {
+                rec.error = "'choices' must be an array of 1 to " + std::to_string(BATCH_MAX_CHOICES) + " strings";
+                return;
+            }
+
+            for (const auto & choice : choices->arr) {
+                if (choice.type != json_value::JSON_STRING) {
+                    rec.error = "'choices' must be an array of strings";
+                    return;
+                }
+
+                // the choices continue the prompt: drop the </s> that starts every tokenized text
+                token_sequence tokens = gpt_tokenize(vocab, choice.str, params.lang);
+                tokens.erase(tokens.begin());
+                if (tokens.empty() || tokens.size() > BATCH_MAX_CHOICE_TOKENS) {
+                    rec.error = "every choice must have 1 to " + std::to_string(BATCH_MAX_CHOICE_TOKENS) + " tokens";
+                    return;
+                }
+
+                rec.choices.push_back(choice.str);
+                rec.choice_tokens.push_back(tokens);
+            }
+        }
+    }
+
+    rec.prompt = gpt_tokenize(vocab, prompt, params.lang);
+
+    size_t n_sum = 0;
+    size_t n_max = 0;
+    for (const auto & tokens : rec.choice_tokens) {
+        n_sum += tokens.size();
+        n_max  = std::max(n_max, tokens.size());
+    }
+
+    if (rec.choices.empty() && rec.n_predict < 1) {
+        rec.error = "'n_predict' must be positive";
+    } else if ((int) n_sum > n_batch) {
+        rec.error = "the choices are too long";
+    } else if ((int) (rec.prompt.size() + std::max<size_t>(n_max, 1)) > n_positions) {
+        rec.error = "the prompt is longer than the context";
+    }
+
+    rec.n_predict = std::min<int>(rec.n_predict, n_positions - rec.prompt.size());
+}
+
+// tokenize the corpus ahead of the evaluation, skipping the first n_skip records
+static void batch_read(
+            std::ifstream & fin,
+             biogpt_vocab & vocab,
+      const biogpt_params & params,
+                const int   n_positions,
+                const int   n_batch,
+            const int64_t   n_skip,
+              batch_queue & queue) {
+    int64_t index = 0;
+
+    std::string line;
+    while (!g_stop && std::getline(fin, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+
+        if (index < n_skip) {
+            index++;
+            continue;
+        }
+
+        batch_record rec;
+        rec.index = index++;
+        batch_parse_record(vocab, params, n_positions, n_batch, line, rec);
+
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        queue.cv.wait(lock, [&] { return queue.records.size() < BATCH_READ_AHEAD || g_stop; });
+        queue.records.push_back(std::move(rec));
+        queue.cv.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.done = true;
+    queue.cv.notify_all();
+}
+
+// next tokenized record; waits for the reader if `wait`, returns false if none is ready
+static bool batch_pop(batch_queue & queue, batch_record & rec, const bool wait) {
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    if (wait) {
+        queue.cv.wait(lock, [&] { return !queue.records.empty() || queue.done; });
+    }
+
+    if (queue.records.empty()) {
+        return false;
+    }
+
+    rec = std::move(queue.records.front());
+    queue.records.pop_front();
+    queue.cv.notify_all();
+
+    return true;
+}
+
+static bool batch_checkpoint(batch_writer & writer) {
+    writer.fout.flush();
+
+    if (writer.checkpoint.empty()) {
+        return true;
+    }
+
+    // written aside then renamed, so that a crash never leaves a partial checkpoint
+    const std::string fname_tmp = writer.checkpoint + ".tmp";
+    {
+        std::ofstream fout(fname_tmp);
+        fout << writer.n_done << " " << writer.offset << " " << writer.seed << "\n";
+        if (!fout) {
+            fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_tmp.c_str());
+            return false;
+        }
+    }
+
+#if defined(_WIN32)
+    std::remove(writer.checkpoint.c_str());
+#endif
+
+    if (std::rename(fname_tmp.c_str(), writer.checkpoint.c_str()) != 0) {
+        fprintf(stderr, "%s: failed to rename '%s'\n", __func__, fname_tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static void batch_write(batch_writer & writer, const int64_t index, const std::string & line) {
+    writer.pending[index] = line;
+
+    while (!writer.pending.empty() && writer.pending.begin()->first == writer.n_done) {
+        const std::string & out = writer.pending.begin()->second;
+
+        writer.fout.write(out.data(), out.size());
+        writer.offset += out.size();
+        writer.n_done += 1;
+
+        writer.pending.erase(writer.pending.begin());
+
+        if (writer.n_done % BATCH_CHECKPOINT_EVERY == 0) {
+            batch_checkpoint(writer);
+        }
+    }
+}
+
+static std::string batch_result_head(const batch_record & rec) {
+    return "{\"index\": " + std::to_string(rec.index) + (rec.id.empty() ? "" : ", \"id\": " + rec.id);
+}
+
+// blocks a record may take from the pool
+static int batch_blocks_needed(const batch_record & rec, const int block_size) {
+    auto n_blocks = [&](const int n_tokens) {
+        return (n_tokens + block_size - 1)/block_size;
+    };
+
+    if (rec.choices.empty()) {
+        return n_blocks(rec.prompt.size() + rec.n_predict);
+    }
+
+    // every choice forks the prompt, copying at most its last partial block
+    int n_max = 0;
+    for (const auto & tokens : rec.choice_tokens) {
+        n_max = std::max<int>(n_max, tokens.size());
+    }
+
+    return n_blocks(rec.prompt.size()) + rec.choices.size()*(n_blocks(n_max) + 1);
+}
+
+static bool batch_truncate(const std::string & fname, const int64_t size) {
+#if defined(_WIN32)
+    FILE * f = fopen(fname.c_str(), "r+b");
+    if (!f) {
+        return false;
+    }
+    const bool ok = _chsize_s(_fileno(f), size) == 0;
+    fclose(f);
+    return ok;
+#else
+    return truncate(fname.c_str(), size) == 0;
+#endif
+}
+
+int main(int argc, char **argv) {
+    ggml_time_init();
+
+    const int64_t t_main_start_us = ggml_time_us();
+
+    biogpt_params params;
+    params.n_batch     = 64;
+    params.n_kv_blocks = 512;
+
+    if (biogpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.prompt_file.empty() || params.output.empty()) {
+        fprintf(stderr, "%s: a corpus (-f FNAME) and an output file (-o FNAME) are required\n", __func__);
+        return 1;
+    }
+
+    if (params.n_kv_blocks <= 0 || params.n_parallel < 1) {
+        fprintf(stderr, "%s: the batch tool requires a paged key + value memory (--kv_blocks) and --parallel >= 1\n", __func__);
+        return 1;
+    }
+
+    std::ifstream fin(params.prompt_file);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.prompt_file.c_str());
+        return 1;
+    }
+
+    batch_writer writer;
+    writer.checkpoint = params.checkpoint;
+    writer.seed       = params.seed < 0 ? time(NULL) : params.seed;
+
+    // resume: drop whatever was written after the last checkpoint
+    bool resume = false;
+    if (!params.checkpoint.empty()) {
+        std::ifstream fckpt(params.checkpoint);
+        if (fckpt) {
+            if (!(fckpt >> writer.n_done >> writer.offset >> writer.seed)) {
+                fprintf(stderr, "%s: invalid checkpoint '%s'\n", __func__, params.checkpoint.c_str());
+                return 1;
+            }
+            if (!batch_truncate(params.output, writer.offset)) {
+                fprintf(stderr, "%s: failed to truncate '%s' to %lld bytes\n", __func__, params.output.c_str(), (long long) writer.offset);
+                return 1;
+            }
+            resume = true;
+
+            fprintf(stderr, "%s: resuming after %lld records (seed = %u)\n", __func__, (long long) writer.n_done, writer.seed);
+        }
+    }
+
+    writer.fout.open(params.output, resume ? std::ios::binary | std::ios::app : std::ios::binary | std::ios::trunc);
+    if (!writer.fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, params.output.c_str());
+        return 1;
+    }
+
+    biogpt_vocab vocab;
+    biogpt_model model;
+
+    if (!biogpt_model_load(params.model, model, vocab, params.verbosity)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+        return 1;
+    }
+
+    const int n_vocab     = model.hparams.n_vocab;
+    const int n_positions = model.hparams.n_positions;
+
+    const biogpt_vocab::id eos_id = 2;
+
+    // a batch holds one token per sequence being generated, or all the choices of a record
+    biogpt_context_params cparams;
+    cparams.n_kv_blocks = params.n_kv_blocks;
+    cparams.n_batch     = std::max(std::max(params.n_batch, params.n_parallel), BATCH_MAX_CHOICE_TOKENS);
+    cparams.n_seq       = std::max(params.n_parallel, BATCH_MAX_CHOICES);
+    cparams.verbosity   = params.verbosity;
+
+    biogpt_context * ctx = biogpt_context_init(model, cparams);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return 1;
+    }
+
+    const biogpt_sampler_params sparams = biogpt_params_to_sampler(params);
+
+    std::vector<batch_slot> slots(params.n_parallel);
+    for (auto & slot : slots) {
+        if (!biogpt_sampler_init(slot.smpl, sparams, n_vocab)) {
+            return 1;
+        }
+    }
+
+    signal(SIGINT, batch_sigint_handler);
+
+    batch_queue queue;
+    std::thread reader(batch_read, std::ref(fin), std::ref(vocab), std::cref(params), n_positions, cparams.n_batch, writer.n_done, std::ref(queue));
+
+    int64_t n_records     = 0;
+    int64_t n_errors      = 0;
+    int64_t n_prompt      = 0;
+    int64_t n_generated   = 0;
+    int64_t n_evals       = 0;
+    int64_t n_eval_tokens = 0;
+    int64_t t_eval_us     = 0;
+    int64_t t_score_us    = 0;
+
+    std::vector<float> logits;
+    std::vector<biogpt_choice_score> scores;
+
+    std::vector<token_sequence>  embed_inps;
+    std::vector<biogpt_kv_seq *> seqs;
+    std::vector<int>             slot_ids;
+
+    batch_record pending;
+    bool         have_pending = false;
+
+    auto finish_error = [&](const batch_record & rec, const std::string & error) {
+        batch_write(writer, rec.index, batch_result_head(rec) + ", \"error\": " + json_escape(error) + "}\n");
+        n_records++;
+        n_errors++;
+    };
+
+    while (!g_stop) {
+        int n_active = 0;
+        for (const auto & slot : slots) {
+            n_active += slot.active;
+        }
+
+        // fill the free slots; the reader is only waited for when nothing else is running
+        for (size_t s = 0; s < slots.size(); ) {
+            if (slots[s].active) {
+                s++;
+                continue;
+            }
+
+            if (!have_pending) {
+                have_pending = batch_pop(queue, pending, n_active == 0);
+                if (!have_pending) {
+                    break;
+                }
+            }
+
+            if (!pending.error.empty()) {
+                finish_error(pending, pending.error);
+                have_pending = false;
+                continue;
+            }
+
+            const int n_needed = batch_blocks_needed(pending, ctx->kv_pool.block_size);
+            if (n_needed > ctx->kv_pool.n_blocks) {
+                finish_error(pending, "the record does not fit the key + value memory");
+                have_pending = false;
+                continue;
+            }
+
+            // wait for the running sequences to release their blocks
+            if (n_needed > (int) ctx->kv_pool.free_blocks.size()) {
+                break;
+            }
+
+            have_pending = false;
+            n_prompt += pending.prompt.size();
+
+            // the choices of a record are scored at once, on top of one evaluation of the prompt
+            if (!pending.choices.empty()) {
+                const int64_t t_start_us = ggml_time_us();
+
+                if (!biogpt_score_choices(*ctx, pending.prompt, pending.choice_tokens, scores, params.n_batch, params.n_threads)) {
+                    finish_error(pending, "scoring failed");
+                    continue;
+                }
+
+                t_score_us += ggml_time_us() - t_start_us;
+
+                size_t best = 0;
+                std::string out = batch_result_head(pending) + ", \"scores\": [";
+                for (size_t c = 0; c < scores.size(); c++) {
+                    if (scores[c].logprob_norm > scores[best].logprob_norm) {
+                        best = c;
+                    }
+
+                    out += c > 0 ? ", " : "";
+                    out += "{\"choice\": "       + json_escape(pending.choices[c]);
+                    out += ", \"logprob\": "      + json_number(scores[c].logprob);
+                    out += ", \"logprob_norm\": " + json_number(scores[c].logprob_norm) + "}";
+                }
+                out += "], \"best\": " + json_escape(pending.choices[best]) + "}\n";
+
+                batch_write(writer, pending.index, out);
+                n_records++;
+                continue;
+            }
+
+            batch_slot & slot = slots[s];
+
+            slot.rec = std::move(pending);
+            slot.tokens.clear();
+
+            // the blocks are reserved up front, so that no evaluation runs out of them
+            biogpt_kv_seq_reserve(ctx->kv_pool, slot.seq, slot.rec.prompt.size() + slot.rec.n_predict);
+
+            // seeded by the index, so that a resumed run samples the same tokens
+            slot.rng.seed(writer.seed + (uint32_t) slot.rec.index);
+
+            biogpt_sampler_reset(slot.smpl);
+            for (auto id : slot.rec.prompt) {
+                biogpt_sampler_accept(slot.smpl, id);
+            }
+
+            slot.active = true;
+            n_active++;
+            s++;
+        }
+
+        if (n_active == 0) {
+            break;
+        }
+
+        // the sequences being generated take one token each, the rest of the batch goes to the prompts
+        embed_inps.clear();
+        seqs.clear();
+        slot_ids.clear();
+
+        int n_budget = cparams.n_batch;
+        for (int pass = 0; pass < 2; pass++) {
+            for (size_t s = 0; s < slots.size() && n_budget > 0; s++) {
+                batch_slot & slot = slots[s];
+
+                const int n_prompt_left = (int) slot.rec.prompt.size() - slot.seq.n_past;
+                if (!slot.active || (pass == 0) != (n_prompt_left <= 0)) {
+                    continue;
+                }
+
+                if (pass == 0) {
+                    embed_inps.push_back({ slot.next });
+                } else {
+                    const int n_eval = std::min(n_budget, n_prompt_left);
+                    embed_inps.push_back(token_sequence(slot.rec.prompt.begin() + slot.seq.n_past, slot.rec.prompt.begin() + slot.seq.n_past + n_eval));
+                }
+
+                n_budget -= embed_inps.back().size();
+                seqs.push_back(&slot.seq);
+                slot_ids.push_back(s);
+            }
+        }
+
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            if (!biogpt_eval_paged(*ctx, embed_inps, seqs, logits, params.n_threads)) {
+                fprintf(stderr, "%s: failed to evaluate a batch of %zu sequences\n", __func__, seqs.size());
+                return 1;
+            }
+
+            t_eval_us     += ggml_time_us() - t_start_us;
+            n_evals       += 1;
+            n_eval_tokens += cparams.n_batch - n_budget;
+        }
+
+        for (size_t i = 0; i < slot_ids.size(); i++) {
+            batch_slot & slot = slots[slot_ids[i]];
+
+            // in the middle of the prompt
+            if (slot.seq.n_past < (int) slot.rec.prompt.size()) {
+                continue;
+            }
+
+            const biogpt_vocab::id id = biogpt_sampler_sample(slot.smpl, logits.data() + i*n_vocab, slot.rng);
+            biogpt_sampler_accept(slot.smpl, id);
+            slot.tokens.push_back(id);
+            slot.next = id;
+
+            // the last token is not evaluated, nothing would read its logits
+            const bool eos = id == eos_id;
+            if (!eos && (int) slot.tokens.size() < slot.rec.n_predict) {
+                continue;
+            }
+
+            std::vector<std::string> words;
+            for (auto t : slot.tokens) {
+                words.push_back(vocab.id_to_token.at(t));
+            }
+
+            std::string out = batch_result_head(slot.rec);
+            out += ", \"text\": "        + json_escape(gpt_decode(words, params.lang));
+            out += ", \"n_prompt\": "    + std::to_string(slot.rec.prompt.size());
+            out += ", \"n_generated\": " + std::to_string(slot.tokens.size());
+            out += ", \"stop\": \""      + std::string(eos ? "eos" : "length") + "\"}\n";
+
+            batch_write(writer, slot.rec.index, out);
+
+            n_records   += 1;
+            n_generated += slot.tokens.size();
+
+            biogpt_kv_seq_free(ctx->kv_pool, slot.seq);
+            slot.active = false;
+        }
+
+        if (params.verbosity > 0 && n_records > 0 && n_evals % 100 == 0) {
+            fprintf(stderr, "%s: %lld records done, %lld in flight\n", __func__, (long long) writer.n_done, (long long) n_active);
+        }
+    }
+
+    if (g_stop) {
+        fprintf(stderr, "\n%s: interrupted, the records in flight are dropped\n", __func__);
+    }
+
+    // stop the reader, then save the progress
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.cv.notify_all();
+    }
+    reader.join();
+
+    for (auto & slot : slots) {
+        biogpt_kv_seq_free(ctx->kv_pool, slot.seq);
+    }
+
+    batch_checkpoint(writer);
+    writer.fout.close();
+
+    // report timing
+    {
+        const int64_t t_main_end_us = ggml_time_us();
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, "%s: %lld records (%lld errors), %lld written in total\n", __func__, (long long) n_records, (long long) n_errors, (long long) writer.n_done);
+        fprintf(stderr, "%s: %lld prompt tokens, %lld generated tokens\n", __func__, (long long) n_prompt, (long long) n_generated);
+        fprintf(stderr, "%s:     eval time = %8.2f ms / %lld batches of %.1f tokens on average / %.2f tokens/s\n", __func__,
+                t_eval_us/1000.0f, (long long) n_evals, n_eval_tokens/(double) std::max<int64_t>(1, n_evals), n_eval_tokens*1e6/std::max<int64_t>(1, t_eval_us));
+        fprintf(stderr, "%s:    score time = %8.2f ms\n", __func__, t_score_us/1000.0f);
+        fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
+    }
+
+    biogpt_context_free(ctx);
+    biogpt_model_free(model);
+
+    return g_stop ? 130 : 0;
+}
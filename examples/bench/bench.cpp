@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ggml.h"
+
+#include "biogpt.h"
+#include "json.h"
+
+// Inference benchmark: sweeps models, thread counts, batch sizes, prompt and generation lengths, and
+// reports the prompt processing (pp) and token generation (tg) throughput over repeated runs.
+//   pp: the prompt is evaluated from an empty memory in batches of n_batch tokens
+//   tg: n_gen tokens are evaluated one at a time from an empty memory
+// The token ids are drawn from a fixed seed and nothing is sampled, so that only the evaluation is timed.
+// One row is printed per model, test and combination of the parameters, as CSV or JSON lines.
+
+struct bench_params {
+    std::vector<std::string> models    = { "../ggml_weights/ggml-model.bin" };
+    std::vector<int>         n_threads = { std::min(4, (int32_t) std::thread::hardware_concurrency()) };
+    std::vector<int>         n_batch   = { 8 };
+    std::vector<int>         n_prompt  = { 128 };
+    std::vector<int>         n_gen     = { 64 };
+
+    int32_t n_warmup  = 1;
+    int32_t n_reps    = 5;
+    int32_t verbosity = 0;
+
+    std::string output = "csv";
+};
+
+struct bench_result {
+    std::string model;
+    std::string type;
+
+    std::string test;  // pp or tg
+    int         n_threads = 0;
+    int         n_batch   = 0;
+    int         n_tokens  = 0;
+
+    std::vector<double> samples;  // tokens/s of each repetition
+};
+
+static void bench_print_usage(char ** argv, const bench_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "every option but -r, --warmup, -o and -v takes a comma-separated list to sweep\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model paths, e.g. one per quantization type (default: %s)\n", params.models[0].c_str());
+    fprintf(stderr, "  -t N, --threads N     number of threads (default: %d)\n", params.n_threads[0]);
+    fprintf(stderr, "  -b N, --batch_size N  batch size of the prompt processing (default: %d)\n", params.n_batch[0]);
+    fprintf(stderr, "  -p N, --n_prompt N    prompt lengths, 0 to skip pp (default: %d)\n", params.n_prompt[0]);
+    fprintf(stderr, "  -n N, --n_gen N       generation lengths, 0 to skip tg (default: %d)\n", params.n_gen[0]);
+    fprintf(stderr, "  -r N, --repetitions N timed runs of every test (default: %d)\n", params.n_reps);
+    fprintf(stderr, "  --warmup N            untimed runs before the timed ones (default: %d)\n", params.n_warmup);
+    fprintf(stderr, "  -o FMT, --output FMT  csv or json (default: %s)\n", params.output.c_str());
+    fprintf(stderr, "  -v V, --verbosity V   verbosity level (default: %d)\n", params.verbosity);
+    fprintf(stderr, "\n");
+}
+
+static std::vector<std::string> split_list(const std::string & str) {
+    std::vector<std::string> values;
+
+    std::stringstream ss(str);
+    std::string value;
+    while (std::getline(ss, value, ',')) {
+        values.push_back(value);
+    }
+
+    return values;
+}
+
+static std::vector<int> split_list_int(const std::string & str) {
+    std::vector<int> values;
+    for (const auto & value : split_list(str)) {
+        values.push_back(std::stoi(value));
+    }
+
+    return values;
+}
+
+static bool bench_params_parse(int argc, char ** argv, bench_params & params) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            bench_print_usage(argv, params);
+            exit(0);
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return false;
+        }
+
+        if (arg == "-m" || arg == "--model") {
+            params.models = split_list(argv[++i]);
+        } else if (arg == "-t" || arg == "--threads") {
+            params.n_threads = split_list_int(argv[++i]);
+        } else if (arg == "-b" || arg == "--batch_size") {
+            params.n_batch = split_list_int(argv[++i]);
+        } else if (arg == "-p" || arg == "--n_prompt") {
+            params.n_prompt = split_list_int(argv[++i]);
+        } else if (arg == "-n" || arg == "--n_gen") {
+            params.n_gen = split_list_int(argv[++i]);
+        } else if (arg == "-r" || arg == "--repetitions") {
+            params.n_reps = std::stoi(argv[++i]);
+        } else if (arg == "--warmup") {
+            params.n_warmup = std::stoi(argv[++i]);
+        } else if (arg == "-o" || arg == "--output") {
+            params.output = argv[++i];
+        } else if (arg == "-v" || arg == "--verbosity") {
+            params.verbosity = std::stoi(argv[++i]);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            bench_print_usage(argv, params);
+            return false;
+        }
+    }
+
+    if (params.output != "csv" && params.output != "json") {
+        fprintf(stderr, "error: unknown output format '%s'\n", params.output.c_str());
+        return false;
+    }
+
+    // a test runs with every combination of the lists, pp and tg are skipped with a length of 0
+    auto list_valid = [](const std::vector<int> & values, const int min) {
+        return !values.empty() && *std::min_element(values.begin(), values.end()) >= min;
+    };
+
+    if (!list_valid(params.n_threads, 1) || !list_valid(params.n_batch, 1)) {
+        fprintf(stderr, "error: the thread counts and the batch sizes must be at least 1\n");
+        return false;
+    }
+
+    if (!list_valid(params.n_prompt, 0) || !list_valid(params.n_gen, 0)) {
+        fprintf(stderr, "error: the prompt and generation lengths must not be negative\n");
+        return false;
+    }
+
+    if (params.n_reps < 1 || params.n_warmup < 0) {
+        fprintf(stderr, "error: invalid number of repetitions (%d) or warmup runs (%d)\n", params.n_reps, params.n_warmup);
+        return false;
+    }
+
+    return true;
+}
+
+static double bench_mean(const std::vector<double> & x) {
+    double sum = 0.0;
+    for (auto v : x) {
+        sum += v;
+    }
+    return sum/x.size();
+}
+
+static double bench_stddev(const std::vector<double> & x) {
+    if (x.size() < 2) {
+        return 0.0;
+    }
+
+    const double mean = bench_mean(x);
+
+    double sum = 0.0;
+    for (auto v : x) {
+        sum += (v - mean)*(v - mean);
+    }
+    return sqrt(sum/(x.size() - 1));
+}
+
+// nearest-rank percentile
+static double bench_percentile(std::vector<double> x, const double p) {
+    std::sort(x.begin(), x.end());
+
+    const int rank = (int) ceil(p/100.0*x.size());
+    return x[std::min<int>(std::max(rank, 1), x.size()) - 1];
+}
+
+static std::string bench_cpu_features() {
+    std::string features;
+    auto add = [&](const char * name, int has) {
+        if (has) {
+            features += features.empty() ? name : std::string(" ") + name;
+        }
+    };
+
+    add("avx",    ggml_cpu_has_avx());
+    add("avx2",   ggml_cpu_has_avx2());
+    add("avx512", ggml_cpu_has_avx512());
+    add("fma",    ggml_cpu_has_fma());
+    add("f16c",   ggml_cpu_has_f16c());
+    add("neon",   ggml_cpu_has_neon());
+    add("blas",   ggml_cpu_has_blas());
+
+    return features;
+}
+
+static void bench_print_header(const bench_params & params) {
+    if (params.output == "csv") {
+        printf("timestamp,cpu_features,n_cpu,model,type,test,n_threads,n_batch,n_tokens,n_reps,"
+               "ts_mean,ts_stddev,ts_p50,ts_p99\n");
+    }
+}
+
+static void bench_print_result(const bench_params & params, const bench_result & r, const std::string & timestamp) {
+    const std::string features = bench_cpu_features();
+    const unsigned    n_cpu    = std::thread::hardware_concurrency();
+
+    const double mean   = bench_mean(r.samples);
+    const double stddev = bench_stddev(r.samples);
+    const double p50    = bench_percentile(r.samples, 50.0);
+    const double p99    = bench_percentile(r.samples, 99.0);
+
+    if (params.output == "csv") {
+        printf("%s,\"%s\",%u,\"%s\",%s,%s,%d,%d,%d,%zu,%.2f,%.2f,%.2f,%.2f\n",
+                timestamp.c_str(), features.c_str(), n_cpu, r.model.c_str(), r.type.c_str(), r.test.c_str(),
+                r.n_threads, r.n_batch, r.n_tokens, r.samples.size(), mean, stddev, p50, p99);
+    } else {
+        std::string samples = "[";
+        for (size_t i = 0; i < r.samples.size(); i++) {
+            samples += (i > 0 ? ", " : "") + json_number(r.samples[i]);
+        }
+        samples += "]";
+
+        printf("{\"timestamp\": %s, \"cpu_features\": %s, \"n_cpu\": %u, \"model\": %s, \"type\": %s, \"test\": %s, "
+               "\"n_threads\": %d, \"n_batch\": %d, \"n_tokens\": %d, \"samples_ts\": %s, "
+               "\"ts_mean\": %s, \"ts_stddev\": %s, \"ts_p50\": %s, \"ts_p99\": %s}\n",
+                json_escape(timestamp).c_str(), json_escape(features).c_str(), n_cpu, json_escape(r.model).c_str(),
+                json_escape(r.type).c_str(), json_escape(r.test).c_str(), r.n_threads, r.n_batch, r.n_tokens,
+                samples.c_str(), json_number(mean).c_str(), json_number(stddev).c_str(), json_number(p50).c_str(), json_number(p99).c_str());
+    }
+
+    fflush(stdout);
+}
+
+// evaluate `tokens` from an empty memory in batches of n_batch, returns the elapsed time in us or -1
+static int64_t bench_eval(biogpt_context & ctx, const token_sequence & tokens, const int n_batch, const int n_threads) {
+    std::vector<float> logits;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    for (int i = 0; i < (int) tokens.size(); i += n_batch) {
+        const int n_eval = std::min<int>(n_batch, tokens.size() - i);
+
+        const token_sequence embed(tokens.begin() + i, tokens.begin() + i + n_eval);
+        if (!biogpt_eval(ctx, embed, logits, i, n_threads)) {
+            return -1;
+        }
+    }
+
+    return ggml_time_us() - t_start_us;
+}
+
+int main(int argc, char **argv) {
+    ggml_time_init();
+
+    bench_params params;
+    if (!bench_params_parse(argc, argv, params)) {
+        return 1;
+    }
+
+    char timestamp[32];
+    {
+        const time_t t = time(NULL);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    }
+
+    bench_print_header(params);
+
+    for (const auto & fname : params.models) {
+        biogpt_vocab vocab;
+        biogpt_model model;
+
+        if (!biogpt_model_load(fname, model, vocab, params.verbosity)) {
+            fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        const int n_vocab     = model.hparams.n_vocab;
+        const int n_positions = model.hparams.n_positions;
+
+        const std::string type = ggml_type_name(ggml_ftype_to_ggml_type((ggml_ftype) model.hparams.ftype));
+
+        // the same tokens for every run, past the special ones
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> dist(4, n_vocab - 1);
+
+        token_sequence tokens(n_positions);
+        tokens[0] = 2;
+        for (int i = 1; i < n_positions; i++) {
+            tokens[i] = dist(rng);
+        }
+
+        for (const int n_batch : params.n_batch) {
+            // the compute buffer is sized for the batch, tg only needs one token
+            biogpt_context_params cparams;
+            cparams.n_batch = n_batch;
+
+            biogpt_context * ctx = biogpt_context_init(model, cparams);
+            if (!ctx) {
+                fprintf(stderr, "%s: failed to create a context with n_batch = %d\n", __func__, n_batch);
+                return 1;
+            }
+
+            for (const int n_threads : params.n_threads) {
+                std::vector<bench_result> tests;
+
+                for (const int n_prompt : params.n_prompt) {
+                    if (n_prompt > 0) {
+                        bench_result r;
+                        r.test     = "pp";
+                        r.n_tokens = n_prompt;
+                        tests.push_back(r);
+                    }
+                }
+
+                // tg does not depend on n_batch: only run it with the first one
+                for (const int n_gen : params.n_gen) {
+                    if (n_gen > 0 && n_batch == params.n_batch[0]) {
+                        bench_result r;
+                        r.test     = "tg";
+                        r.n_tokens = n_gen;
+                        tests.push_back(r);
+                    }
+                }
+
+                for (auto & r : tests) {
+                    r.model     = fname;
+                    r.type      = type;
+                    r.n_threads = n_threads;
+                    r.n_batch   = r.test == "pp" ? n_batch : 1;
+
+                    if (r.n_tokens > n_positions) {
+                        fprintf(stderr, "%s: skipping %s %d, longer than the context (%d)\n", __func__, r.test.c_str(), r.n_tokens, n_positions);
+                        continue;
+                    }
+
+                    const token_sequence embed(tokens.begin(), tokens.begin() + r.n_tokens);
+
+                    for (int rep = 0; rep < params.n_warmup + params.n_reps; rep++) {
+                        const int64_t t_us = bench_eval(*ctx, embed, r.n_batch, n_threads);
+                        if (t_us < 0) {
+                            fprintf(stderr, "%s: failed to evaluate %s %d\n", __func__, r.test.c_str(), r.n_tokens);
+                            return 1;
+                        }
+
+                        if (rep >= params.n_warmup) {
+                            r.samples.push_back(r.n_tokens*1e6/std::max<int64_t>(1, t_us));
+                        }
+                    }
+
+                    if (params.verbosity > 0) {
+                        fprintf(stderr, "%s: %s %d, %d threads, n_batch = %d: %.2f tokens/s\n", __func__,
+                                r.test.c_str(), r.n_tokens, n_threads, r.n_batch, bench_mean(r.samples));
+                    }
+
+                    bench_print_result(params, r, timestamp);
+                }
+            }
+
+            biogpt_context_free(ctx);
+        }
+
+        biogpt_model_free(model);
+    }
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+
+#include "biogpt.h"
+
+// Evaluates a corpus (-f, one document per line) and writes the mean squared input of every channel of
+// every linear layer (-o), read by `quantize --importance` to weight the rounding error of the columns
+
+int main(int argc, char **argv) {
+    ggml_time_init();
+
+    const int64_t t_main_start_us = ggml_time_us();
+
+    biogpt_params params;
+    params.n_batch = 64;
+
+    if (biogpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.prompt_file.empty() || params.output.empty()) {
+        fprintf(stderr, "%s: a corpus (-f FNAME) and an output file (-o FNAME) are required\n", __func__);
+        return 1;
+    }
+
+    std::ifstream fin(params.prompt_file);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.prompt_file.c_str());
+        return 1;
+    }
+
+    biogpt_vocab vocab;
+    biogpt_model model;
+
+    if (!biogpt_model_load(params.model, model, vocab, params.verbosity)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+        return 1;
+    }
+
+    const int n_positions = model.hparams.n_positions;
+
+    // each document is evaluated from the start of the memory
+    biogpt_context_params cparams;
+    cparams.n_batch     = params.n_batch;
+    cparams.calibration = true;
+    cparams.verbosity   = params.verbosity;
+
+    biogpt_context * ctx = biogpt_context_init(model, cparams);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return 1;
+    }
+
+    biogpt_calibration calib;
+    ctx->calibration = &calib;
+
+    int32_t n_docs      = 0;
+    int64_t n_truncated = 0;
+    int64_t t_eval_us   = 0;
+
+    std::vector<float> logits;
+
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (params.n_chunks > 0 && n_docs >= params.n_chunks) {
+            break;
+        }
+
+        token_sequence tokens = gpt_tokenize(vocab, line, params.lang);
+        if ((int) tokens.size() > n_positions) {
+            tokens.resize(n_positions);
+            n_truncated++;
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+
+        for (int i = 0; i < (int) tokens.size(); i += params.n_batch) {
+            const int n_eval = std::min((int) tokens.size() - i, params.n_batch);
+
+            const token_sequence batch(tokens.begin() + i, tokens.begin() + i + n_eval);
+            if (!biogpt_eval(*ctx, batch, logits, i, params.n_threads)) {
+                fprintf(stderr, "%s: failed to evaluate document %d\n", __func__, n_docs);
+                return 1;
+            }
+        }
+
+        t_eval_us += ggml_time_us() - t_start_us;
+
+        n_docs++;
+
+        if (params.verbosity > 0) {
+            fprintf(stderr, "%s: %d documents, %lld tokens\n", __func__, n_docs, (long long) calib.n_tokens);
+        }
+    }
+
+    if (calib.n_tokens == 0) {
+        fprintf(stderr, "%s: no tokens evaluated from '%s'\n", __func__, params.prompt_file.c_str());
+        return 1;
+    }
+
+    if (!biogpt_calibration_save(params.output, calib)) {
+        return 1;
+    }
+
+    // report timing
+    {
+        const int64_t t_main_end_us = ggml_time_us();
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, "%s: %d documents, %lld tokens, %lld truncated to %d tokens\n", __func__, n_docs, (long long) calib.n_tokens, (long long) n_truncated, n_positions);
+        fprintf(stderr, "%s: statistics of %d linear layers written to '%s'\n", __func__, (int) calib.sum_sq.size(), params.output.c_str());
+        fprintf(stderr, "%s:     eval time = %8.2f ms / %.2f tokens/s\n", __func__,
+                t_eval_us/1000.0f, calib.n_tokens*1e6/std::max<int64_t>(1, t_eval_us));
+        fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
+    }
+
+    biogpt_context_free(ctx);
+    biogpt_model_free(model);
+
+    return 0;
+}
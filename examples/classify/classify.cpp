@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+
+#include "biogpt.h"
+
+// Answers each prompt with one of a fixed set of labels (e.g. PubMedQA's yes/no/maybe). When every
+// label is a distinct single token, only their logits are computed: the lm head is reduced to those
+// rows. Otherwise, the labels are scored as continuations of the prompt by their length-normalized
+// log-likelihood, all in one batch on top of a single evaluation of the prompt.
+
+int main(int argc, char **argv) {
+    ggml_time_init();
+
+    const int64_t t_main_start_us = ggml_time_us();
+
+    biogpt_params params;
+    params.labels = "yes,no,maybe";
+
+    if (biogpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    std::vector<std::string> prompts;
+    if (!params.prompt_file.empty()) {
+        std::ifstream fin(params.prompt_file);
+        if (!fin) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.prompt_file.c_str());
+            return 1;
+        }
+
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (!line.empty()) {
+                prompts.push_back(line);
+            }
+        }
+    } else {
+        prompts.push_back(params.prompt);
+    }
+
+    biogpt_vocab vocab;
+    biogpt_model model;
+
+    if (!biogpt_model_load(params.model, model, vocab, params.verbosity)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+        return 1;
+    }
+
+    std::vector<std::string>    labels;
+    std::vector<token_sequence> label_tokens;
+    {
+        std::stringstream ss(params.labels);
+        std::string label;
+        while (std::getline(ss, label, ',')) {
+            // the labels continue the prompt: drop the </s> that starts every tokenized text
+            token_sequence tokens = gpt_tokenize(vocab, label, params.lang);
+            tokens.erase(tokens.begin());
+            if (tokens.empty()) {
+                fprintf(stderr, "%s: label '%s' has no token\n", __func__, label.c_str());
+                return 1;
+            }
+
+            labels.push_back(label);
+            label_tokens.push_back(tokens);
+        }
+    }
+
+    // single-token labels are told apart by their logits alone
+    token_sequence label_ids;
+    for (const auto & tokens : label_tokens) {
+        if (tokens.size() > 1 || std::find(label_ids.begin(), label_ids.end(), tokens[0]) != label_ids.end()) {
+            label_ids.clear();
+            break;
+        }
+        label_ids.push_back(tokens[0]);
+    }
+
+    const bool restricted = !label_ids.empty();
+    const bool paged      = params.n_kv_blocks > 0;
+
+    if (params.verbosity > 0) {
+        fprintf(stderr, "%s: %s\n", __func__, restricted ? "scoring the logits of the labels" : "scoring the labels as continuations");
+    }
+
+    // no prompt batch needs the logits of the whole vocabulary
+    biogpt_eval_opts opts;
+    opts.allowed_ids = restricted ? &label_ids : NULL;
+
+    // the context fits the prompt batches and, when scoring continuations, the batch of the labels
+    biogpt_context_params cparams;
+    cparams.n_kv_blocks = params.n_kv_blocks;
+    cparams.n_batch     = params.n_batch;
+    cparams.verbosity   = params.verbosity;
+    if (!restricted) {
+        size_t n_sum = 0;
+        size_t n_max = 0;
+        for (const auto & tokens : label_tokens) {
+            n_sum += tokens.size();
+            n_max  = std::max(n_max, tokens.size());
+        }
+
+        cparams.n_batch = std::max<int>(cparams.n_batch, paged ? n_sum : n_max);
+        cparams.n_seq   = paged ? labels.size() : 1;
+    }
+
+    biogpt_context * ctx = biogpt_context_init(model, cparams);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return 1;
+    }
+
+    int64_t t_predict_us = 0;
+    int     n_tokens     = 0;
+
+    std::vector<float> logits(labels.size());
+    std::vector<float> probs(labels.size());
+
+    std::vector<biogpt_choice_score> scores;
+
+    for (size_t q = 0; q < prompts.size(); q++) {
+        const token_sequence embed_inp = gpt_tokenize(vocab, prompts[q], params.lang);
+
+        const int n_inp = std::min((int) embed_inp.size(), model.hparams.n_positions);
+        if (n_inp == 0) {
+            continue;
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+
+        if (restricted) {
+            for (int i = 0; i < n_inp; i += params.n_batch) {
+                const int n_eval = std::min(params.n_batch, n_inp - i);
+
+                token_sequence embed(embed_inp.begin() + i, embed_inp.begin() + i + n_eval);
+                if (!biogpt_eval(*ctx, embed, logits, i, params.n_threads, opts)) {
+                    fprintf(stderr, "%s: failed to evaluate prompt %zu\n", __func__, q);
+                    return 1;
+                }
+            }
+        } else {
+            // leave room for the longest label
+            size_t n_max = 0;
+            for (const auto & tokens : label_tokens) {
+                n_max = std::max(n_max, tokens.size());
+            }
+
+            const token_sequence prompt(embed_inp.begin(), embed_inp.begin() + std::min<size_t>(n_inp, model.hparams.n_positions - n_max));
+            if (!biogpt_score_choices(*ctx, prompt, label_tokens, scores, params.n_batch, params.n_threads)) {
+                fprintf(stderr, "%s: failed to score prompt %zu\n", __func__, q);
+                return 1;
+            }
+
+            for (size_t k = 0; k < labels.size(); k++) {
+                logits[k] = scores[k].logprob_norm;
+            }
+        }
+
+        t_predict_us += ggml_time_us() - t_start_us;
+        n_tokens     += n_inp;
+
+        // softmax over the labels
+        const float max = *std::max_element(logits.begin(), logits.begin() + labels.size());
+
+        float sum = 0.0f;
+        for (size_t k = 0; k < labels.size(); k++) {
+            probs[k] = expf(logits[k] - max);
+            sum += probs[k];
+        }
+
+        const size_t best = std::max_element(probs.begin(), probs.end()) - probs.begin();
+
+        printf("%s", labels[best].c_str());
+        for (size_t k = 0; k < labels.size(); k++) {
+            printf("\t%s=%.4f", labels[k].c_str(), probs[k]/sum);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    // report timing
+    {
+        const int64_t t_main_end_us = ggml_time_us();
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, "%s:  predict time = %8.2f ms / %.2f ms per token\n", __func__, t_predict_us/1000.0f, t_predict_us/1000.0f/std::max(1, n_tokens));
+        fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
+    }
+
+    biogpt_context_free(ctx);
+    biogpt_model_free(model);
+
+    return 0;
+}
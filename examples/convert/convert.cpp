@@ -0,0 +1,538 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ggml.h"
+
+#include "biogpt.h"
+#include "json.h"
+
+// Converts a Hugging Face BioGPT checkpoint (model.safetensors, config.json, vocab.json, merges.txt) straight
+// to a ggml model file, without Python. The checkpoint is memory-mapped and each tensor is converted and
+// written by chunks of rows, so the memory stays bounded whatever the size of the model.
+
+// values converted at a time
+#define CONVERT_CHUNK_SIZE (1 << 20)
+
+struct convert_tensor {
+    std::string name;
+    std::string dtype;  // F32, F16 or BF16
+
+    std::vector<int32_t> ne;  // ggml order, the dimensions of size 1 removed
+
+    size_t offset = 0;  // in the data section
+    size_t size   = 0;
+};
+
+struct convert_file {
+    int       fd   = -1;
+    uint8_t * addr = NULL;
+    size_t    size = 0;
+
+    ~convert_file() {
+        if (addr) {
+            munmap(addr, size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+static bool read_file(const std::string & fname, std::string & out) {
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    std::stringstream ss;
+    ss << fin.rdbuf();
+    out = ss.str();
+
+    return true;
+}
+
+static bool read_json(const std::string & fname, json_value & out) {
+    std::string text;
+    if (!read_file(fname, text)) {
+        return false;
+    }
+
+    if (!json_parse(text, out) || out.type != json_value::JSON_OBJECT) {
+        fprintf(stderr, "%s: invalid JSON object in '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static bool convert_type_from_name(const std::string & name, ggml_type & type, ggml_ftype & ftype) {
+    static const struct {
+        const char * name;
+        ggml_type    type;
+        ggml_ftype   ftype;
+    } types[] = {
+        { "f32",  GGML_TYPE_F32,  GGML_FTYPE_ALL_F32     },
+        { "f16",  GGML_TYPE_F16,  GGML_FTYPE_MOSTLY_F16  },
+        { "q4_0", GGML_TYPE_Q4_0, GGML_FTYPE_MOSTLY_Q4_0 },
+        { "q4_1", GGML_TYPE_Q4_1, GGML_FTYPE_MOSTLY_Q4_1 },
+        { "q5_0", GGML_TYPE_Q5_0, GGML_FTYPE_MOSTLY_Q5_0 },
+        { "q5_1", GGML_TYPE_Q5_1, GGML_FTYPE_MOSTLY_Q5_1 },
+        { "q8_0", GGML_TYPE_Q8_0, GGML_FTYPE_MOSTLY_Q8_0 },
+        { "q2_k", GGML_TYPE_Q2_K, GGML_FTYPE_MOSTLY_Q2_K },
+        { "q3_k", GGML_TYPE_Q3_K, GGML_FTYPE_MOSTLY_Q3_K },
+        { "q4_k", GGML_TYPE_Q4_K, GGML_FTYPE_MOSTLY_Q4_K },
+        { "q5_k", GGML_TYPE_Q5_K, GGML_FTYPE_MOSTLY_Q5_K },
+        { "q6_k", GGML_TYPE_Q6_K, GGML_FTYPE_MOSTLY_Q6_K },
+    };
+
+    std::string lname = name;
+    std::transform(lname.begin(), lname.end(), lname.begin(), ::tolower);
+
+    for (const auto & t : types) {
+        if (lname == t.name) {
+            type  = t.type;
+            ftype = t.ftype;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the tensors of the safetensors header, in the order of their data
+static bool convert_parse_header(
+         const convert_file & file,
+                     size_t & data_start,
+std::vector<convert_tensor> & tensors) {
+    if (file.size < 8) {
+        fprintf(stderr, "%s: file too small\n", __func__);
+        return false;
+    }
+
+    uint64_t header_size = 0;
+    for (int i = 7; i >= 0; i--) {
+        header_size = (header_size << 8) | file.addr[i];
+    }
+
+    if (header_size > file.size - 8) {
+        fprintf(stderr, "%s: invalid header size %llu\n", __func__, (unsigned long long) header_size);
+        return false;
+    }
+
+    data_start = 8 + header_size;
+
+    json_value header;
+    if (!json_parse(std::string((const char *) file.addr + 8, header_size), header) || header.type != json_value::JSON_OBJECT) {
+        fprintf(stderr, "%s: invalid JSON header\n", __func__);
+        return false;
+    }
+
+    for (const auto & kv : header.obj) {
+        if (kv.first == "__metadata__") {
+            continue;
+        }
+
+        const json_value & info    = kv.second;
+        const json_value * dtype   = info.get("dtype");
+        const json_value * shape   = info.get("shape");
+        const json_value * offsets = info.get("data_offsets");
+
+        if (!dtype || dtype->type != json_value::JSON_STRING ||
+            !shape || shape->type != json_value::JSON_ARRAY ||
+            !offsets || offsets->type != json_value::JSON_ARRAY || offsets->arr.size() != 2) {
+            fprintf(stderr, "%s: invalid entry for tensor '%s'\n", __func__, kv.first.c_str());
+            return false;
+        }
+
+        uint64_t begin = 0;
+        uint64_t end   = 0;
+        if (!json_to(offsets->arr[0], begin) || !json_to(offsets->arr[1], end) || end < begin || end > file.size) {
+            fprintf(stderr, "%s: tensor '%s' has invalid data offsets\n", __func__, kv.first.c_str());
+            return false;
+        }
+
+        convert_tensor tensor;
+        tensor.name   = kv.first;
+        tensor.dtype  = dtype->str;
+        tensor.offset = (size_t) begin;
+        tensor.size   = (size_t) (end - begin);
+
+        if (tensor.dtype != "F32" && tensor.dtype != "F16" && tensor.dtype != "BF16") {
+            fprintf(stderr, "%s: tensor '%s' has unsupported dtype %s\n", __func__, tensor.name.c_str(), tensor.dtype.c_str());
+            return false;
+        }
+
+        // ggml lists the dimensions from the innermost one
+        int64_t nelements = 1;
+        for (auto it = shape->arr.rbegin(); it != shape->arr.rend(); ++it) {
+            int32_t n = 0;
+            if (!json_to(*it, n) || n < 0 || (n > 0 && nelements > (int64_t) file.size/n)) {
+                fprintf(stderr, "%s: tensor '%s' has an invalid shape\n", __func__, tensor.name.c_str());
+                return false;
+            }
+            nelements *= n;
+            if (n != 1) {
+                tensor.ne.push_back(n);
+            }
+        }
+
+        const size_t bpe = tensor.dtype == "F32" ? 4 : 2;
+        if (nelements <= 0 || tensor.ne.empty() || tensor.ne.size() > 2 || (size_t) nelements*bpe != tensor.size ||
+            data_start + tensor.offset + tensor.size > file.size) {
+            fprintf(stderr, "%s: tensor '%s' has an invalid shape or size\n", __func__, tensor.name.c_str());
+            return false;
+        }
+
+        tensors.push_back(tensor);
+    }
+
+    std::sort(tensors.begin(), tensors.end(), [](const convert_tensor & a, const convert_tensor & b) {
+        return a.offset < b.offset;
+    });
+
+    return true;
+}
+
+// convert n values of a safetensors dtype to f32
+static void convert_to_f32(const std::string & dtype, const uint8_t * src, float * dst, const int n) {
+    if (dtype == "F32") {
+        memcpy(dst, src, n*sizeof(float));
+    } else if (dtype == "F16") {
+        ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, dst, n);
+    } else {
+        // bf16 is the upper half of an f32
+        const uint16_t * x = (const uint16_t *) src;
+        for (int i = 0; i < n; i++) {
+            const uint32_t bits = (uint32_t) x[i] << 16;
+            memcpy(&dst[i], &bits, sizeof(float));
+        }
+    }
+}
+
+static void convert_print_usage(char ** argv) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  --dir-model DIR       Hugging Face checkpoint: model.safetensors, config.json, vocab.json, merges.txt\n");
+    fprintf(stderr, "  -o FNAME, --output FNAME\n");
+    fprintf(stderr, "                        output model file (default: DIR/ggml-model-TYPE.bin)\n");
+    fprintf(stderr, "  --type TYPE           type of the matrices: f32, f16, q4_0, q4_1, q5_0, q5_1, q8_0, q2_k ... q6_k (default: f16)\n");
+    fprintf(stderr, "  --policy POLICY       uniform, mixed, mixed-f16 or a rule file, as for quantize (default: uniform)\n");
+    fprintf(stderr, "  --threads N           threads quantizing each chunk (default: number of cores)\n");
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    const int64_t t_main_start_us = ggml_time_us();
+
+    std::string dir_model;
+    std::string fname_out;
+    std::string type_name = "f16";
+    std::string policy    = "uniform";
+
+    int n_threads = std::max(1, (int) std::thread::hardware_concurrency());
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--dir-model") {
+            dir_model = argv[++i];
+        } else if (arg == "-o" || arg == "--output") {
+            fname_out = argv[++i];
+        } else if (arg == "--type") {
+            type_name = argv[++i];
+        } else if (arg == "--policy") {
+            policy = argv[++i];
+        } else if (arg == "--threads") {
+            n_threads = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "-h" || arg == "--help") {
+            convert_print_usage(argv);
+            return 0;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            convert_print_usage(argv);
+            return 1;
+        }
+    }
+
+    if (dir_model.empty()) {
+        fprintf(stderr, "%s: a checkpoint directory (--dir-model DIR) is required\n", __func__);
+        return 1;
+    }
+
+    ggml_type  wtype;
+    ggml_ftype ftype;
+    if (!convert_type_from_name(type_name, wtype, ftype)) {
+        fprintf(stderr, "%s: unknown type '%s'\n", __func__, type_name.c_str());
+        return 1;
+    }
+
+    if (fname_out.empty()) {
+        fname_out = dir_model + "/ggml-model-" + type_name + ".bin";
+    }
+
+    biogpt_hparams hparams;
+
+    // hyperparameters
+    {
+        json_value config;
+        if (!read_json(dir_model + "/config.json", config)) {
+            return 1;
+        }
+
+        if (!json_get(config, "vocab_size",              hparams.n_vocab)     ||
+            !json_get(config, "num_hidden_layers",       hparams.n_layer)     ||
+            !json_get(config, "num_attention_heads",     hparams.n_head)      ||
+            !json_get(config, "max_position_embeddings", hparams.n_positions) ||
+            !json_get(config, "intermediate_size",       hparams.d_ff)        ||
+            !json_get(config, "hidden_size",             hparams.d_model)) {
+            fprintf(stderr, "%s: invalid hyperparameters in config.json\n", __func__);
+            return 1;
+        }
+
+        hparams.ftype = ftype;
+    }
+
+    std::vector<biogpt_quantize_rule> rules;
+    if (!biogpt_quantize_policy_preset(policy, hparams.n_layer, rules) && !biogpt_quantize_policy_load(policy, rules)) {
+        fprintf(stderr, "%s: invalid quantization policy '%s'\n", __func__, policy.c_str());
+        return 1;
+    }
+
+    std::vector<std::regex> rules_re;
+    for (const auto & rule : rules) {
+        rules_re.push_back(std::regex(rule.pattern));
+    }
+
+    // map the checkpoint
+    convert_file file;
+    {
+        const std::string fname = dir_model + "/model.safetensors";
+
+        file.fd = open(fname.c_str(), O_RDONLY);
+        if (file.fd < 0) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        struct stat st;
+        if (fstat(file.fd, &st) != 0) {
+            fprintf(stderr, "%s: failed to stat '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        file.size = st.st_size;
+        file.addr = (uint8_t *) mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+        if (file.addr == MAP_FAILED) {
+            file.addr = NULL;
+            fprintf(stderr, "%s: failed to map '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        madvise(file.addr, file.size, MADV_SEQUENTIAL);
+    }
+
+    size_t data_start = 0;
+
+    std::vector<convert_tensor> tensors;
+    if (!convert_parse_header(file, data_start, tensors)) {
+        return 1;
+    }
+
+    std::ofstream fout(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
+        return 1;
+    }
+
+    // magic and hyperparameters
+    {
+        uint32_t magic = BIOGPT_FILE_MAGIC;
+
+        write_safe(fout, magic);
+        write_safe(fout, hparams.n_vocab);
+        write_safe(fout, hparams.n_layer);
+        write_safe(fout, hparams.n_head);
+        write_safe(fout, hparams.n_positions);
+        write_safe(fout, hparams.d_ff);
+        write_safe(fout, hparams.d_model);
+        write_safe(fout, hparams.ftype);
+    }
+
+    // vocab, in the order of the ids
+    {
+        json_value vocab;
+        if (!read_json(dir_model + "/vocab.json", vocab)) {
+            return 1;
+        }
+
+        std::vector<std::pair<int32_t, const std::string *>> tokens;
+        for (const auto & kv : vocab.obj) {
+            if (kv.second.type != json_value::JSON_NUMBER) {
+                fprintf(stderr, "%s: invalid id for token '%s' in vocab.json\n", __func__, kv.first.c_str());
+                return 1;
+            }
+            tokens.push_back(std::make_pair((int32_t) kv.second.num, &kv.first));
+        }
+
+        std::sort(tokens.begin(), tokens.end());
+
+        int32_t n_vocab = tokens.size();
+        write_safe(fout, n_vocab);
+
+        for (const auto & token : tokens) {
+            uint32_t len = token.second->size();
+            write_safe(fout, len);
+            fout.write(token.second->data(), len);
+        }
+
+        printf("%s: vocab size    = %d\n", __func__, n_vocab);
+    }
+
+    // merges, the first two fields of every line
+    {
+        std::string text;
+        if (!read_file(dir_model + "/merges.txt", text)) {
+            return 1;
+        }
+
+        std::vector<std::string> merges;
+
+        std::istringstream ss(text);
+        std::string line;
+        while (std::getline(ss, line)) {
+            std::istringstream ls(line);
+            std::string first, second;
+            ls >> first >> second;
+            merges.push_back(first + " " + second);
+        }
+
+        int32_t n_merges = merges.size();
+        write_safe(fout, n_merges);
+
+        for (const auto & merge : merges) {
+            uint32_t len = merge.size();
+            write_safe(fout, len);
+            fout.write(merge.data(), len);
+        }
+
+        printf("%s: merges size   = %d\n", __func__, n_merges);
+    }
+
+    // tensors
+    size_t total_size_org = 0;
+    size_t total_size_new = 0;
+
+    std::vector<float>   buf_f32;
+    std::vector<uint8_t> buf_out;
+
+    // the lm head tied to the token embeddings is not written, the loader shares the embeddings, wherever it is stored
+    const convert_tensor * embd = NULL;
+    for (const auto & tensor : tensors) {
+        if (tensor.name == "biogpt.embed_tokens.weight") {
+            embd = &tensor;
+        }
+    }
+
+    for (const auto & tensor : tensors) {
+        const uint8_t * src = file.addr + data_start + tensor.offset;
+
+        if (tensor.name == "output_projection.weight" && embd && embd->dtype == tensor.dtype && embd->ne == tensor.ne &&
+            memcmp(file.addr + data_start + embd->offset, src, tensor.size) == 0) {
+            printf("%64s - tied to the token embeddings, skipped\n", tensor.name.c_str());
+            continue;
+        }
+
+        const int32_t n_dims    = tensor.ne.size();
+        const int32_t n_per_row = tensor.ne[0];
+        const int32_t n_rows    = n_dims > 1 ? tensor.ne[1] : 1;
+
+        // the matrices take the type of the policy, the vectors stay in f32
+        ggml_type type = GGML_TYPE_F32;
+        if (n_dims == 2 && tensor.name.find("weight") != std::string::npos) {
+            type = wtype;
+            for (size_t i = 0; i < rules.size(); i++) {
+                if (std::regex_match(tensor.name, rules_re[i])) {
+                    type = rules[i].type;
+                    break;
+                }
+            }
+            type = biogpt_quantize_row_type(type, n_per_row);
+        }
+
+        const int32_t length = tensor.name.size();
+        const int32_t ttype  = type;
+
+        write_safe(fout, n_dims);
+        write_safe(fout, length);
+        write_safe(fout, ttype);
+        for (int i = 0; i < n_dims; i++) {
+            int32_t ne = tensor.ne[i];
+            write_safe(fout, ne);
+        }
+        fout.write(tensor.name.data(), length);
+
+        // by chunks of whole rows
+        const int    rows_per_chunk = std::max(1, CONVERT_CHUNK_SIZE/n_per_row);
+        const size_t src_row_size   = tensor.size/n_rows;
+
+        size_t cur_size = 0;
+
+        for (int r0 = 0; r0 < n_rows; r0 += rows_per_chunk) {
+            const int n_chunk_rows = std::min(rows_per_chunk, n_rows - r0);
+
+            buf_f32.resize((size_t) n_chunk_rows*n_per_row);
+            buf_out.resize((size_t) n_chunk_rows*n_per_row*sizeof(float));
+
+            convert_to_f32(tensor.dtype, src + r0*src_row_size, buf_f32.data(), n_chunk_rows*n_per_row);
+
+            const size_t size = biogpt_convert_rows(type, buf_f32.data(), buf_out.data(), n_chunk_rows, n_per_row, n_threads);
+            fout.write((const char *) buf_out.data(), size);
+
+            cur_size += size;
+        }
+
+        // the pages of the checkpoint are not needed anymore
+        {
+            const uintptr_t page  = sysconf(_SC_PAGESIZE);
+            const uintptr_t begin = (uintptr_t) src & ~(page - 1);
+
+            madvise((void *) begin, (uintptr_t) src + tensor.size - begin, MADV_DONTNEED);
+        }
+
+        printf("%64s - [%5d, %5d], %4s -> %6s, %8.2f MB -> %8.2f MB\n", tensor.name.c_str(), n_per_row, n_rows,
+                tensor.dtype.c_str(), ggml_type_name(type), tensor.size/1024.0/1024.0, cur_size/1024.0/1024.0);
+
+        total_size_org += tensor.size;
+        total_size_new += cur_size;
+    }
+
+    fout.close();
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out.c_str());
+        return 1;
+    }
+
+    const int64_t t_main_end_us = ggml_time_us();
+
+    printf("%s: checkpoint size = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
+    printf("%s: model size      = %8.2f MB | type = %s\n", __func__, total_size_new/1024.0/1024.0, type_name.c_str());
+    printf("%s: written to '%s' in %.2f s\n", __func__, fname_out.c_str(), (t_main_end_us - t_main_start_us)/1e6);
+
+    return 0;
+}
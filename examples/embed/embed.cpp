@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+
+#include "biogpt.h"
+
+// Embeds a corpus (-f, one document per line) and streams the vectors to a binary matrix (-o):
+//   int32 n_docs, int32 d_model, then n_docs rows of d_model float32, in the order of the corpus
+
+// documents tokenized and embedded at a time
+#define EMBED_CHUNK_SIZE 256
+
+// documents sharing a batch of the paged memory
+#define EMBED_BATCH_DOCS 8
+
+int main(int argc, char **argv) {
+    ggml_time_init();
+
+    const int64_t t_main_start_us = ggml_time_us();
+
+    biogpt_params params;
+    params.n_batch = 64;
+
+    if (biogpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.prompt_file.empty() || params.output.empty()) {
+        fprintf(stderr, "%s: a corpus (-f FNAME) and an output file (-o FNAME) are required\n", __func__);
+        return 1;
+    }
+
+    biogpt_pooling pooling;
+    if (params.pooling == "mean") {
+        pooling = BIOGPT_POOLING_MEAN;
+    } else if (params.pooling == "last") {
+        pooling = BIOGPT_POOLING_LAST;
+    } else {
+        fprintf(stderr, "%s: unknown pooling '%s'\n", __func__, params.pooling.c_str());
+        return 1;
+    }
+
+    std::ifstream fin(params.prompt_file);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.prompt_file.c_str());
+        return 1;
+    }
+
+    std::ofstream fout(params.output, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, params.output.c_str());
+        return 1;
+    }
+
+    biogpt_vocab vocab;
+    biogpt_model model;
+
+    if (!biogpt_model_load(params.model, model, vocab, params.verbosity)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+        return 1;
+    }
+
+    const int d_model     = model.hparams.d_model;
+    const int n_positions = model.hparams.n_positions;
+
+    // with the paged memory, the batches mix the end of a document with the start of the next ones
+    biogpt_context_params cparams;
+    cparams.n_kv_blocks = params.n_kv_blocks;
+    cparams.n_batch     = params.n_batch;
+    cparams.n_seq       = EMBED_BATCH_DOCS;
+    cparams.verbosity   = params.verbosity;
+
+    biogpt_context * ctx = biogpt_context_init(model, cparams);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return 1;
+    }
+
+    // the number of rows is written once the corpus is done
+    int32_t n_docs = 0;
+    write_safe(fout, n_docs);
+    write_safe(fout, d_model);
+
+    int64_t n_tokens    = 0;
+    int64_t n_truncated = 0;
+    int64_t t_embed_us  = 0;
+
+    std::vector<token_sequence> docs;
+    std::vector<float>          embeddings;
+
+    std::string line;
+    bool eof = false;
+    while (!eof) {
+        docs.clear();
+        while (docs.size() < EMBED_CHUNK_SIZE) {
+            if (!std::getline(fin, line)) {
+                eof = true;
+                break;
+            }
+
+            token_sequence tokens = gpt_tokenize(vocab, line, params.lang);
+            if ((int) tokens.size() > n_positions) {
+                tokens.resize(n_positions);
+                n_truncated++;
+            }
+
+            n_tokens += tokens.size();
+            docs.push_back(std::move(tokens));
+        }
+
+        if (docs.empty()) {
+            break;
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+
+        if (!biogpt_embed(*ctx, docs, pooling, embeddings, params.n_batch, params.n_threads)) {
+            fprintf(stderr, "%s: failed to embed documents %d to %d\n", __func__, n_docs, n_docs + (int) docs.size() - 1);
+            return 1;
+        }
+
+        t_embed_us += ggml_time_us() - t_start_us;
+
+        if (params.normalize) {
+            for (size_t d = 0; d < docs.size(); d++) {
+                float * row = embeddings.data() + d*d_model;
+
+                double sum = 0.0;
+                for (int j = 0; j < d_model; j++) {
+                    sum += row[j]*row[j];
+                }
+
+                const float scale = sum > 0.0 ? 1.0/sqrt(sum) : 0.0f;
+                for (int j = 0; j < d_model; j++) {
+                    row[j] *= scale;
+                }
+            }
+        }
+
+        fout.write((const char *) embeddings.data(), embeddings.size()*sizeof(float));
+
+        n_docs += docs.size();
+
+        if (params.verbosity > 0) {
+            fprintf(stderr, "%s: %d documents embedded\n", __func__, n_docs);
+        }
+    }
+
+    fout.seekp(0);
+    write_safe(fout, n_docs);
+    fout.close();
+
+    // report timing
+    {
+        const int64_t t_main_end_us = ggml_time_us();
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, "%s: %d documents, %lld tokens, %lld truncated to %d tokens\n", __func__, n_docs, (long long) n_tokens, (long long) n_truncated, n_positions);
+        fprintf(stderr, "%s:    embed time = %8.2f ms / %.2f documents/s / %.2f tokens/s\n", __func__,
+                t_embed_us/1000.0f, n_docs*1e6/std::max<int64_t>(1, t_embed_us), n_tokens*1e6/std::max<int64_t>(1, t_embed_us));
+        fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
+    }
+
+    biogpt_context_free(ctx);
+    biogpt_model_free(model);
+
+    return 0;
+}
@@ -0,0 +1,389 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// minimal JSON reader and writer helpers shared by the examples that speak JSON (server, batch)
+
+struct json_value {
+    enum json_type {
+        JSON_NULL,
+        JSON_BOOL,
+        JSON_NUMBER,
+        JSON_STRING,
+        JSON_ARRAY,
+        JSON_OBJECT,
+    };
+
+    json_type   type = JSON_NULL;
+    bool        b    = false;
+    double      num  = 0.0;
+    std::string str;
+
+    std::vector<json_value>                         arr;
+    std::vector<std::pair<std::string, json_value>> obj;
+
+    const json_value * get(const std::string & key) const {
+        for (const auto & kv : obj) {
+            if (kv.first == key) {
+                return &kv.second;
+            }
+        }
+        return NULL;
+    }
+};
+
+inline void json_skip_ws(const std::string & s, size_t & pos) {
+    while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\n' || s[pos] == '\r')) {
+        pos++;
+    }
+}
+
+inline bool json_parse_hex4(const std::string & s, size_t & pos, uint32_t & cp) {
+    if (pos + 4 > s.size()) {
+        return false;
+    }
+
+    cp = 0;
+    for (int i = 0; i < 4; i++) {
+        const char c = s[pos++];
+        cp <<= 4;
+        if (c >= '0' && c <= '9') {
+            cp |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            cp |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            cp |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+inline void utf8_append(std::string & out, const uint32_t cp) {
+    if (cp < 0x80) {
+        out += (char) cp;
+    } else if (cp < 0x800) {
+        out += (char) (0xC0 | (cp >> 6));
+        out += (char) (0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char) (0xE0 | (cp >> 12));
+        out += (char) (0x80 | ((cp >> 6) & 0x3F));
+        out += (char) (0x80 | (cp & 0x3F));
+    } else {
+        out += (char) (0xF0 | (cp >> 18));
+        out += (char) (0x80 | ((cp >> 12) & 0x3F));
+        out += (char) (0x80 | ((cp >> 6) & 0x3F));
+        out += (char) (0x80 | (cp & 0x3F));
+    }
+}
+
+inline bool json_parse_string(const std::string & s, size_t & pos, std::string & out) {
+    if (pos >= s.size() || s[pos] != '"') {
+        return false;
+    }
+    pos++;
+
+    out.clear();
+    while (pos < s.size()) {
+        char c = s[pos++];
+        if (c == '"') {
+            return true;
+        }
+        if ((unsigned char) c < 0x20) {
+            return false;
+        }
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+
+        if (pos >= s.size()) {
+            return false;
+        }
+
+        c = s[pos++];
+        switch (c) {
+            case '"':  out += '"';  break;
+            case '\\': out += '\\'; break;
+            case '/':  out += '/';  break;
+            case 'b':  out += '\b'; break;
+            case 'f':  out += '\f'; break;
+            case 'n':  out += '\n'; break;
+            case 'r':  out += '\r'; break;
+            case 't':  out += '\t'; break;
+            case 'u':
+                {
+                    uint32_t cp = 0;
+                    if (!json_parse_hex4(s, pos, cp)) {
+                        return false;
+                    }
+
+                    // surrogate pair
+                    if (cp >= 0xD800 && cp < 0xDC00) {
+                        uint32_t lo = 0;
+                        if (pos + 2 > s.size() || s[pos] != '\\' || s[pos + 1] != 'u') {
+                            return false;
+                        }
+                        pos += 2;
+                        if (!json_parse_hex4(s, pos, lo) || lo < 0xDC00 || lo >= 0xE000) {
+                            return false;
+                        }
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    }
+
+                    utf8_append(out, cp);
+                } break;
+            default:
+                return false;
+        }
+    }
+
+    return false;
+}
+
+inline bool json_parse_value(const std::string & s, size_t & pos, json_value & out, const int depth) {
+    if (depth > 32) {
+        return false;
+    }
+
+    json_skip_ws(s, pos);
+    if (pos >= s.size()) {
+        return false;
+    }
+
+    const char c = s[pos];
+
+    if (c == '{') {
+        out.type = json_value::JSON_OBJECT;
+        pos++;
+
+        json_skip_ws(s, pos);
+        if (pos < s.size() && s[pos] == '}') {
+            pos++;
+            return true;
+        }
+
+        while (true) {
+            json_skip_ws(s, pos);
+
+            std::string key;
+            if (!json_parse_string(s, pos, key)) {
+                return false;
+            }
+
+            json_skip_ws(s, pos);
+            if (pos >= s.size() || s[pos] != ':') {
+                return false;
+            }
+            pos++;
+
+            json_value value;
+            if (!json_parse_value(s, pos, value, depth + 1)) {
+                return false;
+            }
+            out.obj.push_back(std::make_pair(key, value));
+
+            json_skip_ws(s, pos);
+            if (pos >= s.size()) {
+                return false;
+            }
+            if (s[pos] == ',') {
+                pos++;
+                continue;
+            }
+            if (s[pos] == '}') {
+                pos++;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    if (c == '[') {
+        out.type = json_value::JSON_ARRAY;
+        pos++;
+
+        json_skip_ws(s, pos);
+        if (pos < s.size() && s[pos] == ']') {
+            pos++;
+            return true;
+        }
+
+        while (true) {
+            json_value value;
+            if (!json_parse_value(s, pos, value, depth + 1)) {
+                return false;
+            }
+            out.arr.push_back(value);
+
+            json_skip_ws(s, pos);
+            if (pos >= s.size()) {
+                return false;
+            }
+            if (s[pos] == ',') {
+                pos++;
+                continue;
+            }
+            if (s[pos] == ']') {
+                pos++;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    if (c == '"') {
+        out.type = json_value::JSON_STRING;
+        return json_parse_string(s, pos, out.str);
+    }
+
+    if (s.compare(pos, 4, "true") == 0) {
+        out.type = json_value::JSON_BOOL;
+        out.b    = true;
+        pos += 4;
+        return true;
+    }
+
+    if (s.compare(pos, 5, "false") == 0) {
+        out.type = json_value::JSON_BOOL;
+        out.b    = false;
+        pos += 5;
+        return true;
+    }
+
+    if (s.compare(pos, 4, "null") == 0) {
+        out.type = json_value::JSON_NULL;
+        pos += 4;
+        return true;
+    }
+
+    if (c == '-' || (c >= '0' && c <= '9')) {
+        const char * start = s.c_str() + pos;
+        char * end = NULL;
+
+        out.type = json_value::JSON_NUMBER;
+        out.num  = strtod(start, &end);
+        if (end == start) {
+            return false;
+        }
+        pos += end - start;
+        return true;
+    }
+
+    return false;
+}
+
+inline bool json_parse(const std::string & s, json_value & out) {
+    size_t pos = 0;
+    if (!json_parse_value(s, pos, out, 0)) {
+        return false;
+    }
+
+    json_skip_ws(s, pos);
+    return pos == s.size();
+}
+
+inline std::string json_escape(const std::string & s) {
+    std::string out = "\"";
+    for (const char c : s) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:
+                if ((unsigned char) c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
+
+    return out;
+}
+
+inline std::string json_number(const double x) {
+    if (!std::isfinite(x)) {
+        return "0";
+    }
+
+    // integers (e.g. ids) are written exactly
+    if (std::fabs(x) < 1e15 && x == (double) (long long) x) {
+        return std::to_string((long long) x);
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6g", x);
+    return buf;
+}
+
+// optional fields of an object: false if present with the wrong type, or with a number that T cannot represent
+inline bool json_get(const json_value & obj, const char * key, std::string & val) {
+    const json_value * v = obj.get(key);
+    if (v == NULL) {
+        return true;
+    }
+    if (v->type != json_value::JSON_STRING) {
+        return false;
+    }
+    val = v->str;
+    return true;
+}
+
+inline bool json_get(const json_value & obj, const char * key, bool & val) {
+    const json_value * v = obj.get(key);
+    if (v == NULL) {
+        return true;
+    }
+    if (v->type != json_value::JSON_BOOL) {
+        return false;
+    }
+    val = v->b;
+    return true;
+}
+
+// a number that T can represent, e.g. an element of an array
+template<typename T>
+bool json_to(const json_value & v, T & val) {
+    if (v.type != json_value::JSON_NUMBER || !std::isfinite(v.num)) {
+        return false;
+    }
+
+    const double x = v.num;
+    if (std::is_integral<T>::value) {
+        // max() + 1 is a power of two, exact as a double even when max() itself is not
+        const double lo = (double) std::numeric_limits<T>::min();
+        const double hi = (double) std::numeric_limits<T>::max() + 1.0;
+        if (x != std::floor(x) || x < lo || x >= hi) {
+            return false;
+        }
+    } else if (std::fabs(x) > (double) std::numeric_limits<T>::max()) {
+        return false;
+    }
+
+    val = (T) x;
+    return true;
+}
+
+template<typename T>
+bool json_get(const json_value & obj, const char * key, T & val) {
+    const json_value * v = obj.get(key);
+    if (v == NULL) {
+        return true;
+    }
+    return json_to(*v, val);
+}
@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+
+#include "biogpt.h"
+
+// Layer-skip self-speculative decoding: the first K decoder layers followed by the final norm and
+// lm head draft n_draft tokens, which the full model verifies in a single batched evaluation.
+// The draft writes the keys and values of the shallow layers into the context's own memory, and the
+// verification overwrites them with the same values, so no extra weights or memory are needed.
+// Without --draft_layers, every K is swept and compared to plain decoding.
+
+struct run_stats {
+    int n_generated = 0;
+    int n_drafted   = 0;
+    int n_accepted  = 0;
+    int n_steps     = 0;
+
+    int64_t t_draft_us  = 0;
+    int64_t t_verify_us = 0;
+    int64_t t_gen_us    = 0;
+};
+
+// generate from the prompt, drafting with the first n_draft_layers layers (0 = plain decoding)
+static bool run(
+           biogpt_context & ctx,
+       const biogpt_vocab & vocab,
+     const token_sequence & prompt,
+     const biogpt_params  & params,
+                const int   n_draft_layers,
+                run_stats & stats) {
+    const int n_vocab  = ctx.model->hparams.n_vocab;
+    const int n_prompt = prompt.size();
+
+    const biogpt_vocab::id eos_id = 2;
+
+    std::mt19937 rng(params.seed);
+
+    std::vector<float> logits;
+
+    // evaluate the prompt except for its last token, which is evaluated with the first drafts
+    int n_past = 0;
+    for (int i = 0; i < n_prompt - 1; i += params.n_batch) {
+        const int n_eval = std::min(params.n_batch, n_prompt - 1 - i);
+
+        token_sequence embed(prompt.begin() + i, prompt.begin() + i + n_eval);
+        if (!biogpt_eval(ctx, embed, logits, n_past, params.n_threads)) {
+            fprintf(stderr, "%s: failed to evaluate the prompt\n", __func__);
+            return false;
+        }
+
+        n_past += n_eval;
+    }
+
+    token_sequence history = prompt;
+
+    biogpt_eval_opts opts_draft;
+    opts_draft.n_layer = n_draft_layers;
+
+    // the logits of the verified rows are read in place from the compute buffer
+    const float * rows = NULL;
+
+    biogpt_eval_opts opts_verify;
+    opts_verify.logits_view = &rows;
+
+    biogpt_sampler smpl;
+    if (!biogpt_sampler_init(smpl, biogpt_params_to_sampler(params), n_vocab)) {
+        return false;
+    }
+
+    std::vector<float> p;
+
+    const int64_t t_gen_start_us = ggml_time_us();
+
+    while (stats.n_generated < params.n_predict) {
+        token_sequence draft;
+
+        // draft with the shallow layers, writing their keys and values past n_past
+        if (n_draft_layers > 0) {
+            const int64_t t_start_us = ggml_time_us();
+
+            token_sequence pending(history.begin() + n_past, history.end());
+            int n_past_dft = n_past;
+
+            for (int i = 0; i < params.n_draft; i++) {
+                if (!biogpt_eval(ctx, pending, logits, n_past_dft, params.n_threads, opts_draft)) {
+                    fprintf(stderr, "%s: failed to draft\n", __func__);
+                    return false;
+                }
+                n_past_dft += pending.size();
+
+                // greedy drafts: q is one-hot, and the acceptance only depends on the full model
+                const biogpt_vocab::id id = std::max_element(logits.begin(), logits.end()) - logits.begin();
+                draft.push_back(id);
+
+                if (id == eos_id) {
+                    break;
+                }
+
+                pending = { id };
+            }
+
+            stats.t_draft_us += ggml_time_us() - t_start_us;
+        }
+
+        // verify the drafts with all the layers in one batch
+        token_sequence accepted;
+        int n_accept = 0;
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            token_sequence embed(history.begin() + n_past, history.end());
+            embed.insert(embed.end(), draft.begin(), draft.end());
+
+            const int n_rows = draft.size() + 1;
+
+            opts_verify.n_rows = n_rows;
+
+            if (!biogpt_eval(ctx, embed, logits, n_past, params.n_threads, opts_verify)) {
+                fprintf(stderr, "%s: failed to verify\n", __func__);
+                return false;
+            }
+
+            n_accept = biogpt_speculative_verify(smpl, rows, NULL, draft, eos_id, params.n_predict - stats.n_generated, rng, p, accepted);
+
+            stats.t_verify_us += ggml_time_us() - t_start_us;
+        }
+
+        // keep the accepted drafts, the key + value memory of the rejected ones is rolled back
+        history.insert(history.end(), accepted.begin(), accepted.end());
+        n_past = history.size() - 1;
+
+        stats.n_generated += accepted.size();
+        stats.n_drafted   += draft.size();
+        stats.n_accepted  += n_accept;
+        stats.n_steps++;
+
+        if (params.verbosity > 0) {
+            std::vector<std::string> tokens;
+            for (auto id : accepted) {
+                tokens.push_back(vocab.id_to_token.at(id));
+            }
+            printf("%s ", gpt_decode(tokens, params.lang).c_str());
+            fflush(stdout);
+        }
+
+        if (accepted.back() == eos_id) {
+            break;
+        }
+    }
+
+    stats.t_gen_us = ggml_time_us() - t_gen_start_us;
+
+    if (params.verbosity > 0) {
+        printf("\n\n");
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    ggml_time_init();
+
+    const int64_t t_main_start_us = ggml_time_us();
+
+    biogpt_params params;
+    if (biogpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.seed < 0) {
+        params.seed = time(NULL);
+    }
+
+    printf("%s: seed = %d\n", __func__, params.seed);
+
+    biogpt_vocab vocab;
+    biogpt_model model;
+
+    if (!biogpt_model_load(params.model, model, vocab, params.verbosity)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+        return 1;
+    }
+
+    const int n_layer = model.hparams.n_layer;
+
+    if (params.n_draft_layers < 0 || params.n_draft_layers >= n_layer) {
+        fprintf(stderr, "%s: the draft must use between 1 and %d layers\n", __func__, n_layer - 1);
+        return 1;
+    }
+
+    // the context fits the verification batch, the truncated drafts need less
+    biogpt_context_params cparams;
+    cparams.n_batch = std::max(params.n_batch, params.n_draft + 1);
+    cparams.verbosity = params.verbosity;
+
+    biogpt_context * ctx = biogpt_context_init(model, cparams);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return 1;
+    }
+
+    const token_sequence prompt = gpt_tokenize(vocab, params.prompt, params.lang);
+
+    params.n_predict = std::min(params.n_predict, model.hparams.n_positions - (int) prompt.size() - params.n_draft - 1);
+
+    printf("%s: prompt: '%s'\n", __func__, params.prompt.c_str());
+    printf("%s: number of tokens in prompt = %zu\n\n", __func__, prompt.size());
+
+    // plain decoding first, as the reference for the speedups
+    std::vector<int> layers = { 0 };
+    if (params.n_draft_layers > 0) {
+        layers.push_back(params.n_draft_layers);
+    } else {
+        for (int k = 1; k < n_layer; k++) {
+            layers.push_back(k);
+        }
+    }
+
+    printf("%8s %10s %10s %12s %14s %12s %10s\n", "layers", "drafted", "accepted", "acceptance", "tokens/verify", "ms/token", "speedup");
+
+    double ms_per_token_ref = 0.0;
+
+    for (int k : layers) {
+        run_stats stats;
+        if (!run(*ctx, vocab, prompt, params, k, stats)) {
+            return 1;
+        }
+
+        const double ms_per_token = stats.t_gen_us/1000.0/std::max(1, stats.n_generated);
+        if (k == 0) {
+            ms_per_token_ref = ms_per_token;
+        }
+
+        printf("%8s %10d %10d %11.2f%% %14.2f %12.2f %9.2fx\n",
+                k == 0 ? "none" : std::to_string(k).c_str(),
+                stats.n_drafted, stats.n_accepted, 100.0f*stats.n_accepted/std::max(1, stats.n_drafted),
+                (float) stats.n_generated/std::max(1, stats.n_steps),
+                ms_per_token, ms_per_token_ref/std::max(1e-9, ms_per_token));
+        fflush(stdout);
+    }
+
+    {
+        const int64_t t_main_end_us = ggml_time_us();
+
+        printf("\n");
+        printf("%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
+    }
+
+    biogpt_context_free(ctx);
+    biogpt_model_free(model);
+
+    return 0;
+}
@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+
+#include "biogpt.h"
+
+// Prompt-lookup decoding: drafts are copied from the prompt after the last n-gram of the generation,
+// then verified in a single batched evaluation. No draft model is needed, which suits extraction
+// tasks where the output mostly copies spans of the input.
+
+int main(int argc, char **argv) {
+    ggml_time_init();
+
+    const int64_t t_main_start_us = ggml_time_us();
+
+    biogpt_params params;
+    if (biogpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.seed < 0) {
+        params.seed = time(NULL);
+    }
+
+    printf("%s: seed = %d\n", __func__, params.seed);
+
+    std::mt19937 rng(params.seed);
+
+    int64_t t_load_us = 0;
+
+    biogpt_vocab vocab;
+    biogpt_model model;
+
+    // load the model
+    {
+        const int64_t t_start_us = ggml_time_us();
+
+        if (!biogpt_model_load(params.model, model, vocab, params.verbosity)) {
+            fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+            return 1;
+        }
+
+        t_load_us = ggml_time_us() - t_start_us;
+    }
+
+    const int n_vocab = model.hparams.n_vocab;
+    const int n_draft = params.n_draft;
+
+    const biogpt_vocab::id eos_id = 2;
+
+    // the context fits the verification batch
+    biogpt_context_params cparams;
+    cparams.n_batch = std::max(params.n_batch, n_draft + 1);
+    cparams.verbosity = params.verbosity;
+
+    biogpt_context * ctx = biogpt_context_init(model, cparams);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return 1;
+    }
+
+    // tokenize the prompt
+    const token_sequence prompt = gpt_tokenize(vocab, params.prompt, params.lang);
+
+    const int n_prompt = prompt.size();
+
+    params.n_predict = std::min(params.n_predict, model.hparams.n_positions - n_prompt - n_draft - 1);
+
+    printf("%s: prompt: '%s'\n", __func__, params.prompt.c_str());
+    printf("%s: number of tokens in prompt = %d\n\n", __func__, n_prompt);
+
+    token_sequence history = prompt;
+
+    std::vector<float> logits;
+
+    // evaluate the prompt except for its last token, which is evaluated with the first drafts
+    int n_past = 0;
+
+    int64_t t_prompt_us = 0;
+    {
+        const int64_t t_start_us = ggml_time_us();
+
+        for (int i = 0; i < n_prompt - 1; i += params.n_batch) {
+            const int n_eval = std::min(params.n_batch, n_prompt - 1 - i);
+
+            token_sequence embed(history.begin() + i, history.begin() + i + n_eval);
+            if (!biogpt_eval(*ctx, embed, logits, n_past, params.n_threads)) {
+                fprintf(stderr, "%s: failed to evaluate the prompt\n", __func__);
+                return 1;
+            }
+
+            n_past += n_eval;
+        }
+
+        t_prompt_us = ggml_time_us() - t_start_us;
+    }
+
+    {
+        std::vector<std::string> tokens;
+        for (auto id : history) {
+            tokens.push_back(vocab.id_to_token[id]);
+        }
+        printf("%s ", gpt_decode(tokens, params.lang).c_str());
+        fflush(stdout);
+    }
+
+    int n_generated = 0;
+    int n_drafted   = 0;
+    int n_accepted  = 0;
+    int n_steps     = 0;
+
+    int64_t t_lookup_us  = 0;
+    int64_t t_predict_us = 0;
+
+    // the logits of the verified rows are read in place from the compute buffer
+    const float * rows = NULL;
+
+    biogpt_eval_opts opts_verify;
+    opts_verify.logits_view = &rows;
+
+    biogpt_sampler smpl;
+    if (!biogpt_sampler_init(smpl, biogpt_params_to_sampler(params), n_vocab)) {
+        return 1;
+    }
+
+    std::vector<float> p;
+
+    const int64_t t_gen_start_us = ggml_time_us();
+
+    while (n_generated < params.n_predict) {
+        // draft by copying the prompt after the last generated n-gram
+        token_sequence draft;
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            draft = biogpt_prompt_lookup(prompt, history, params.n_ngram, n_draft);
+
+            t_lookup_us += ggml_time_us() - t_start_us;
+        }
+
+        // verify the drafts in one batch, falling back to a single token when there is none
+        token_sequence accepted;
+        int n_accept = 0;
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            token_sequence embed(history.begin() + n_past, history.end());
+            embed.insert(embed.end(), draft.begin(), draft.end());
+
+            const int n_rows = draft.size() + 1;
+
+            opts_verify.n_rows = n_rows;
+
+            if (!biogpt_eval(*ctx, embed, logits, n_past, params.n_threads, opts_verify)) {
+                fprintf(stderr, "%s: failed to predict\n", __func__);
+                return 1;
+            }
+
+            // the drafts are deterministic: q is one-hot
+            n_accept = biogpt_speculative_verify(smpl, rows, NULL, draft, eos_id, params.n_predict - n_generated, rng, p, accepted);
+
+            t_predict_us += ggml_time_us() - t_start_us;
+        }
+
+        // keep the accepted drafts, the key + value memory of the rejected ones is rolled back
+        history.insert(history.end(), accepted.begin(), accepted.end());
+        n_past = history.size() - 1;
+
+        n_generated += accepted.size();
+        n_drafted   += draft.size();
+        n_accepted  += n_accept;
+        n_steps++;
+
+        std::vector<std::string> tokens;
+        for (auto id : accepted) {
+            tokens.push_back(vocab.id_to_token[id]);
+        }
+        printf("%s ", gpt_decode(tokens, params.lang).c_str());
+        fflush(stdout);
+
+        if (accepted.back() == eos_id) {
+            break;
+        }
+    }
+
+    const int64_t t_gen_us = ggml_time_us() - t_gen_start_us;
+
+    // report statistics
+    {
+        const int64_t t_main_end_us = ggml_time_us();
+
+        printf("\n\n");
+        printf("%s: drafted = %d, accepted = %d, acceptance rate = %.2f%%\n", __func__,
+                n_drafted, n_accepted, 100.0f*n_accepted/std::max(1, n_drafted));
+        printf("%s: generated = %d tokens in %d evaluations (%.2f tokens per evaluation)\n", __func__,
+                n_generated, n_steps, (float) n_generated/std::max(1, n_steps));
+        printf("%s:     load time = %8.2f ms\n", __func__, t_load_us/1000.0f);
+        printf("%s:   prompt time = %8.2f ms\n", __func__, t_prompt_us/1000.0f);
+        printf("%s:   lookup time = %8.2f ms\n", __func__, t_lookup_us/1000.0f);
+        printf("%s:  predict time = %8.2f ms\n", __func__, t_predict_us/1000.0f);
+        printf("%s:     effective = %8.2f tokens/s\n", __func__, n_generated*1e6f/std::max<int64_t>(1, t_gen_us));
+        printf("%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
+    }
+
+    biogpt_context_free(ctx);
+    biogpt_model_free(model);
+
+    return 0;
+}
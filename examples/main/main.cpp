@@ -3,7 +3,6 @@
 #include <vector>
 
 #include "ggml.h"
-#include "ggml-alloc.h"
 
 #include "biogpt.h"
 
@@ -43,38 +42,47 @@ int main(int argc, char **argv) {
         t_load_us = ggml_time_us() - t_start_us;
     }
 
-    // keep this buffer alive while evaluating the model
-    ggml_backend_buffer_t buf_compute;
-
-    struct ggml_allocr * allocr = NULL;
-    // allocate the compute buffer
-    {
-         // alignment required by the backend
-        size_t align = ggml_backend_get_alignment(model.backend);
-        allocr = ggml_allocr_new_measure(align);
-
-        // create the worst case graph for memory usage estimation
-        int n_tokens = std::min(model.hparams.n_positions, params.n_batch);
-        int n_past = model.hparams.n_positions - n_tokens;
-        struct ggml_cgraph * gf = biogpt_graph(model, allocr, token_sequence(n_tokens, 0), n_past);
-
-        // compute the required memory
-        size_t mem_size = ggml_allocr_alloc_graph(allocr, gf);
+    biogpt_context_params cparams;
+    cparams.n_kv_blocks = params.n_kv_blocks;
+    cparams.n_batch     = params.n_batch;
+    cparams.verbosity   = params.verbosity;
+
+    // all the beams are evaluated in a single batch; they share the blocks of the prompt and own at
+    // most the blocks of their generation
+    if (params.n_beams > 0) {
+        cparams.n_seq = params.n_beams;
+        if (cparams.n_kv_blocks == 0) {
+            cparams.n_kv_blocks = model.hparams.n_positions/BIOGPT_KV_BLOCK_SIZE + params.n_beams*(params.n_predict/BIOGPT_KV_BLOCK_SIZE + 2);
+        }
+    }
 
-        // recreate the allocator with the required memory
-        ggml_allocr_free(allocr);
-        buf_compute = ggml_backend_alloc_buffer(model.backend, mem_size);
-        allocr = ggml_allocr_new_from_buffer(buf_compute);
+    biogpt_context * ctx = biogpt_context_init(model, cparams);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return 1;
+    }
 
-        fprintf(stderr, "%s: compute buffer size: %.2f MB\n", __func__, mem_size/1024.0/1024.0);
+    biogpt_profile profile;
+    profile.trace = !params.trace.empty();
+    if (params.profile || profile.trace) {
+        ctx->profile = &profile;
     }
 
-    int n_past = 0;
+    // the phases outside of the graph computation: tokenization, graph build, allocation, sampling
+    biogpt_metrics_enable(params.profile);
 
-    int64_t t_sample_us  = 0;
-    int64_t t_predict_us = 0;
+    auto report_profile = [&]() {
+        if (params.profile) {
+            biogpt_metrics_print();
+            biogpt_profile_print(profile);
+        }
+        if (profile.trace) {
+            biogpt_profile_save_trace(params.trace, profile);
+        }
+    };
 
-    std::vector<float> logits;
+    // positions of the generated sequence, and its block table when using the paged memory
+    biogpt_kv_seq seq;
 
     // tokenize the prompt
     token_sequence embed_inp = gpt_tokenize(vocab, params.prompt, params.lang);
@@ -88,85 +96,137 @@ int main(int argc, char **argv) {
     }
     printf("\n\n");
 
-    token_sequence embed;
+    const bool paged = ctx->kv_pool.n_blocks > 0;
 
-    for (size_t i = embed.size(); i < (int) embed_inp.size() + params.n_predict; i++) {
-        // predict
-        if (embed.size() > 0) {
-            const int64_t t_start_us = ggml_time_us();
+    if (params.n_beams > 0) {
+        biogpt_beam_params bparams;
+        bparams.n_beams        = params.n_beams;
+        bparams.n_predict      = params.n_predict;
+        bparams.length_penalty = params.length_penalty;
+        bparams.early_stopping = params.early_stopping;
 
-            if(!biogpt_eval(model, embed, logits, allocr, n_past, params.n_threads)) {
-                printf("Failed to predict\n");
-                return 1;
-            }
+        biogpt_beam_result result;
+        if (!biogpt_beam_search(*ctx, embed_inp, bparams, result, params.n_batch, params.n_threads)) {
+            printf("Failed to predict\n");
+            return 1;
+        }
 
-            t_predict_us += ggml_time_us() - t_start_us;
+        std::vector<std::string> tokens;
+        for (auto id : embed_inp) {
+            tokens.push_back(vocab.id_to_token[id]);
         }
+        for (auto id : result.tokens) {
+            tokens.push_back(vocab.id_to_token[id]);
+        }
+        printf("%s\n\n", gpt_decode(tokens, params.lang).c_str());
 
-        n_past += embed.size();
-        embed.clear();
+        printf("%s: beam search: %d beams, %d steps, score = %.4f\n", __func__, params.n_beams, result.n_steps, result.score);
+        printf("%s:    load time = %8.2f ms\n", __func__, t_load_us/1000.0f);
+        printf("%s:   prompt time = %8.2f ms / %.2f ms per token\n", __func__,
+                result.t_prompt_us/1000.0f, result.t_prompt_us/1000.0f/std::max<size_t>(1, embed_inp.size()));
+        printf("%s:  predict time = %8.2f ms / %.2f beams x tokens/s\n", __func__,
+                result.t_predict_us/1000.0f, result.n_beam_tokens*1e6/std::max<int64_t>(1, result.t_predict_us));
 
-        if (i >= embed_inp.size()) {
-            // sample next token
-            const int   top_k = params.top_k;
-            const float top_p = params.top_p;
-            const float temp  = params.temp;
+        report_profile();
 
-            const int n_vocab = model.hparams.n_vocab;
+        biogpt_context_free(ctx);
+        biogpt_model_free(model);
 
-            biogpt_vocab::id id = 0;
+        return 0;
+    }
 
-            // generation
-            {
-                const int64_t t_start_sample_us = ggml_time_us();
+    // reuse the keys and values of a previous prompt sharing a prefix with this one
+    token_sequence session_tokens;
+    bool session_saved = params.prompt_cache.empty();
+    if (!params.prompt_cache.empty()) {
+        std::mt19937 rng_session;
 
-                id = biogpt_sample_top_k_top_p(vocab, logits.data() + (logits.size() - n_vocab), top_k, top_p, temp, rng);
+        if (biogpt_session_load(params.prompt_cache, *ctx, paged ? &seq : NULL, session_tokens, rng_session)) {
+            size_t n_match = 0;
+            while (n_match < session_tokens.size() && n_match < embed_inp.size() && session_tokens[n_match] == embed_inp[n_match]) {
+                n_match++;
+            }
 
-                t_sample_us += ggml_time_us() - t_start_sample_us;
+            // the last token of the prompt is always evaluated to get its logits
+            seq.n_past = std::min(n_match, embed_inp.size() - 1);
+
+            if (n_match == session_tokens.size()) {
+                rng = rng_session;
             }
 
-            embed.push_back(id);
-        } else {
-            for (size_t k = i; k < embed_inp.size(); k++) {
-                embed.push_back(embed_inp[k]);
-                if (int32_t(embed.size()) >= params.n_batch) {
-                    break;
+            fprintf(stderr, "%s: reusing %d prompt tokens from '%s'\n", __func__, seq.n_past, params.prompt_cache.c_str());
+
+            std::vector<std::string> tokens;
+            for (int k = 0; k < seq.n_past; k++) {
+                tokens.push_back(vocab.id_to_token[embed_inp[k]]);
+            }
+            printf("%s ", gpt_decode(tokens, params.lang).c_str());
+        }
+    }
+
+    biogpt_sampler smpl;
+    if (!biogpt_sampler_init(smpl, biogpt_params_to_sampler(params), model.hparams.n_vocab)) {
+        return 1;
+    }
+
+    // print the prompt as it is evaluated, then the generated tokens
+    auto print_tokens = [&](const token_sequence & embed, bool prompt) {
+        // store the evaluated prompt for the next runs
+        if (prompt && !session_saved && seq.n_past == (int) embed_inp.size()) {
+            if (session_tokens != embed_inp) {
+                if (!biogpt_session_save(params.prompt_cache, *ctx, paged ? &seq : NULL, seq.n_past, embed_inp, rng)) {
+                    fprintf(stderr, "%s: failed to save prompt cache '%s'\n", __func__, params.prompt_cache.c_str());
                 }
             }
-            i += embed.size() - 1;
+            session_saved = true;
         }
 
         std::vector<std::string> tokens;
         for (auto id : embed) {
             tokens.push_back(vocab.id_to_token[id]);
         }
-        std::string decoded_word = gpt_decode(tokens, params.lang);
-        printf("%s ", decoded_word.c_str());
+        printf("%s ", gpt_decode(tokens, params.lang).c_str());
         fflush(stdout);
 
-        // end of text token
-        if (embed.back() == model.hparams.n_vocab) {
-            break;
-        }
+        return true;
+    };
+
+    biogpt_generate_result result;
+    if (!biogpt_generate(*ctx, seq, embed_inp, biogpt_params_to_generate(params), smpl, rng, print_tokens, result)) {
+        printf("Failed to predict\n");
+        return 1;
     }
 
     // report timing
     {
         const int64_t t_main_end_us = ggml_time_us();
 
+        const int n_sample = result.tokens.size();
+        const int n_eval   = result.n_prompt_eval + std::max(0, n_sample - 1);
+
+        const int64_t t_predict_us = result.t_prompt_us + result.t_predict_us;
+
         printf("\n\n");
+        if (result.stop == BIOGPT_STOP_DEADLINE) {
+            printf("%s: stopped at the %d ms deadline\n", __func__, params.timeout_ms);
+        }
         printf("%s:     load time = %8.2f ms\n", __func__, t_load_us/1000.0f);
-        printf("%s:   sample time = %8.2f ms\n", __func__, t_sample_us/1000.0f);
-        printf("%s:  predict time = %8.2f ms / %.2f ms per token\n", __func__, t_predict_us/1000.0f, t_predict_us/1000.0f/n_past);
+        printf("%s:   sample time = %8.2f ms / %.2f us per token\n", __func__, result.t_sample_us/1000.0f, (float) result.t_sample_us/std::max(1, n_sample));
+        printf("%s:  predict time = %8.2f ms / %.2f ms per token\n", __func__, t_predict_us/1000.0f, t_predict_us/1000.0f/std::max(1, n_eval));
         printf("%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
+
+        if (paged) {
+            const int n_used = ctx->kv_pool.n_blocks - (int) ctx->kv_pool.free_blocks.size();
+            printf("%s:  kv blocks used = %d / %d\n", __func__, n_used, ctx->kv_pool.n_blocks);
+        }
     }
 
-    ggml_free(model.ctx);
+    report_profile();
+
+    biogpt_kv_seq_free(ctx->kv_pool, seq);
 
-    ggml_backend_buffer_free(model.buffer_w);
-    ggml_backend_buffer_free(model.buffer_kv);
-    ggml_backend_buffer_free(buf_compute);
-    ggml_backend_free(model.backend);
+    biogpt_context_free(ctx);
+    biogpt_model_free(model);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+
+#include "biogpt.h"
+
+// Answers every question of a file after the same preamble (-p), reusing the keys and values
+// of the longest already evaluated prefix through the prefix cache.
+
+static bool eval_with_eviction(
+           biogpt_context & ctx,
+      biogpt_prefix_cache & cache,
+     const token_sequence & embed,
+            biogpt_kv_seq & seq,
+       std::vector<float> & logits,
+                const int   n_threads) {
+    auto & pool = ctx.kv_pool;
+
+    const int n_blocks = (seq.n_past + (int) embed.size() + pool.block_size - 1)/pool.block_size;
+
+    // new blocks, plus a copy of every block written to that is shared with the cache
+    int n_needed = std::max(0, n_blocks - (int) seq.blocks.size());
+    for (int ib = seq.n_past/pool.block_size; ib < std::min(n_blocks, (int) seq.blocks.size()); ib++) {
+        if (pool.ref_count[seq.blocks[ib]] > 1) {
+            n_needed++;
+        }
+    }
+
+    // make room by dropping cached prefixes first; the blocks the sequence shares are not freed
+    while (n_needed > (int) pool.free_blocks.size() && cache.n_blocks > 0) {
+        biogpt_prefix_cache_evict(cache, pool, n_needed - (int) pool.free_blocks.size());
+    }
+
+    return biogpt_eval_paged(ctx, { embed }, { &seq }, logits, n_threads);
+}
+
+int main(int argc, char **argv) {
+    ggml_time_init();
+
+    const int64_t t_main_start_us = ggml_time_us();
+
+    biogpt_params params;
+    params.n_predict   = 16;
+    params.n_kv_blocks = 512;
+
+    if (biogpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.n_kv_blocks <= 0) {
+        fprintf(stderr, "%s: the prefix cache requires a paged key + value memory (--kv_blocks)\n", __func__);
+        return 1;
+    }
+
+    if (params.n_cache_blocks <= 0) {
+        params.n_cache_blocks = params.n_kv_blocks/2;
+    }
+
+    if (params.seed < 0) {
+        params.seed = time(NULL);
+    }
+
+    std::mt19937 rng(params.seed);
+
+    std::vector<std::string> questions;
+    {
+        std::ifstream fin(params.prompt_file);
+        if (!fin) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.prompt_file.c_str());
+            return 1;
+        }
+
+        std::string line;
+        while (std::getline(fin, line)) {
+            if (!line.empty()) {
+                questions.push_back(line);
+            }
+        }
+    }
+
+    biogpt_vocab vocab;
+    biogpt_model model;
+
+    if (!biogpt_model_load(params.model, model, vocab, params.verbosity)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+        return 1;
+    }
+
+    biogpt_context_params cparams;
+    cparams.n_kv_blocks = params.n_kv_blocks;
+    cparams.n_batch     = params.n_batch;
+    cparams.verbosity   = params.verbosity;
+
+    biogpt_context * ctx = biogpt_context_init(model, cparams);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return 1;
+    }
+
+    biogpt_sampler smpl;
+    if (!biogpt_sampler_init(smpl, biogpt_params_to_sampler(params), model.hparams.n_vocab)) {
+        return 1;
+    }
+
+    biogpt_prefix_cache cache;
+    cache.n_blocks_max = params.n_cache_blocks;
+
+    int64_t t_prompt_us  = 0;
+    int64_t t_predict_us = 0;
+
+    std::vector<float> logits;
+
+    for (size_t q = 0; q < questions.size(); q++) {
+        const token_sequence embed_inp = gpt_tokenize(vocab, params.prompt + " " + questions[q], params.lang);
+
+        const int n_predict = std::min(params.n_predict, model.hparams.n_positions - (int) embed_inp.size());
+        if (n_predict <= 0) {
+            fprintf(stderr, "%s: question %zu is too long, skipping\n", __func__, q);
+            continue;
+        }
+
+        biogpt_kv_seq seq;
+
+        // reuse the longest cached prefix and evaluate the rest of the prompt
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            const int n_reused = biogpt_prefix_cache_lookup(cache, ctx->kv_pool, embed_inp, seq);
+
+            for (int i = n_reused; i < (int) embed_inp.size(); i += params.n_batch) {
+                const int n_eval = std::min(params.n_batch, (int) embed_inp.size() - i);
+
+                token_sequence embed(embed_inp.begin() + i, embed_inp.begin() + i + n_eval);
+                if (!eval_with_eviction(*ctx, cache, embed, seq, logits, params.n_threads)) {
+                    fprintf(stderr, "%s: failed to evaluate question %zu\n", __func__, q);
+                    return 1;
+                }
+            }
+
+            biogpt_prefix_cache_insert(cache, ctx->kv_pool, embed_inp, seq);
+
+            t_prompt_us += ggml_time_us() - t_start_us;
+
+            if (params.verbosity > 0) {
+                fprintf(stderr, "%s: question %zu: %d / %zu prompt tokens reused\n", __func__, q, n_reused, embed_inp.size());
+            }
+        }
+
+        // generate the answer
+        std::vector<std::string> tokens;
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            biogpt_sampler_reset(smpl);
+            for (auto id : embed_inp) {
+                biogpt_sampler_accept(smpl, id);
+            }
+
+            for (int i = 0; i < n_predict; i++) {
+                const biogpt_vocab::id id = biogpt_sampler_sample(smpl, logits.data(), rng);
+                biogpt_sampler_accept(smpl, id);
+
+                // end of text token
+                if (id == 2) {
+                    break;
+                }
+
+                tokens.push_back(vocab.id_to_token[id]);
+
+                if (!eval_with_eviction(*ctx, cache, { id }, seq, logits, params.n_threads)) {
+                    fprintf(stderr, "%s: failed to predict\n", __func__);
+                    return 1;
+                }
+            }
+
+            t_predict_us += ggml_time_us() - t_start_us;
+        }
+
+        printf("%s\t%s\n", questions[q].c_str(), gpt_decode(tokens, params.lang).c_str());
+        fflush(stdout);
+
+        biogpt_kv_seq_free(ctx->kv_pool, seq);
+    }
+
+    // report timing and cache metrics
+    {
+        const int64_t t_main_end_us = ggml_time_us();
+
+        fprintf(stderr, "\n");
+        biogpt_prefix_cache_print_stats(cache);
+        fprintf(stderr, "%s:   prompt time = %8.2f ms / %.2f ms per question\n", __func__, t_prompt_us/1000.0f, t_prompt_us/1000.0f/std::max<size_t>(1, questions.size()));
+        fprintf(stderr, "%s:  predict time = %8.2f ms\n", __func__, t_predict_us/1000.0f);
+        fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
+    }
+
+    biogpt_prefix_cache_clear(cache, ctx->kv_pool);
+
+    biogpt_context_free(ctx);
+    biogpt_model_free(model);
+
+    return 0;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -8,7 +9,10 @@
 static bool biogpt_model_quantize(
         const std::string & fname_inp,
         const std::string & fname_out,
-        ggml_ftype ftype) {
+        ggml_ftype ftype,
+        int n_threads,
+        const std::string & policy,
+        const std::string & fname_importance) {
 
     biogpt_model model;
 
@@ -121,10 +125,23 @@ static bool biogpt_model_quantize(
         }
     }
 
+    // a preset name, or else a rule file
+    std::vector<biogpt_quantize_rule> rules;
+    if (!biogpt_quantize_policy_preset(policy, hparams.n_layer, rules) && !biogpt_quantize_policy_load(policy, rules)) {
+        fprintf(stderr, "%s: invalid quantization policy '%s'\n", __func__, policy.c_str());
+        return false;
+    }
+
+    // the input statistics of the calibration tool
+    biogpt_calibration calib;
+    if (!fname_importance.empty() && !biogpt_calibration_load(fname_importance, calib)) {
+        return false;
+    }
+
     try {
-        biogpt_model_quantize_internal(fin, fout, ftype);
-    } catch(const std::string& err) {
-        fprintf(stderr, "%s: failed to quantize: %s\n", __func__, err.c_str());
+        biogpt_model_quantize_internal(fin, fout, ftype, n_threads, rules, fname_importance.empty() ? NULL : &calib);
+    } catch(const std::exception & err) {
+        fprintf(stderr, "%s: failed to quantize: %s\n", __func__, err.what());
         return false;
     }
 
@@ -137,6 +154,9 @@ static bool biogpt_model_quantize(
 int main(int argc, char **argv) {
     std::string fname_inp, fname_out;
     ggml_ftype ftype;
+    int n_threads = std::max(1, (int) std::thread::hardware_concurrency());
+    std::string policy = "uniform";
+    std::string fname_importance;
 
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
@@ -151,13 +171,19 @@ int main(int argc, char **argv) {
             } catch (const std::string & err) {
                 fprintf(stderr, "error castying file type: %s\n", err.c_str());
             }
+        } else if (arg == "--importance") {
+            fname_importance = argv[++i];
+        } else if (arg == "--policy") {
+            policy = argv[++i];
+        } else if (arg == "--threads") {
+            n_threads = std::max(1, std::stoi(argv[++i]));
         } else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             exit(0);
         }
     }
 
-    biogpt_model_quantize(fname_inp, fname_out, ftype);
+    biogpt_model_quantize(fname_inp, fname_out, ftype, n_threads, policy, fname_importance);
 
     printf("Done.\n");
 
@@ -0,0 +1,798 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "ggml.h"
+
+#include "biogpt.h"
+#include "json.h"
+
+// HTTP inference server: the model is loaded once and shared by a pool of workers, each owning a
+// context. Connections wait in a bounded queue for a free worker and are rejected with 503 once
+// the queue is full. Every response closes its connection.
+//   POST /generate  {"prompt": "...", "n_predict": 64, "stream": true, ...}
+//   POST /score     {"prompt": "...", "choices": ["yes", "no", "maybe"]}
+//   POST /tokenize  {"text": "..."}
+//   GET  /metrics   request, token and latency counters
+//   GET  /metrics/prometheus  the same counters and the phase histograms of the library
+//   GET  /health
+
+#define SERVER_MAX_HEADER        (16*1024)
+#define SERVER_MAX_BODY          (1024*1024)
+#define SERVER_IO_TIMEOUT_S      30
+
+// the contexts are sized for /score requests of up to this many choices and choice tokens
+#define SERVER_MAX_CHOICES       16
+#define SERVER_MAX_CHOICE_TOKENS 64
+
+static std::atomic<bool> g_stop(false);
+
+static void server_sigint_handler(int) {
+    g_stop = true;
+}
+
+static std::string json_tokens(const token_sequence & tokens) {
+    std::string out = "[";
+    for (size_t i = 0; i < tokens.size(); i++) {
+        out += (i > 0 ? ", " : "") + std::to_string(tokens[i]);
+    }
+    out += "]";
+
+    return out;
+}
+
+//
+// HTTP
+//
+
+struct http_request {
+    std::string method;
+    std::string path;
+    std::string body;
+};
+
+static bool send_all(int fd, const char * data, size_t size) {
+    while (size > 0) {
+        const ssize_t n = send(fd, data, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// false once the client has closed its end of the connection
+static bool client_connected(int fd) {
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, 0) <= 0) {
+        return true;
+    }
+    if (pfd.revents & (POLLERR | POLLHUP)) {
+        return false;
+    }
+
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 0;
+}
+
+static bool http_read_request(int fd, http_request & req) {
+    std::string buf;
+    char chunk[4096];
+
+    size_t header_end = std::string::npos;
+    while ((header_end = buf.find("\r\n\r\n")) == std::string::npos) {
+        if (buf.size() > SERVER_MAX_HEADER) {
+            return false;
+        }
+
+        const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf.append(chunk, n);
+    }
+
+    // request line, without the query string
+    const size_t line_end = buf.find("\r\n");
+    {
+        std::stringstream ss(buf.substr(0, line_end));
+        ss >> req.method >> req.path;
+        if (req.method.empty() || req.path.empty()) {
+            return false;
+        }
+        req.path = req.path.substr(0, req.path.find('?'));
+    }
+
+    // headers: only the length of the body matters
+    size_t content_length = 0;
+    for (size_t pos = line_end + 2; pos < header_end; ) {
+        const size_t eol = buf.find("\r\n", pos);
+        const std::string line = buf.substr(pos, eol - pos);
+        pos = eol + 2;
+
+        const size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name == "content-length") {
+            content_length = strtoul(line.c_str() + colon + 1, NULL, 10);
+        }
+    }
+
+    if (content_length > SERVER_MAX_BODY) {
+        return false;
+    }
+
+    req.body = buf.substr(header_end + 4);
+    while (req.body.size() < content_length) {
+        const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        req.body.append(chunk, n);
+    }
+    req.body.resize(content_length);
+
+    return true;
+}
+
+static const char * http_status_text(const int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 503: return "Service Unavailable";
+        default:  return "Internal Server Error";
+    }
+}
+
+static bool http_send(int fd, const int status, const char * content_type, const std::string & body) {
+    std::string resp = "HTTP/1.1 " + std::to_string(status) + " " + http_status_text(status) + "\r\n";
+    resp += "Content-Type: " + std::string(content_type) + "\r\n";
+    resp += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    resp += "Connection: close\r\n\r\n";
+    resp += body;
+
+    return send_all(fd, resp.data(), resp.size());
+}
+
+static bool http_send_json(int fd, const int status, const std::string & body) {
+    return http_send(fd, status, "application/json", body);
+}
+
+static bool http_send_error(int fd, const int status, const std::string & message) {
+    http_send_json(fd, status, "{\"error\": " + json_escape(message) + "}\n");
+    return false;
+}
+
+// one chunk of a response with chunked transfer encoding, an empty chunk ends the response
+static bool http_send_chunk(int fd, const std::string & data) {
+    char size[16];
+    snprintf(size, sizeof(size), "%zx\r\n", data.size());
+
+    return send_all(fd, size, strlen(size)) && send_all(fd, data.data(), data.size()) && send_all(fd, "\r\n", 2);
+}
+
+//
+// server
+//
+
+struct server_metrics {
+    int64_t t_start_us = 0;
+
+    std::atomic<uint64_t> n_requests;
+    std::atomic<uint64_t> n_errors;
+    std::atomic<uint64_t> n_rejected;
+    std::atomic<int>      n_busy;
+
+    std::atomic<uint64_t> n_prompt_tokens;
+    std::atomic<uint64_t> n_generated_tokens;
+    std::atomic<uint64_t> n_generations;
+
+    std::atomic<int64_t>  t_latency_us;      // sum over the requests
+    std::atomic<int64_t>  t_latency_max_us;
+    std::atomic<int64_t>  t_first_token_us;  // sum over the generations
+    std::atomic<int64_t>  t_generate_us;     // sum over the generations
+
+    server_metrics() :
+        n_requests(0), n_errors(0), n_rejected(0), n_busy(0),
+        n_prompt_tokens(0), n_generated_tokens(0), n_generations(0),
+        t_latency_us(0), t_latency_max_us(0), t_first_token_us(0), t_generate_us(0) {}
+};
+
+struct server_worker {
+    biogpt_context * ctx = NULL;
+    biogpt_sampler   smpl;
+    std::thread      thread;
+};
+
+struct server_state {
+    const biogpt_params * params = NULL;
+    const biogpt_model  * model  = NULL;
+    biogpt_vocab        * vocab  = NULL;
+
+    // gpt_tokenize takes the vocabulary by non-const reference
+    std::mutex vocab_mutex;
+
+    // accepted connections waiting for a worker
+    std::mutex              queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<int>         queue;
+    bool                    queue_closed = false;
+
+    // connections queued or being handled, counted when they are admitted
+    int n_inflight = 0;
+
+    server_metrics metrics;
+};
+
+static token_sequence server_tokenize(server_state & state, const std::string & text) {
+    std::lock_guard<std::mutex> lock(state.vocab_mutex);
+    return gpt_tokenize(*state.vocab, text, state.params->lang);
+}
+
+static std::string server_decode(const server_state & state, const token_sequence & tokens) {
+    std::vector<std::string> words;
+    for (auto id : tokens) {
+        words.push_back(state.vocab->id_to_token.at(id));
+    }
+    return gpt_decode(words, state.params->lang);
+}
+
+static const char * server_stop_reason(const biogpt_stop_reason stop) {
+    switch (stop) {
+        case BIOGPT_STOP_EOS:       return "eos";
+        case BIOGPT_STOP_LENGTH:    return "length";
+        case BIOGPT_STOP_CALLBACK:  return "disconnected";
+        case BIOGPT_STOP_DEADLINE:  return "deadline";
+        case BIOGPT_STOP_CANCELLED: return "shutdown";
+        default:                    return "error";
+    }
+}
+
+static void atomic_max(std::atomic<int64_t> & a, const int64_t x) {
+    int64_t cur = a.load();
+    while (x > cur && !a.compare_exchange_weak(cur, x)) {
+    }
+}
+
+static bool server_tokenize_request(server_state & state, int fd, const json_value & req) {
+    std::string text;
+    if (!json_get(req, "text", text)) {
+        return http_send_error(fd, 400, "'text' must be a string");
+    }
+
+    const token_sequence tokens = server_tokenize(state, text);
+
+    return http_send_json(fd, 200, "{\"tokens\": " + json_tokens(tokens) + ", \"n_tokens\": " + std::to_string(tokens.size()) + "}\n");
+}
+
+static bool server_generate(server_state & state, server_worker & worker, int fd, const json_value & req) {
+    const biogpt_params & params = *state.params;
+
+    const int n_positions = state.model->hparams.n_positions;
+
+    std::string prompt;
+    bool        stream     = false;
+    int32_t     seed       = -1;
+    int32_t     timeout_ms = params.timeout_ms;
+
+    biogpt_generate_params gparams = biogpt_params_to_generate(params);
+    biogpt_sampler_params  sparams = biogpt_params_to_sampler(params);
+
+    if (!json_get(req, "prompt", prompt)                 ||
+        !json_get(req, "stream", stream)                 ||
+        !json_get(req, "seed", seed)                     ||
+        !json_get(req, "timeout_ms", timeout_ms)         ||
+        !json_get(req, "n_predict", gparams.n_predict)   ||
+        !json_get(req, "temp", sparams.temp)             ||
+        !json_get(req, "top_k", sparams.top_k)           ||
+        !json_get(req, "top_p", sparams.top_p)           ||
+        !json_get(req, "min_p", sparams.min_p)           ||
+        !json_get(req, "repeat_penalty", sparams.repeat_penalty)) {
+        return http_send_error(fd, 400, "invalid request field");
+    }
+
+    if (prompt.empty()) {
+        return http_send_error(fd, 400, "'prompt' is required");
+    }
+
+    if (!biogpt_sampler_init(worker.smpl, sparams, state.model->hparams.n_vocab)) {
+        return http_send_error(fd, 400, "invalid sampling parameters");
+    }
+
+    const token_sequence tokens = server_tokenize(state, prompt);
+    if ((int) tokens.size() >= n_positions) {
+        return http_send_error(fd, 400, "the prompt is longer than the context");
+    }
+
+    gparams.t_max_us = (int64_t) timeout_ms*1000;
+    gparams.cancel   = &g_stop;
+
+    std::mt19937 rng(seed < 0 ? std::random_device()() : (uint32_t) seed);
+
+    if (stream) {
+        const std::string header =
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/x-ndjson\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Connection: close\r\n\r\n";
+
+        if (!send_all(fd, header.data(), header.size())) {
+            return false;
+        }
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    int64_t t_first_token_us = 0;
+
+    // a client that went away frees the worker at the next token
+    auto on_tokens = [&](const token_sequence & embed, bool is_prompt) {
+        if (is_prompt) {
+            return client_connected(fd);
+        }
+
+        if (t_first_token_us == 0) {
+            t_first_token_us = ggml_time_us() - t_start_us;
+        }
+
+        if (stream) {
+            const std::string line = "{\"token\": " + std::to_string(embed[0]) + ", \"text\": " + json_escape(server_decode(state, embed)) + "}\n";
+            return http_send_chunk(fd, line);
+        }
+
+        return client_connected(fd);
+    };
+
+    biogpt_kv_seq          seq;
+    biogpt_generate_result result;
+
+    const bool ok = biogpt_generate(*worker.ctx, seq, tokens, gparams, worker.smpl, rng, on_tokens, result);
+
+    biogpt_kv_seq_free(worker.ctx->kv_pool, seq);
+
+    const int64_t t_generate_us = ggml_time_us() - t_start_us;
+
+    state.metrics.n_prompt_tokens    += result.n_prompt_eval;
+    state.metrics.n_generated_tokens += result.tokens.size();
+    state.metrics.n_generations      += 1;
+    state.metrics.t_first_token_us   += t_first_token_us;
+    state.metrics.t_generate_us      += t_generate_us;
+
+    if (result.stop == BIOGPT_STOP_CALLBACK) {
+        return true;
+    }
+
+    std::string body = "{";
+    body += "\"text\": "           + json_escape(server_decode(state, result.tokens)) + ", ";
+    body += "\"tokens\": "         + json_tokens(result.tokens) + ", ";
+    body += "\"n_prompt\": "       + std::to_string(tokens.size()) + ", ";
+    body += "\"n_generated\": "    + std::to_string(result.tokens.size()) + ", ";
+    body += "\"stop\": \""         + std::string(server_stop_reason(result.stop)) + "\", ";
+    body += "\"t_prompt_ms\": "    + json_number(result.t_prompt_us/1000.0) + ", ";
+    body += "\"t_generate_ms\": "  + json_number(t_generate_us/1000.0);
+    body += "}\n";
+
+    if (stream) {
+        return http_send_chunk(fd, body) && http_send_chunk(fd, "") && ok;
+    }
+
+    if (!ok) {
+        return http_send_error(fd, 500, "generation failed");
+    }
+
+    return http_send_json(fd, 200, body);
+}
+
+static bool server_score(server_state & state, server_worker & worker, int fd, const json_value & req) {
+    const biogpt_params & params = *state.params;
+
+    const biogpt_context & ctx = *worker.ctx;
+
+    std::string prompt;
+    if (!json_get(req, "prompt", prompt) || prompt.empty()) {
+        return http_send_error(fd, 400, "'prompt' is required");
+    }
+
+    const json_value * choices = req.get("choices");
+    if (choices == NULL || choices->type != json_value::JSON_ARRAY || choices->arr.empty()) {
+        return http_send_error(fd, 400, "'choices' must be a non-empty array of strings");
+    }
+    if ((int) choices->arr.size() > SERVER_MAX_CHOICES) {
+        return http_send_error(fd, 400, "too many choices (at most " + std::to_string(SERVER_MAX_CHOICES) + ")");
+    }
+
+    const token_sequence prompt_tokens = server_tokenize(state, prompt);
+
+    // the choices continue the prompt: drop the </s> that starts every tokenized text
+    std::vector<token_sequence> choice_tokens;
+    size_t n_sum = 0;
+    size_t n_max = 0;
+    for (const auto & choice : choices->arr) {
+        if (choice.type != json_value::JSON_STRING) {
+            return http_send_error(fd, 400, "'choices' must be a non-empty array of strings");
+        }
+
+        token_sequence tokens = server_tokenize(state, choice.str);
+        tokens.erase(tokens.begin());
+        if (tokens.empty()) {
+            return http_send_error(fd, 400, "empty choice");
+        }
+
+        n_sum += tokens.size();
+        n_max  = std::max(n_max, tokens.size());
+        choice_tokens.push_back(tokens);
+    }
+
+    // the choices are evaluated in one batch when paged, one after the other otherwise
+    const bool paged = ctx.kv_pool.n_blocks > 0;
+    if ((int) (paged ? n_sum : n_max) > ctx.cparams.n_batch) {
+        return http_send_error(fd, 400, "the choices are too long");
+    }
+    if ((int) (prompt_tokens.size() + n_max) > state.model->hparams.n_positions) {
+        return http_send_error(fd, 400, "the prompt is longer than the context");
+    }
+
+    std::vector<biogpt_choice_score> scores;
+    if (!biogpt_score_choices(*worker.ctx, prompt_tokens, choice_tokens, scores, params.n_batch, params.n_threads)) {
+        return http_send_error(fd, 500, "scoring failed");
+    }
+
+    state.metrics.n_prompt_tokens += prompt_tokens.size() + n_sum;
+
+    size_t best = 0;
+    std::string body = "{\"scores\": [";
+    for (size_t c = 0; c < scores.size(); c++) {
+        if (scores[c].logprob_norm > scores[best].logprob_norm) {
+            best = c;
+        }
+
+        body += c > 0 ? ", " : "";
+        body += "{\"choice\": "       + json_escape(choices->arr[c].str);
+        body += ", \"logprob\": "      + json_number(scores[c].logprob);
+        body += ", \"logprob_norm\": " + json_number(scores[c].logprob_norm);
+        body += ", \"n_tokens\": "     + std::to_string(scores[c].n_tokens) + "}";
+    }
+    body += "], \"best\": " + json_escape(choices->arr[best].str) + "}\n";
+
+    return http_send_json(fd, 200, body);
+}
+
+static bool server_metrics_request(server_state & state, int fd) {
+    const auto & m = state.metrics;
+
+    size_t n_queued = 0;
+    {
+        std::lock_guard<std::mutex> lock(state.queue_mutex);
+        n_queued = state.queue.size();
+    }
+
+    const uint64_t n_requests    = m.n_requests;
+    const uint64_t n_generations = m.n_generations;
+    const uint64_t n_generated   = m.n_generated_tokens;
+    const int64_t  t_generate_us = m.t_generate_us;
+
+    std::string body = "{";
+    body += "\"uptime_s\": "              + json_number((ggml_time_us() - m.t_start_us)/1e6) + ", ";
+    body += "\"workers\": "               + std::to_string(state.params->n_workers) + ", ";
+    body += "\"busy\": "                  + std::to_string(m.n_busy.load()) + ", ";
+    body += "\"queued\": "                + std::to_string(n_queued) + ", ";
+    body += "\"requests\": "              + std::to_string(n_requests) + ", ";
+    body += "\"errors\": "                + std::to_string(m.n_errors.load()) + ", ";
+    body += "\"rejected\": "              + std::to_string(m.n_rejected.load()) + ", ";
+    body += "\"prompt_tokens\": "         + std::to_string(m.n_prompt_tokens.load()) + ", ";
+    body += "\"generated_tokens\": "      + std::to_string(n_generated) + ", ";
+    body += "\"latency_avg_ms\": "        + json_number(m.t_latency_us/1000.0/std::max<uint64_t>(1, n_requests)) + ", ";
+    body += "\"latency_max_ms\": "        + json_number(m.t_latency_max_us/1000.0) + ", ";
+    body += "\"first_token_avg_ms\": "    + json_number(m.t_first_token_us/1000.0/std::max<uint64_t>(1, n_generations)) + ", ";
+    body += "\"generated_tokens_per_s\": " + json_number(n_generated*1e6/std::max<int64_t>(1, t_generate_us));
+    body += "}\n";
+
+    return http_send_json(fd, 200, body);
+}
+
+// the counters of the server and the phase histograms of the library, in the Prometheus text format
+static bool server_prometheus_request(server_state & state, int fd) {
+    const auto & m = state.metrics;
+
+    size_t n_queued = 0;
+    {
+        std::lock_guard<std::mutex> lock(state.queue_mutex);
+        n_queued = state.queue.size();
+    }
+
+    std::string body;
+    auto metric = [&](const char * name, const char * type, const char * help, const std::string & value) {
+        body += std::string("# HELP ") + name + " " + help + "\n";
+        body += std::string("# TYPE ") + name + " " + type + "\n";
+        body += std::string(name) + " " + value + "\n";
+    };
+
+    metric("biogpt_server_requests_total",         "counter", "Requests read.",                     std::to_string(m.n_requests.load()));
+    metric("biogpt_server_errors_total",           "counter", "Requests that failed.",              std::to_string(m.n_errors.load()));
+    metric("biogpt_server_rejected_total",         "counter", "Connections rejected by a full queue.", std::to_string(m.n_rejected.load()));
+    metric("biogpt_server_prompt_tokens_total",    "counter", "Prompt tokens evaluated.",           std::to_string(m.n_prompt_tokens.load()));
+    metric("biogpt_server_generated_tokens_total", "counter", "Tokens generated.",                  std::to_string(m.n_generated_tokens.load()));
+    metric("biogpt_server_busy_workers",           "gauge",   "Workers handling a request.",        std::to_string(m.n_busy.load()));
+    metric("biogpt_server_queued_connections",     "gauge",   "Connections waiting for a worker.",  std::to_string(n_queued));
+
+    body += biogpt_metrics_prometheus();
+
+    return http_send(fd, 200, "text/plain; version=0.0.4", body);
+}
+
+static void server_handle_connection(server_state & state, server_worker & worker, int fd) {
+    const int64_t t_start_us = ggml_time_us();
+
+    http_request req;
+    if (!http_read_request(fd, req)) {
+        state.metrics.n_errors++;
+        http_send_error(fd, 400, "malformed request");
+        return;
+    }
+
+    state.metrics.n_requests++;
+
+    bool ok = false;
+    if (req.path == "/health" || req.path == "/metrics" || req.path == "/metrics/prometheus") {
+        if (req.method != "GET") {
+            ok = http_send_error(fd, 405, "use GET");
+        } else if (req.path == "/health") {
+            ok = http_send_json(fd, 200, "{\"status\": \"ok\"}\n");
+        } else if (req.path == "/metrics") {
+            ok = server_metrics_request(state, fd);
+        } else {
+            ok = server_prometheus_request(state, fd);
+        }
+    } else if (req.path == "/generate" || req.path == "/score" || req.path == "/tokenize") {
+        json_value body;
+        if (req.method != "POST") {
+            ok = http_send_error(fd, 405, "use POST");
+        } else if (!json_parse(req.body, body) || body.type != json_value::JSON_OBJECT) {
+            ok = http_send_error(fd, 400, "the body must be a JSON object");
+        } else if (req.path == "/generate") {
+            ok = server_generate(state, worker, fd, body);
+        } else if (req.path == "/score") {
+            ok = server_score(state, worker, fd, body);
+        } else {
+            ok = server_tokenize_request(state, fd, body);
+        }
+    } else {
+        ok = http_send_error(fd, 404, "unknown endpoint " + req.path);
+    }
+
+    if (!ok) {
+        state.metrics.n_errors++;
+    }
+
+    const int64_t t_latency_us = ggml_time_us() - t_start_us;
+
+    state.metrics.t_latency_us += t_latency_us;
+    atomic_max(state.metrics.t_latency_max_us, t_latency_us);
+
+    if (state.params->verbosity > 0) {
+        fprintf(stderr, "%s: %s %s %s in %.2f ms\n", __func__, req.method.c_str(), req.path.c_str(), ok ? "ok" : "failed", t_latency_us/1000.0);
+    }
+}
+
+static void server_worker_loop(server_state & state, server_worker & worker) {
+    while (true) {
+        int fd = -1;
+        {
+            std::unique_lock<std::mutex> lock(state.queue_mutex);
+            state.queue_cv.wait(lock, [&] { return state.queue_closed || !state.queue.empty(); });
+            if (state.queue.empty()) {
+                return;
+            }
+
+            fd = state.queue.front();
+            state.queue.pop_front();
+        }
+
+        state.metrics.n_busy++;
+        server_handle_connection(state, worker, fd);
+        state.metrics.n_busy--;
+
+        close(fd);
+
+        {
+            std::lock_guard<std::mutex> lock(state.queue_mutex);
+            state.n_inflight--;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    ggml_time_init();
+
+    biogpt_params params;
+    if (biogpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.n_workers < 1 || params.n_queue < 0) {
+        fprintf(stderr, "%s: invalid number of workers (%d) or queue length (%d)\n", __func__, params.n_workers, params.n_queue);
+        return 1;
+    }
+
+    biogpt_vocab vocab;
+    biogpt_model model;
+
+    if (!biogpt_model_load(params.model, model, vocab, params.verbosity)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+        return 1;
+    }
+
+    // one context per worker, all sharing the weights
+    biogpt_context_params cparams;
+    cparams.n_kv_blocks = params.n_kv_blocks;
+    cparams.n_batch     = std::max(params.n_batch, SERVER_MAX_CHOICE_TOKENS);
+    cparams.n_seq       = params.n_kv_blocks > 0 ? SERVER_MAX_CHOICES : 1;
+    cparams.verbosity   = params.verbosity;
+
+    std::vector<server_worker> workers(params.n_workers);
+    for (auto & worker : workers) {
+        worker.ctx = biogpt_context_init(model, cparams);
+        if (!worker.ctx) {
+            fprintf(stderr, "%s: failed to create the context of a worker\n", __func__);
+            return 1;
+        }
+
+        // the workers' contexts are all the same size
+        cparams.verbosity = 0;
+    }
+
+    int fd_listen = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_listen < 0) {
+        fprintf(stderr, "%s: failed to create a socket: %s\n", __func__, strerror(errno));
+        return 1;
+    }
+
+    {
+        int yes = 1;
+        setsockopt(fd_listen, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(params.port);
+
+        if (inet_pton(AF_INET, params.hostname.c_str(), &addr.sin_addr) != 1) {
+            fprintf(stderr, "%s: invalid IPv4 address '%s'\n", __func__, params.hostname.c_str());
+            return 1;
+        }
+
+        if (bind(fd_listen, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd_listen, 64) < 0) {
+            fprintf(stderr, "%s: failed to listen on %s:%d: %s\n", __func__, params.hostname.c_str(), params.port, strerror(errno));
+            return 1;
+        }
+    }
+
+    signal(SIGINT,  server_sigint_handler);
+    signal(SIGTERM, server_sigint_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    server_state state;
+    state.params = &params;
+    state.model  = &model;
+    state.vocab  = &vocab;
+
+    state.metrics.t_start_us = ggml_time_us();
+
+    // the phase histograms of /metrics/prometheus
+    biogpt_metrics_enable(true);
+
+    for (auto & worker : workers) {
+        worker.thread = std::thread(server_worker_loop, std::ref(state), std::ref(worker));
+    }
+
+    fprintf(stderr, "%s: listening on http://%s:%d with %d workers of %d threads\n", __func__,
+            params.hostname.c_str(), params.port, params.n_workers, params.n_threads);
+
+    while (!g_stop) {
+        struct pollfd pfd;
+        pfd.fd      = fd_listen;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+
+        // wake up regularly to notice a shutdown
+        if (poll(&pfd, 1, 250) <= 0) {
+            continue;
+        }
+
+        const int fd = accept(fd_listen, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        // a stalled client cannot hold a worker forever
+        struct timeval tv;
+        tv.tv_sec  = SERVER_IO_TIMEOUT_S;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        bool queued = false;
+        {
+            std::lock_guard<std::mutex> lock(state.queue_mutex);
+            // n_busy only moves once a worker has woken up, so a burst of accepts is bounded by
+            // the connections admitted so far instead
+            if (state.n_inflight < params.n_workers + params.n_queue) {
+                state.queue.push_back(fd);
+                state.n_inflight++;
+                queued = true;
+            }
+        }
+
+        if (queued) {
+            state.queue_cv.notify_one();
+        } else {
+            state.metrics.n_rejected++;
+            http_send_error(fd, 503, "all workers are busy and the queue is full");
+            close(fd);
+        }
+    }
+
+    fprintf(stderr, "\n%s: shutting down\n", __func__);
+
+    close(fd_listen);
+
+    // the workers cancel their generations (g_stop) and drain the queue
+    {
+        std::lock_guard<std::mutex> lock(state.queue_mutex);
+        state.queue_closed = true;
+    }
+    state.queue_cv.notify_all();
+
+    for (auto & worker : workers) {
+        worker.thread.join();
+        biogpt_context_free(worker.ctx);
+    }
+
+    fprintf(stderr, "%s: %llu requests, %llu errors, %llu rejected, %llu tokens generated\n", __func__,
+            (unsigned long long) state.metrics.n_requests.load(), (unsigned long long) state.metrics.n_errors.load(),
+            (unsigned long long) state.metrics.n_rejected.load(), (unsigned long long) state.metrics.n_generated_tokens.load());
+
+    biogpt_model_free(model);
+
+    return 0;
+}
@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+
+#include "biogpt.h"
+
+// Speculative decoding: a small or quantized draft model proposes n_draft tokens that the target
+// model verifies in a single batched evaluation. Both models must share the same vocabulary.
+
+int main(int argc, char **argv) {
+    ggml_time_init();
+
+    const int64_t t_main_start_us = ggml_time_us();
+
+    biogpt_params params;
+    if (biogpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.model_draft.empty()) {
+        fprintf(stderr, "%s: a draft model is required (-md FNAME)\n", __func__);
+        return 1;
+    }
+
+    if (params.seed < 0) {
+        params.seed = time(NULL);
+    }
+
+    printf("%s: seed = %d\n", __func__, params.seed);
+
+    std::mt19937 rng(params.seed);
+
+    biogpt_vocab vocab;
+    biogpt_vocab vocab_dft;
+
+    biogpt_model model_tgt;
+    biogpt_model model_dft;
+
+    int64_t t_load_us = 0;
+
+    // load the target and the draft models
+    {
+        const int64_t t_start_us = ggml_time_us();
+
+        if (!biogpt_model_load(params.model, model_tgt, vocab, params.verbosity)) {
+            fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+            return 1;
+        }
+
+        if (!biogpt_model_load(params.model_draft, model_dft, vocab_dft, params.verbosity)) {
+            fprintf(stderr, "%s: failed to load draft model from '%s'\n", __func__, params.model_draft.c_str());
+            return 1;
+        }
+
+        if (model_tgt.hparams.n_vocab != model_dft.hparams.n_vocab) {
+            fprintf(stderr, "%s: the draft model vocabulary (%d) differs from the target's (%d)\n",
+                    __func__, model_dft.hparams.n_vocab, model_tgt.hparams.n_vocab);
+            return 1;
+        }
+
+        t_load_us = ggml_time_us() - t_start_us;
+    }
+
+    const int n_vocab = model_tgt.hparams.n_vocab;
+    const int n_draft = params.n_draft;
+
+    const biogpt_vocab::id eos_id = 2;
+
+    // the target context fits the verification batch
+    biogpt_context_params cparams_tgt;
+    cparams_tgt.n_batch   = std::max(params.n_batch, n_draft + 1);
+    cparams_tgt.verbosity = params.verbosity;
+
+    // after a fully accepted draft, the draft evaluates its last token and the bonus token at once
+    biogpt_context_params cparams_dft;
+    cparams_dft.n_batch   = std::max(params.n_batch, 2);
+    cparams_dft.verbosity = params.verbosity;
+
+    biogpt_context * ctx_tgt = biogpt_context_init(model_tgt, cparams_tgt);
+    biogpt_context * ctx_dft = biogpt_context_init(model_dft, cparams_dft);
+    if (!ctx_tgt || !ctx_dft) {
+        fprintf(stderr, "%s: failed to create the contexts\n", __func__);
+        return 1;
+    }
+
+    // tokenize the prompt
+    token_sequence history = gpt_tokenize(vocab, params.prompt, params.lang);
+
+    const int n_prompt = history.size();
+
+    params.n_predict = std::min(params.n_predict, model_tgt.hparams.n_positions - n_prompt - n_draft - 1);
+
+    printf("%s: prompt: '%s'\n", __func__, params.prompt.c_str());
+    printf("%s: number of tokens in prompt = %d\n\n", __func__, n_prompt);
+
+    std::vector<float> logits;
+
+    // evaluate the prompt except for its last token, which starts the first draft
+    int n_past_tgt = 0;
+    int n_past_dft = 0;
+
+    int64_t t_prompt_us = 0;
+    {
+        const int64_t t_start_us = ggml_time_us();
+
+        for (int i = 0; i < n_prompt - 1; i += params.n_batch) {
+            const int n_eval = std::min(params.n_batch, n_prompt - 1 - i);
+
+            token_sequence embed(history.begin() + i, history.begin() + i + n_eval);
+
+            if (!biogpt_eval(*ctx_tgt, embed, logits, n_past_tgt, params.n_threads) ||
+                !biogpt_eval(*ctx_dft, embed, logits, n_past_dft, params.n_threads)) {
+                fprintf(stderr, "%s: failed to evaluate the prompt\n", __func__);
+                return 1;
+            }
+
+            n_past_tgt += n_eval;
+            n_past_dft += n_eval;
+        }
+
+        t_prompt_us = ggml_time_us() - t_start_us;
+    }
+
+    {
+        std::vector<std::string> tokens;
+        for (auto id : history) {
+            tokens.push_back(vocab.id_to_token[id]);
+        }
+        printf("%s ", gpt_decode(tokens, params.lang).c_str());
+        fflush(stdout);
+    }
+
+    int n_generated = 0;
+    int n_drafted   = 0;
+    int n_accepted  = 0;
+    int n_steps     = 0;
+
+    int64_t t_draft_us  = 0;
+    int64_t t_target_us = 0;
+
+    // the logits of the verified rows are read in place from the compute buffer
+    const float * rows = NULL;
+
+    biogpt_eval_opts opts_verify;
+    opts_verify.logits_view = &rows;
+
+    // the draft and the target filter their logits with the same chain
+    biogpt_sampler smpl;
+    if (!biogpt_sampler_init(smpl, biogpt_params_to_sampler(params), n_vocab)) {
+        return 1;
+    }
+
+    std::vector<float> q;  // draft probabilities
+    std::vector<float> p;  // target probabilities
+
+    const int64_t t_gen_start_us = ggml_time_us();
+
+    while (n_generated < params.n_predict) {
+        token_sequence draft;
+
+        // draft n_draft tokens with the draft model
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            q.clear();
+
+            // tokens the draft has not seen yet: the last one and the ones it rolled back
+            token_sequence pending(history.begin() + n_past_dft, history.end());
+
+            for (int i = 0; i < n_draft; i++) {
+                if (!biogpt_eval(*ctx_dft, pending, logits, n_past_dft, params.n_threads)) {
+                    fprintf(stderr, "%s: failed to draft\n", __func__);
+                    return 1;
+                }
+                n_past_dft += pending.size();
+
+                q.resize((i + 1)*n_vocab);
+                biogpt_sampler_probs(smpl, logits.data(), q.data() + i*n_vocab);
+
+                const biogpt_vocab::id id = biogpt_sample_probs(q.data() + i*n_vocab, n_vocab, rng);
+                draft.push_back(id);
+
+                if (id == eos_id) {
+                    break;
+                }
+
+                pending = { id };
+            }
+
+            t_draft_us += ggml_time_us() - t_start_us;
+        }
+
+        // verify the drafts with the target model in one batch
+        token_sequence accepted;
+        int n_accept = 0;
+        {
+            const int64_t t_start_us = ggml_time_us();
+
+            token_sequence embed(history.begin() + n_past_tgt, history.end());
+            embed.insert(embed.end(), draft.begin(), draft.end());
+
+            const int n_rows = draft.size() + 1;
+
+            opts_verify.n_rows = n_rows;
+
+            if (!biogpt_eval(*ctx_tgt, embed, logits, n_past_tgt, params.n_threads, opts_verify)) {
+                fprintf(stderr, "%s: failed to verify\n", __func__);
+                return 1;
+            }
+
+            // the rows follow the last accepted token and every draft
+            n_accept = biogpt_speculative_verify(smpl, rows, q.data(), draft, eos_id, params.n_predict - n_generated, rng, p, accepted);
+
+            t_target_us += ggml_time_us() - t_start_us;
+        }
+
+        // keep the accepted drafts and roll back the key + value memory of the rejected ones
+        history.insert(history.end(), accepted.begin(), accepted.end());
+
+        n_past_tgt = history.size() - 1;
+        n_past_dft = std::min(n_past_dft, n_past_tgt);
+
+        n_generated += accepted.size();
+        n_drafted   += draft.size();
+        n_accepted  += n_accept;
+        n_steps++;
+
+        std::vector<std::string> tokens;
+        for (auto id : accepted) {
+            tokens.push_back(vocab.id_to_token[id]);
+        }
+        printf("%s ", gpt_decode(tokens, params.lang).c_str());
+        fflush(stdout);
+
+        if (accepted.back() == eos_id) {
+            break;
+        }
+    }
+
+    const int64_t t_gen_us = ggml_time_us() - t_gen_start_us;
+
+    // report statistics
+    {
+        const int64_t t_main_end_us = ggml_time_us();
+
+        printf("\n\n");
+        printf("%s: drafted = %d, accepted = %d, acceptance rate = %.2f%%\n", __func__,
+                n_drafted, n_accepted, 100.0f*n_accepted/std::max(1, n_drafted));
+        printf("%s: generated = %d tokens in %d target evaluations (%.2f tokens per evaluation)\n", __func__,
+                n_generated, n_steps, (float) n_generated/std::max(1, n_steps));
+        printf("%s:     load time = %8.2f ms\n", __func__, t_load_us/1000.0f);
+        printf("%s:   prompt time = %8.2f ms\n", __func__, t_prompt_us/1000.0f);
+        printf("%s:    draft time = %8.2f ms\n", __func__, t_draft_us/1000.0f);
+        printf("%s:   target time = %8.2f ms\n", __func__, t_target_us/1000.0f);
+        printf("%s:     effective = %8.2f tokens/s\n", __func__, n_generated*1e6f/std::max<int64_t>(1, t_gen_us));
+        printf("%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
+    }
+
+    biogpt_context_free(ctx_tgt);
+    biogpt_context_free(ctx_dft);
+
+    biogpt_model_free(model_tgt);
+    biogpt_model_free(model_dft);
+
+    return 0;
+}